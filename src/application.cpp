@@ -27,7 +27,7 @@ Texture* texture = nullptr;
 
 float cam_speed = 10;
 
-Application::Application(int window_width, int window_height, SDL_Window* window)
+Application::Application(int window_width, int window_height, SDL_Window* window, const char* scene_filename)
 {
 	this->window_width = window_width;
 	this->window_height = window_height;
@@ -76,7 +76,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 
 
 	scene = new GTR::Scene();
-	if (!scene->load("data/scene.json"))
+	if (!scene->load(scene_filename))
 		exit(1);
 
 	camera->lookAt(scene->main_camera.eye, scene->main_camera.center, Vector3(0, 1, 0));
@@ -261,6 +261,10 @@ void Application::renderDebugGUI(void)
 	ImGui::ColorEdit3("BG color", scene->background_color.v);
 	ImGui::ColorEdit3("Ambient Light", scene->ambient_light.v);
 	ImGui::Combo("Pipeline", (int*) &renderer->pipeline_mode, "FORWARD\0DEFERRED\0", 2);
+	if (ImGui::TreeNode(renderer, "Renderer")) {
+		renderer->renderInMenu();
+		ImGui::TreePop();
+	}
 
 	
 
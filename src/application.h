@@ -33,7 +33,7 @@ public:
 	bool render_wireframe; //in case we want to render everything in wireframe mode
 
 	//constructor
-	Application( int window_width, int window_height, SDL_Window* window );
+	Application( int window_width, int window_height, SDL_Window* window, const char* scene_filename = "data/scene.json" );
 
 	//main functions ans methods
 	void render( void );
@@ -0,0 +1,362 @@
+#include "benchmark.h"
+#include "application.h"
+#include "camera.h"
+#include "mesh.h"
+#include "scene.h"
+#include "renderer.h"
+#include "extra/cJSON.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+//the offscreen context only exists on linux (Mesa), link with -lEGL (or define NO_EGL to use the window)
+#if defined(__linux__) && !defined(NO_EGL)
+	#define USE_EGL
+	#include <EGL/egl.h>
+	#include <EGL/eglext.h>
+#endif
+
+//globals of application.cpp
+extern Camera* camera;
+extern GTR::Scene* scene;
+extern GTR::Renderer* renderer;
+
+Benchmark::Benchmark()
+{
+	scene_filename = "data/scene.json";
+	output_filename = "benchmark.json";
+	width = 900;
+	height = 500;
+	num_frames = 100;
+	warmup_frames = 3;
+	dump_hashes = false;
+	render_frames = mesh_report = false;
+	display = surface = context = NULL;
+}
+
+bool Benchmark::parseArgs(int argc, char** argv)
+{
+	bool enabled = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc && argv[i + 1][0] != '-';
+		if (arg == "--benchmark" || arg == "--mesh-report")
+		{
+			enabled = true;
+			if (arg == "--benchmark")
+				render_frames = true;
+			else
+				mesh_report = true;
+			if (has_value)
+				scene_filename = argv[++i];
+		}
+		else if (arg == "--frames" && has_value)
+			num_frames = std::max(atoi(argv[++i]), 1);
+		else if (arg == "--warmup" && has_value)
+			warmup_frames = std::max(atoi(argv[++i]), 0);
+		else if (arg == "--size" && has_value)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if (arg == "--output" && has_value)
+			output_filename = argv[++i];
+		else if (arg == "--hashes")
+			dump_hashes = true;
+	}
+	return enabled;
+}
+
+bool Benchmark::createContext()
+{
+#ifdef USE_EGL
+	//surfaceless platform of Mesa when there is no display server, the default display otherwise
+	EGLDisplay egl_display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+		egl_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (egl_display == EGL_NO_DISPLAY)
+		egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	EGLint major, minor;
+	if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API))
+	{
+		std::cout << "ERROR: EGL not available" << std::endl;
+		return false;
+	}
+
+	EGLint config_attribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_STENCIL_SIZE, 8, EGL_NONE };
+	EGLConfig config;
+	EGLint num_configs = 0;
+	if (!eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs) || !num_configs)
+	{
+		std::cout << "ERROR: no EGL config with a pbuffer" << std::endl;
+		return false;
+	}
+	EGLint surface_attribs[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+	EGLSurface egl_surface = eglCreatePbufferSurface(egl_display, config, surface_attribs);
+
+	//compatibility profile, same as the window (the framework still uses some fixed pipeline calls)
+	EGLint context_attribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3, EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT, EGL_NONE };
+	EGLContext egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+	if (egl_surface == EGL_NO_SURFACE || egl_context == EGL_NO_CONTEXT || !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
+	{
+		std::cout << "ERROR: the EGL context can't be created" << std::endl;
+		return false;
+	}
+
+	display = egl_display;
+	surface = egl_surface;
+	context = egl_context;
+	std::cout << " * Headless context: " << width << " x " << height << std::endl;
+	std::cout << " * OpenGL Version: " << glGetString(GL_VERSION) << " (" << glGetString(GL_RENDERER) << ")" << std::endl;
+	return true;
+#else
+	std::cout << "ERROR: the headless benchmark needs EGL (linux)" << std::endl;
+	return false;
+#endif
+}
+
+void Benchmark::destroyContext()
+{
+#ifdef USE_EGL
+	if (!display)
+		return;
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+	eglDestroySurface(display, surface);
+	eglTerminate(display);
+	display = surface = context = NULL;
+#endif
+}
+
+void Benchmark::setCamera(Camera* camera, const std::vector<Camera>& path, const Camera& main_camera, float t)
+{
+	Vector3 eye, center;
+	float fov;
+	if (path.size() < 2)
+	{
+		//orbit around the target of the main camera
+		Vector3 offset = main_camera.eye - main_camera.center;
+		float angle = t * 2.0f * PI;
+		eye = main_camera.center + Vector3(offset.x * cos(angle) - offset.z * sin(angle), offset.y, offset.x * sin(angle) + offset.z * cos(angle));
+		center = main_camera.center;
+		fov = main_camera.fov;
+	}
+	else
+	{
+		//catmull-rom between the keys, so the camera doesn't turn suddenly at every key
+		float pos = t * (path.size() - 1);
+		int k = std::min((int)pos, (int)path.size() - 2);
+		float f = pos - k;
+		const Camera& p0 = path[std::max(k - 1, 0)];
+		const Camera& p1 = path[k];
+		const Camera& p2 = path[k + 1];
+		const Camera& p3 = path[std::min(k + 2, (int)path.size() - 1)];
+		float f2 = f * f;
+		float f3 = f2 * f;
+		float w0 = -0.5f * f3 + f2 - 0.5f * f;
+		float w1 = 1.5f * f3 - 2.5f * f2 + 1.0f;
+		float w2 = -1.5f * f3 + 2.0f * f2 + 0.5f * f;
+		float w3 = 0.5f * f3 - 0.5f * f2;
+		eye = p0.eye * w0 + p1.eye * w1 + p2.eye * w2 + p3.eye * w3;
+		center = p0.center * w0 + p1.center * w1 + p2.center * w2 + p3.center * w3;
+		fov = p1.fov + (p2.fov - p1.fov) * f;
+	}
+	camera->lookAt(eye, center, Vector3(0, 1, 0));
+	camera->setPerspective(fov, width / (float)height, camera->near_plane, camera->far_plane);
+}
+
+void Benchmark::renderPath(Application* app, std::vector<sFrame>& frames)
+{
+	frames.resize(num_frames);
+	std::vector<GLuint> queries(num_frames);
+	glGenQueries(num_frames, &queries[0]);
+
+	for (int i = -warmup_frames; i < num_frames; ++i)
+	{
+		setCamera(camera, scene->camera_path, scene->main_camera, std::max(i, 0) / (float)std::max(num_frames - 1, 1));
+		Mesh::num_meshes_rendered = 0;
+		Mesh::num_triangles_rendered = 0;
+
+		auto t0 = std::chrono::high_resolution_clock::now();
+		if (i >= 0)
+			glBeginQuery(GL_TIME_ELAPSED, queries[i]);
+		app->render();
+		if (i >= 0)
+			glEndQuery(GL_TIME_ELAPSED);
+		auto t1 = std::chrono::high_resolution_clock::now();
+		//like the swap of the window, the next frame doesn't start until this one is done
+		glFinish();
+		auto t2 = std::chrono::high_resolution_clock::now();
+		if (i < 0)
+			continue;
+
+		sFrame& frame = frames[i];
+		frame.cpu_ms = std::chrono::duration<float, std::milli>(t1 - t0).count();
+		frame.frame_ms = std::chrono::duration<float, std::milli>(t2 - t0).count();
+		frame.render_calls = renderer->rc_data_list.size();
+		frame.draw_calls = Mesh::num_meshes_rendered;
+		frame.triangles = Mesh::num_triangles_rendered;
+		frame.hash = dump_hashes ? hashScreen() : 0;
+		app->frame++;
+	}
+
+	//the results of the queries are read at the end so they don't stall the frames
+	for (int i = 0; i < num_frames; ++i)
+	{
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+		frames[i].gpu_ms = ns / 1000000.0;
+	}
+	glDeleteQueries(num_frames, &queries[0]);
+}
+
+uint64 Benchmark::hashScreen()
+{
+	//FNV-1a of the pixels of the default framebuffer
+	std::vector<uint8> pixels(width * height * 4);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+	uint64 hash = 14695981039346656037ULL;
+	for (unsigned int i = 0; i < pixels.size(); ++i)
+		hash = (hash ^ pixels[i]) * 1099511628211ULL;
+	return hash;
+}
+
+cJSON* Benchmark::reportMeshes()
+{
+	cJSON* meshes_json = cJSON_CreateArray();
+	double triangles = 0, acmr[2] = { 0, 0 };
+	for (auto it = Mesh::sMeshesLoaded.begin(); it != Mesh::sMeshesLoaded.end(); ++it)
+	{
+		Mesh* mesh = it->second;
+		if (!mesh->getNumIndices())
+			continue;
+		int num_triangles = mesh->getNumIndices() / 3;
+		sVertexCacheStats stats = computeVertexCacheStats(mesh->getIndices(), mesh->getNumIndices(), mesh->getNumVertices());
+		const sVertexCacheStats& imported = mesh->index_stats[1].acmr ? mesh->index_stats[0] : stats; //not optimized, as it is
+		std::cout << " * " << it->first << ": " << num_triangles << " triangles, ACMR " << imported.acmr << " -> " << stats.acmr << ", ATVR " << imported.atvr << " -> " << stats.atvr << std::endl;
+
+		cJSON* mesh_json = cJSON_CreateObject();
+		cJSON_AddItemToObject(mesh_json, "name", cJSON_CreateString(it->first.c_str()));
+		cJSON_AddItemToObject(mesh_json, "vertices", cJSON_CreateNumber(mesh->getNumVertices()));
+		cJSON_AddItemToObject(mesh_json, "triangles", cJSON_CreateNumber(num_triangles));
+		cJSON_AddItemToObject(mesh_json, "optimized", cJSON_CreateBool(mesh->index_stats[1].acmr != 0));
+		cJSON_AddItemToObject(mesh_json, "acmr_imported", cJSON_CreateNumber(imported.acmr));
+		cJSON_AddItemToObject(mesh_json, "atvr_imported", cJSON_CreateNumber(imported.atvr));
+		cJSON_AddItemToObject(mesh_json, "acmr", cJSON_CreateNumber(stats.acmr));
+		cJSON_AddItemToObject(mesh_json, "atvr", cJSON_CreateNumber(stats.atvr));
+		cJSON* lods_json = cJSON_CreateArray();
+		for (unsigned int i = 0; i < mesh->lods.size(); ++i)
+		{
+			cJSON* lod_json = cJSON_CreateObject();
+			cJSON_AddItemToObject(lod_json, "triangles", cJSON_CreateNumber(mesh->lods[i]->getNumIndices() / 3));
+			cJSON_AddItemToObject(lod_json, "error", cJSON_CreateNumber(mesh->lods[i]->lod_error));
+			cJSON_AddItemToArray(lods_json, lod_json);
+		}
+		cJSON_AddItemToObject(mesh_json, "lods", lods_json);
+		cJSON_AddItemToArray(meshes_json, mesh_json);
+		triangles += num_triangles;
+		acmr[0] += imported.acmr * num_triangles;
+		acmr[1] += stats.acmr * num_triangles;
+	}
+	if (triangles)
+		std::cout << " * All the meshes: ACMR " << acmr[0] / triangles << " -> " << acmr[1] / triangles << " (cache of " << INDEXOPT_CACHE_SIZE << " vertices)" << std::endl;
+	return meshes_json;
+}
+
+bool Benchmark::writeResults(const std::vector<sFrame>* results, const char** names, int num_results)
+{
+	cJSON* json = cJSON_CreateObject();
+	cJSON_AddItemToObject(json, "scene", cJSON_CreateString(scene_filename.c_str()));
+	cJSON_AddItemToObject(json, "gl_renderer", cJSON_CreateString((const char*)glGetString(GL_RENDERER)));
+	cJSON_AddItemToObject(json, "width", cJSON_CreateNumber(width));
+	cJSON_AddItemToObject(json, "height", cJSON_CreateNumber(height));
+	cJSON_AddItemToObject(json, "frames", cJSON_CreateNumber(num_frames));
+
+	cJSON* runs_json = cJSON_CreateArray();
+	for (int r = 0; r < num_results; ++r)
+	{
+		const std::vector<sFrame>& frames = results[r];
+		cJSON* run_json = cJSON_CreateObject();
+		cJSON* frames_json = cJSON_CreateArray();
+		double cpu = 0, gpu = 0, total = 0;
+		for (unsigned int i = 0; i < frames.size(); ++i)
+		{
+			const sFrame& frame = frames[i];
+			cJSON* frame_json = cJSON_CreateObject();
+			cJSON_AddItemToObject(frame_json, "cpu_ms", cJSON_CreateNumber(frame.cpu_ms));
+			cJSON_AddItemToObject(frame_json, "gpu_ms", cJSON_CreateNumber(frame.gpu_ms));
+			cJSON_AddItemToObject(frame_json, "frame_ms", cJSON_CreateNumber(frame.frame_ms));
+			cJSON_AddItemToObject(frame_json, "render_calls", cJSON_CreateNumber(frame.render_calls));
+			cJSON_AddItemToObject(frame_json, "draw_calls", cJSON_CreateNumber(frame.draw_calls));
+			cJSON_AddItemToObject(frame_json, "triangles", cJSON_CreateNumber(frame.triangles));
+			if (dump_hashes)
+			{
+				char hash[32];
+				sprintf(hash, "%016llx", (unsigned long long)frame.hash);
+				cJSON_AddItemToObject(frame_json, "hash", cJSON_CreateString(hash));
+			}
+			cJSON_AddItemToArray(frames_json, frame_json);
+			cpu += frame.cpu_ms;
+			gpu += frame.gpu_ms;
+			total += frame.frame_ms;
+		}
+		cpu /= frames.size();
+		gpu /= frames.size();
+		total /= frames.size();
+		std::cout << " * " << names[r] << ": cpu " << cpu << " ms, gpu " << gpu << " ms, frame " << total << " ms" << std::endl;
+
+		cJSON_AddItemToObject(run_json, "pipeline", cJSON_CreateString(names[r]));
+		cJSON_AddItemToObject(run_json, "cpu_ms_avg", cJSON_CreateNumber(cpu));
+		cJSON_AddItemToObject(run_json, "gpu_ms_avg", cJSON_CreateNumber(gpu));
+		cJSON_AddItemToObject(run_json, "frame_ms_avg", cJSON_CreateNumber(total));
+		cJSON_AddItemToObject(run_json, "frames", frames_json);
+		cJSON_AddItemToArray(runs_json, run_json);
+	}
+	cJSON_AddItemToObject(json, "runs", runs_json);
+	if (mesh_report)
+		cJSON_AddItemToObject(json, "meshes", reportMeshes());
+
+	char* text = cJSON_Print(json);
+	FILE* file = fopen(output_filename.c_str(), "wb");
+	if (file)
+	{
+		fwrite(text, 1, strlen(text), file);
+		fclose(file);
+		std::cout << " + Results saved in " << output_filename << std::endl;
+	}
+	else
+		std::cout << "ERROR: can't write " << output_filename << std::endl;
+	free(text);
+	cJSON_Delete(json);
+	return file != NULL;
+}
+
+int Benchmark::run()
+{
+	if (render_frames)
+		std::cout << "Benchmark of " << scene_filename << ": " << num_frames << " frames per pipeline" << std::endl;
+	else
+		std::cout << "Meshes of " << scene_filename << std::endl;
+	if (!createContext())
+		return 1;
+
+	glViewport(0, 0, width, height);
+	Application* app = new Application(width, height, NULL, scene_filename.c_str());
+	app->render_gui = false;
+
+	const GTR::ePipelineMode pipelines[2] = { GTR::FORWARD, GTR::DEFERRED };
+	const char* names[2] = { "FORWARD", "DEFERRED" };
+	std::vector<sFrame> results[2];
+	int num_results = render_frames ? 2 : 0;
+	for (int p = 0; p < num_results; ++p)
+	{
+		renderer->pipeline_mode = pipelines[p];
+		renderPath(app, results[p]);
+	}
+
+	bool saved = writeResults(results, names, num_results);
+	destroyContext();
+	return saved ? 0 : 1;
+}
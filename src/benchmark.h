@@ -0,0 +1,72 @@
+/*	Headless benchmark: renders a scene without a window (offscreen EGL context, works with Mesa llvmpipe)
+	flying the camera path of the scene for some frames with the FORWARD and the DEFERRED pipelines,
+	and writes the CPU and GPU time of every frame to a JSON file.
+	Usage: app --benchmark data/scene.json --frames 100 --size 900x500 --output benchmark.json --hashes
+	--mesh-report adds the vertex cache stats (ACMR/ATVR) of every mesh loaded, as imported and after optimizeIndices,
+	and alone (app --mesh-report data/scene.json) only loads the scene and writes them.
+*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "includes.h"
+#include "framework.h"
+#include <string>
+#include <vector>
+
+class Camera;
+class Application;
+struct cJSON;
+
+class Benchmark
+{
+public:
+	std::string scene_filename;
+	std::string output_filename;
+	int width;
+	int height;
+	int num_frames; //frames of the path for every pipeline
+	int warmup_frames; //rendered before measuring (shaders, shadow maps, render targets)
+	bool dump_hashes; //hash of the image of every frame, to check that an optimization doesn't change the output
+	bool render_frames; //--benchmark
+	bool mesh_report; //--mesh-report
+
+	//result of a frame
+	struct sFrame {
+		float cpu_ms; //time to issue the frame
+		float gpu_ms; //time of the frame in the GPU (timer query)
+		float frame_ms; //until the GPU has finished
+		int render_calls;
+		int draw_calls;
+		long triangles;
+		uint64 hash;
+	};
+
+	Benchmark();
+
+	//true if the arguments ask for the benchmark (--benchmark), reads the options
+	bool parseArgs(int argc, char** argv);
+
+	//creates the context and the application, renders the path and writes the results, returns the exit code of the program
+	int run();
+
+private:
+	void* display; //EGL objects
+	void* surface;
+	void* context;
+
+	bool createContext();
+	void destroyContext();
+
+	//camera at t (0..1) along the path of the scene, or orbiting the main camera if the scene has no path
+	void setCamera(Camera* camera, const std::vector<Camera>& path, const Camera& main_camera, float t);
+
+	//renders the frames with the current pipeline of the renderer
+	void renderPath(Application* app, std::vector<sFrame>& frames);
+
+	uint64 hashScreen();
+	cJSON* reportMeshes();
+	bool writeResults(const std::vector<sFrame>* results, const char** names, int num_results);
+};
+
+#endif
@@ -5,9 +5,11 @@
 #include <iostream>
 
 Camera* Camera::current = NULL;
+int Camera::s_versions = 0;
 
 Camera::Camera()
 {
+	version = 0;
 	lookAt( Vector3(0, 0, 0), Vector3(0, 0, -1), Vector3(0, 1, 0) );
 	setOrthographic(-100,100,-100, 100,-100,100);
 }
@@ -33,9 +35,11 @@ void Camera::enable()
 
 void Camera::updateViewMatrix()
 {
+	Matrix44 prev_viewprojection = viewprojection_matrix;
 	view_matrix.lookAt( eye, center, up );
 	viewprojection_matrix = view_matrix * projection_matrix;
 	extractFrustum();
+	checkChanges(prev_viewprojection);
 }
 
 // ******************************************
@@ -43,6 +47,7 @@ void Camera::updateViewMatrix()
 //Create a projection matrix
 void Camera::updateProjectionMatrix()
 {
+	Matrix44 prev_viewprojection = viewprojection_matrix;
 	if (type == ORTHOGRAPHIC)
 		projection_matrix.ortho(left,right,bottom,top,near_plane,far_plane);
 	else
@@ -51,6 +56,14 @@ void Camera::updateProjectionMatrix()
 	viewprojection_matrix = view_matrix * projection_matrix;
 
 	extractFrustum();
+	checkChanges(prev_viewprojection);
+}
+
+//the matrices are computed again every frame (enable), only a different result is a change
+void Camera::checkChanges(const Matrix44& prev_viewprojection)
+{
+	if (memcmp(prev_viewprojection.m, viewprojection_matrix.m, sizeof(viewprojection_matrix.m)) != 0)
+		version = ++s_versions;
 }
 
 Vector3 Camera::getLocalVector(const Vector3& v)
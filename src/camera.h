@@ -40,6 +40,10 @@ public:
 	Matrix44 projection_matrix;
 	Matrix44 viewprojection_matrix;
 
+	//a new number every time the matrices change (never used by other camera), so a copy of a camera has the same one
+	int version;
+	static int s_versions;
+
 	Camera();
 
 	//set as current
@@ -69,6 +73,9 @@ public:
 	void updateViewMatrix();
 	void updateProjectionMatrix();
 
+	//gives a new version if the viewprojection is not this one anymore
+	void checkChanges(const Matrix44& prev_viewprojection);
+
 	//to work between world and screen coordinates
 	Vector3 project(Vector3 pos3d, float window_width, float window_height); //to project 3D points to screen coordinates
 	Vector3 unproject( Vector3 coord2d, float window_width, float window_height ); //to project screen coordinates to world coordinates
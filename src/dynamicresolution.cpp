@@ -0,0 +1,107 @@
+#include "dynamicresolution.h"
+#include <algorithm>
+#include <cmath>
+
+#define DYNRES_SMOOTHING 0.2f //weight of the new time in the smoothed one
+#define DYNRES_BAND 0.1f //no change while the time is this fraction around the budget
+
+DynamicResolution::DynamicResolution()
+{
+	enabled = false;
+	budget = 16.6f;
+	min_scale = 0.5f;
+	max_scale = 1.0f;
+	scale = 1.0f;
+	gpu_time = 0;
+	num_changes = 0;
+	frame = 0;
+	frames_since_change = 0;
+	restart = true;
+	issued = false;
+	for (int i = 0; i < DYNRES_FRAMES; ++i)
+	{
+		queries[i][0] = queries[i][1] = 0;
+		pending[i] = false;
+	}
+}
+
+DynamicResolution::~DynamicResolution()
+{
+	for (int i = 0; i < DYNRES_FRAMES; ++i)
+		if (queries[i][0])
+			glDeleteQueries(2, queries[i]);
+}
+
+void DynamicResolution::beginFrame()
+{
+	//the oldest frame is read when the GPU has finished it, otherwise it waits for the next time
+	//and this frame is not measured (its queries would overwrite the ones in flight)
+	int index = frame % DYNRES_FRAMES;
+	if (!queries[index][0])
+		glGenQueries(2, queries[index]);
+	if (pending[index])
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(queries[index][1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			issued = false;
+			return;
+		}
+		GLuint64 start = 0, end = 0;
+		glGetQueryObjectui64v(queries[index][0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(queries[index][1], GL_QUERY_RESULT, &end);
+		update((end - start) / 1000000.0f);
+		pending[index] = false;
+	}
+	glQueryCounter(queries[index][0], GL_TIMESTAMP);
+	issued = true;
+}
+
+void DynamicResolution::endFrame()
+{
+	int index = frame % DYNRES_FRAMES;
+	if (issued)
+	{
+		glQueryCounter(queries[index][1], GL_TIMESTAMP);
+		pending[index] = true;
+	}
+	issued = false;
+	frame++;
+	frames_since_change++;
+}
+
+void DynamicResolution::update(float ms)
+{
+	//the frames read just after a change were rendered with the old scale
+	if (frames_since_change < DYNRES_FRAMES)
+		return;
+	gpu_time = restart ? ms : gpu_time + (ms - gpu_time) * DYNRES_SMOOTHING;
+	restart = false;
+	if (!enabled)
+	{
+		scale = max_scale;
+		return;
+	}
+
+	//some frames with the new scale before deciding again
+	if (frames_since_change < DYNRES_FRAMES * 2 || fabs(gpu_time - budget) < budget * DYNRES_BAND)
+		return;
+
+	float target = scale * sqrt(budget / std::max(gpu_time, 0.01f));
+	target = floor(target / DYNRES_STEP + 0.5f) * DYNRES_STEP;
+	target = std::min(std::max(target, min_scale), max_scale);
+	if (target == scale)
+		return;
+	scale = target;
+	frames_since_change = 0;
+	restart = true;
+	num_changes++;
+}
+
+void DynamicResolution::getSize(int width, int height, int& scaled_width, int& scaled_height)
+{
+	float s = enabled ? scale : 1.0f;
+	scaled_width = std::max((int)(width * s), 1);
+	scaled_height = std::max((int)(height * s), 1);
+}
@@ -0,0 +1,48 @@
+#ifndef DYNAMICRESOLUTION_H
+#define DYNAMICRESOLUTION_H
+
+#include "includes.h"
+
+#define DYNRES_FRAMES 4 //frames of queries in flight, the result of a frame is read some frames later without waiting
+#define DYNRES_STEP 0.0625f //the scale changes in steps, so the pool of targets only sees a few sizes
+
+//DynamicResolution
+//measures the time of every frame in the GPU with two timestamps and changes the scale of the render targets
+//to keep it inside a budget. The cost of a frame goes with the pixels (the square of the scale), so the new scale is
+//the current one by the square root of budget / time, only when the time leaves a band around the budget (no oscillation)
+//and a few frames after the last change, when its result can be measured.
+
+class DynamicResolution {
+public:
+	bool enabled;
+	float budget; //ms of the frame in the GPU
+	float min_scale;
+	float max_scale;
+	float scale; //of the width and the height
+
+	//stats
+	float gpu_time; //ms, smoothed
+	int num_changes;
+
+	DynamicResolution();
+	~DynamicResolution();
+
+	//timestamps around the frame, the queries of old frames that have finished are read in beginFrame
+	void beginFrame();
+	void endFrame();
+
+	//size of the targets for a window of this size
+	void getSize(int width, int height, int& scaled_width, int& scaled_height);
+
+private:
+	GLuint queries[DYNRES_FRAMES][2];
+	bool pending[DYNRES_FRAMES];
+	bool issued; //the current frame has its queries, not when the slot of the frame was still waiting for the GPU
+	int frame;
+	int frames_since_change;
+	bool restart; //the smoothed time starts again with the next frame measured
+
+	void update(float ms);
+};
+
+#endif
@@ -121,7 +121,8 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 
 	if (depth_texture)
 	{
-		glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, 0);
+		GLenum attachment = depth_texture->format == GL_DEPTH_STENCIL ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+		glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, attachment, GL_TEXTURE_2D, depth_texture->texture_id, 0);
 		this->depth_texture = depth_texture;
 	}
 	else
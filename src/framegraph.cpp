@@ -0,0 +1,324 @@
+#include "framegraph.h"
+#include <cassert>
+#include <algorithm>
+
+using namespace GTR;
+
+FrameGraph::FrameGraph()
+{
+	frame = 0;
+	num_culled = num_textures = pool_size = memory = memory_no_aliasing = 0;
+}
+
+FrameGraph::~FrameGraph()
+{
+	for (unsigned int i = 0; i < fbos.size(); ++i)
+		delete fbos[i].fbo;
+	for (unsigned int i = 0; i < pool.size(); ++i)
+		delete pool[i].texture;
+}
+
+void FrameGraph::reset()
+{
+	resources.resize(0);
+	passes.resize(0);
+	order.resize(0);
+}
+
+int FrameGraph::createTexture(const char* name, const sTextureDesc& desc)
+{
+	sResource resource;
+	resource.name = name;
+	resource.desc = desc;
+	resource.texture = NULL;
+	resource.imported = false;
+	resource.writer = -1;
+	resource.refs = 0;
+	resource.first_use = resource.last_use = -1;
+	resources.push_back(resource);
+	return resources.size() - 1;
+}
+
+int FrameGraph::importTexture(const char* name, Texture* texture)
+{
+	sTextureDesc desc = { (int)texture->width, (int)texture->height, (int)texture->format, (int)texture->type, (int)texture->internal_format };
+	int handle = createTexture(name, desc);
+	resources[handle].texture = texture;
+	resources[handle].imported = true;
+	return handle;
+}
+
+int FrameGraph::addPass(const char* name, const std::vector<int>& reads, const std::vector<int>& writes, std::function<void()> execute, bool side_effect)
+{
+	sPass pass;
+	pass.name = name;
+	pass.reads = reads;
+	pass.writes = writes;
+	pass.execute = execute;
+	pass.side_effect = side_effect;
+	pass.refs = 0;
+	pass.culled = false;
+	passes.push_back(pass);
+
+	int index = passes.size() - 1;
+	for (unsigned int i = 0; i < writes.size(); ++i)
+	{
+		assert(resources[writes[i]].writer == -1 && "only one pass can write a texture");
+		assert(!resources[writes[i]].imported && "imported textures can't be written");
+		resources[writes[i]].writer = index;
+	}
+	return index;
+}
+
+void FrameGraph::compile()
+{
+	frame++;
+
+	//culling: a pass is removed when nobody reads what it writes, then the same with the passes it read from
+	std::vector<int> unused;
+	for (unsigned int i = 0; i < resources.size(); ++i)
+		resources[i].refs = 0;
+	for (unsigned int i = 0; i < passes.size(); ++i)
+	{
+		passes[i].refs = passes[i].writes.size();
+		passes[i].culled = false;
+		for (unsigned int k = 0; k < passes[i].reads.size(); ++k)
+			resources[passes[i].reads[k]].refs++;
+	}
+	for (unsigned int i = 0; i < passes.size(); ++i)
+		if (!passes[i].refs && !passes[i].side_effect)
+		{
+			passes[i].culled = true;
+			for (unsigned int k = 0; k < passes[i].reads.size(); ++k)
+				resources[passes[i].reads[k]].refs--;
+		}
+	for (unsigned int i = 0; i < resources.size(); ++i)
+		if (!resources[i].refs)
+			unused.push_back(i);
+	while (unused.size())
+	{
+		int writer = resources[unused.back()].writer;
+		unused.pop_back();
+		if (writer == -1)
+			continue;
+		sPass& pass = passes[writer];
+		if (pass.side_effect || pass.culled || --pass.refs > 0)
+			continue;
+		pass.culled = true;
+		for (unsigned int k = 0; k < pass.reads.size(); ++k)
+			if (--resources[pass.reads[k]].refs == 0)
+				unused.push_back(pass.reads[k]);
+	}
+
+	//order: the first pass (as they were added) whose inputs are already written
+	order.resize(0);
+	std::vector<bool> done(passes.size(), false);
+	num_culled = 0;
+	for (unsigned int i = 0; i < passes.size(); ++i)
+		if (passes[i].culled)
+		{
+			done[i] = true;
+			num_culled++;
+		}
+	while (order.size() + num_culled < passes.size())
+	{
+		int next = -1;
+		for (int i = 0; i < (int)passes.size() && next == -1; ++i)
+		{
+			if (done[i])
+				continue;
+			next = i;
+			for (unsigned int k = 0; k < passes[i].reads.size(); ++k)
+			{
+				int writer = resources[passes[i].reads[k]].writer;
+				if (writer != -1 && writer != i && !done[writer])
+					next = -1;
+			}
+		}
+		assert(next != -1 && "the passes have a cycle");
+		if (next == -1)
+			break;
+		done[next] = true;
+		order.push_back(next);
+	}
+
+	//lifetime of every target, from the first pass that uses it to the last one
+	for (unsigned int i = 0; i < resources.size(); ++i)
+	{
+		resources[i].first_use = resources[i].last_use = -1;
+		if (!resources[i].imported)
+			resources[i].texture = NULL;
+	}
+	for (int i = 0; i < (int)order.size(); ++i)
+	{
+		sPass& pass = passes[order[i]];
+		for (int j = 0; j < 2; ++j)
+		{
+			std::vector<int>& used = j == 0 ? pass.writes : pass.reads;
+			for (unsigned int k = 0; k < used.size(); ++k)
+			{
+				sResource& resource = resources[used[k]];
+				if (resource.first_use == -1)
+					resource.first_use = i;
+				resource.last_use = i;
+			}
+		}
+	}
+
+	//aliasing: the texture goes back to the pool after the last pass that uses it
+	for (unsigned int i = 0; i < pool.size(); ++i)
+		pool[i].in_use = false;
+	memory_no_aliasing = 0;
+	for (int i = 0; i < (int)order.size(); ++i)
+	{
+		for (unsigned int r = 0; r < resources.size(); ++r)
+		{
+			sResource& resource = resources[r];
+			if (resource.imported || resource.first_use != i)
+				continue;
+			resource.texture = acquireTexture(resource.desc);
+			memory_no_aliasing += textureBytes(resource.desc);
+		}
+		for (unsigned int r = 0; r < resources.size(); ++r)
+			if (!resources[r].imported && resources[r].last_use == i)
+				releaseTexture(resources[r].texture);
+	}
+
+	freeUnused();
+
+	num_textures = memory = 0;
+	for (unsigned int i = 0; i < pool.size(); ++i)
+		if (pool[i].last_frame == frame)
+		{
+			num_textures++;
+			memory += textureBytes(pool[i].desc);
+		}
+	pool_size = pool.size();
+}
+
+void FrameGraph::execute()
+{
+	for (unsigned int i = 0; i < order.size(); ++i)
+	{
+		sPass& pass = passes[order[i]];
+		if (pass.writes.empty())
+		{
+			pass.execute();
+			continue;
+		}
+		FBO* fbo = getFBO(pass);
+		fbo->bind();
+		pass.execute();
+		fbo->unbind();
+	}
+}
+
+Texture* FrameGraph::getTexture(int handle)
+{
+	assert(handle >= 0 && handle < (int)resources.size());
+	return resources[handle].texture;
+}
+
+Texture* FrameGraph::acquireTexture(const sTextureDesc& desc)
+{
+	for (unsigned int i = 0; i < pool.size(); ++i)
+	{
+		sPooledTexture& pooled = pool[i];
+		if (pooled.in_use || memcmp(&pooled.desc, &desc, sizeof(desc)) != 0)
+			continue;
+		pooled.in_use = true;
+		pooled.last_frame = frame;
+		return pooled.texture;
+	}
+
+	//same parameters as the textures of FBO::create
+	sPooledTexture pooled;
+	pooled.texture = new Texture(desc.width, desc.height, desc.format, desc.type, false, NULL, desc.internal_format);
+	pooled.desc = desc;
+	pooled.in_use = true;
+	pooled.last_frame = frame;
+	if (desc.format != GL_DEPTH_COMPONENT)
+	{
+		Texture* texture = pooled.texture;
+		glBindTexture(texture->texture_type, texture->texture_id);
+		glTexParameteri(texture->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(texture->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(texture->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(texture->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	pool.push_back(pooled);
+	return pooled.texture;
+}
+
+void FrameGraph::releaseTexture(Texture* texture)
+{
+	for (unsigned int i = 0; i < pool.size(); ++i)
+		if (pool[i].texture == texture)
+			pool[i].in_use = false;
+}
+
+//the framebuffers are kept while their textures are in the pool
+FBO* FrameGraph::getFBO(sPass& pass)
+{
+	std::vector<Texture*> textures;
+	Texture* depth = NULL;
+	for (unsigned int i = 0; i < pass.writes.size(); ++i)
+	{
+		Texture* texture = resources[pass.writes[i]].texture;
+		if (texture->format == GL_DEPTH_COMPONENT || texture->format == GL_DEPTH_STENCIL)
+			depth = texture;
+		else
+			textures.push_back(texture);
+	}
+	std::vector<Texture*> key = textures;
+	key.push_back(depth);
+
+	for (unsigned int i = 0; i < fbos.size(); ++i)
+		if (fbos[i].textures == key)
+			return fbos[i].fbo;
+
+	sPassFBO pass_fbo;
+	pass_fbo.fbo = new FBO();
+	pass_fbo.fbo->setTextures(textures, depth);
+	pass_fbo.textures = key;
+	fbos.push_back(pass_fbo);
+	return pass_fbo.fbo;
+}
+
+//deletes the textures not used in the last frames (and their framebuffers), like the ones of an old window size
+void FrameGraph::freeUnused()
+{
+	for (unsigned int i = 0; i < pool.size(); )
+	{
+		if (frame - pool[i].last_frame <= FRAMEGRAPH_MAX_UNUSED_FRAMES)
+		{
+			++i;
+			continue;
+		}
+		Texture* texture = pool[i].texture;
+		for (unsigned int k = 0; k < fbos.size(); )
+		{
+			if (std::find(fbos[k].textures.begin(), fbos[k].textures.end(), texture) == fbos[k].textures.end())
+			{
+				++k;
+				continue;
+			}
+			delete fbos[k].fbo;
+			fbos[k] = fbos.back();
+			fbos.pop_back();
+		}
+		delete texture;
+		pool[i] = pool.back();
+		pool.pop_back();
+	}
+}
+
+int FrameGraph::textureBytes(const sTextureDesc& desc)
+{
+	//packed formats, all the channels in 32 bits
+	if (desc.internal_format == GL_RGB10_A2 || desc.internal_format == GL_R11F_G11F_B10F)
+		return desc.width * desc.height * 4;
+	int channels = desc.format == GL_RGBA ? 4 : (desc.format == GL_RGB ? 3 : (desc.format == GL_RG ? 2 : 1));
+	int bytes = desc.type == GL_UNSIGNED_BYTE ? 1 : (desc.type == GL_HALF_FLOAT ? 2 : 4);
+	return desc.width * desc.height * channels * bytes;
+}
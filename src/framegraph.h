@@ -0,0 +1,110 @@
+#pragma once
+#include "framework.h"
+#include "fbo.h"
+#include "texture.h"
+#include <vector>
+#include <string>
+#include <functional>
+
+namespace GTR {
+
+	#define FRAMEGRAPH_MAX_UNUSED_FRAMES 8 //frames a texture of the pool is kept without being used
+
+	// Passes of a frame declared with the textures they read and write, rebuilt every frame.
+	// compile() removes the passes whose results nobody reads, sorts them by their dependencies and
+	// gives a texture of the pool to every transient target only from the pass that writes it to the last one that reads it,
+	// so targets that are not alive at the same time share the same texture.
+	// The pool and the framebuffers of the passes are kept between frames.
+	class FrameGraph
+	{
+	public:
+		struct sTextureDesc {
+			int width;
+			int height;
+			int format; //GL_RGBA, GL_RGB, GL_DEPTH_COMPONENT, GL_DEPTH_STENCIL
+			int type; //GL_UNSIGNED_BYTE, GL_FLOAT...
+			int internal_format; //0 to let the texture choose it from the format and the type, or GL_RGB10_A2, GL_R11F_G11F_B10F...
+		};
+
+		struct sResource {
+			std::string name;
+			sTextureDesc desc;
+			Texture* texture; //texture of the pool (or the imported one) after compile
+			bool imported; //not owned by the graph, never aliased
+			int writer; //pass that writes it (-1 for imported)
+			int refs; //passes that read it
+			int first_use; //position in the order of the passes
+			int last_use;
+		};
+
+		struct sPass {
+			std::string name;
+			std::vector<int> reads;
+			std::vector<int> writes; //rendered with a framebuffer of these textures
+			std::function<void()> execute;
+			bool side_effect; //renders to the screen (or outside the graph), never culled
+			int refs;
+			bool culled;
+		};
+
+		std::vector<sResource> resources;
+		std::vector<sPass> passes;
+		std::vector<int> order; //passes that are not culled, in the order they are executed
+
+		//stats of the last compile
+		int num_culled;
+		int num_textures; //textures of the pool used this frame
+		int pool_size; //textures of the pool
+		int memory; //bytes of the textures used this frame
+		int memory_no_aliasing; //bytes if every target had its own texture
+
+		FrameGraph();
+		~FrameGraph();
+
+		//removes the passes and resources of the last frame (the pool is kept)
+		void reset();
+
+		//declares a target that only lives during the frame, returns its handle
+		int createTexture(const char* name, const sTextureDesc& desc);
+
+		//a texture owned by someone else, so the passes can declare they read it
+		int importTexture(const char* name, Texture* texture);
+
+		//adds a pass, execute is called with the framebuffer of the writes bound
+		int addPass(const char* name, const std::vector<int>& reads, const std::vector<int>& writes, std::function<void()> execute, bool side_effect = false);
+
+		//culls, sorts and assigns the textures of the pool
+		void compile();
+
+		//runs the passes of order
+		void execute();
+
+		//texture of a resource (only valid after compile)
+		Texture* getTexture(int handle);
+
+		//bytes of a texture with this description
+		static int textureBytes(const sTextureDesc& desc);
+
+	private:
+		struct sPooledTexture {
+			Texture* texture;
+			sTextureDesc desc;
+			int last_frame;
+			bool in_use;
+		};
+		struct sPassFBO {
+			FBO* fbo;
+			std::vector<Texture*> textures;
+		};
+
+		int frame;
+		std::vector<sPooledTexture> pool;
+		std::vector<sPassFBO> fbos;
+
+		Texture* acquireTexture(const sTextureDesc& desc);
+		void releaseTexture(Texture* texture);
+		FBO* getFBO(sPass& pass);
+		void freeUnused();
+	};
+
+};
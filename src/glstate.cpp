@@ -0,0 +1,195 @@
+#include "glstate.h"
+#include "shader.h"
+#include "texture.h"
+
+using namespace GTR;
+
+GLState::GLState()
+{
+	invalidate();
+	resetCounters();
+}
+
+void GLState::invalidate()
+{
+	shader = NULL;
+	active_unit = -1;
+	for (int i = 0; i < GLSTATE_MAX_TEXTURE_UNITS; ++i)
+	{
+		textures[i] = 0;
+		texture_targets[i] = 0;
+		sampler_shaders[i] = NULL;
+		sampler_names[i] = NULL;
+	}
+	blend = -1;
+	blend_src = blend_dst = 0;
+	cull_face = -1;
+	depth_test = -1;
+	depth_func = 0;
+	depth_mask = -1;
+	for (int i = 0; i < UBO_MAX_BINDINGS; ++i)
+	{
+		uniform_buffers[i] = 0;
+		uniform_offsets[i] = -1;
+	}
+}
+
+void GLState::endPass()
+{
+	if (Shader::current)
+		Shader::current->disable();
+	glDisable(GL_BLEND);
+	invalidate();
+}
+
+void GLState::useShader(Shader* shader)
+{
+	if (this->shader == shader && Shader::current == shader)
+	{
+		num_elided++;
+		return;
+	}
+	//force the glUseProgram, the cache knows better than Shader::current
+	Shader::current = NULL;
+	shader->enable();
+	this->shader = shader;
+	num_issued++;
+}
+
+void GLState::setTexture(Shader* shader, const char* varname, Texture* texture, int slot)
+{
+	setTexture(shader, varname, texture->texture_id, texture->texture_type, slot);
+}
+
+void GLState::setTexture(Shader* shader, const char* varname, TBO* tbo, int slot)
+{
+	setTexture(shader, varname, tbo->texture_id, GL_TEXTURE_BUFFER, slot);
+}
+
+void GLState::setTexture(Shader* shader, const char* varname, GLuint texture_id, GLenum target, int slot)
+{
+	assert(slot < GLSTATE_MAX_TEXTURE_UNITS);
+
+	if (textures[slot] != texture_id || texture_targets[slot] != target)
+	{
+		if (active_unit != slot)
+		{
+			glActiveTexture(GL_TEXTURE0 + slot);
+			active_unit = slot;
+			num_issued++;
+		}
+		glBindTexture(target, texture_id);
+		textures[slot] = texture_id;
+		texture_targets[slot] = target;
+		num_issued++;
+	}
+	else
+		num_elided++;
+
+	//the sampler uniform is part of the program state, only needed once per program and slot
+	if (sampler_shaders[slot] != shader || sampler_names[slot] != varname)
+	{
+		shader->setUniform1(varname, slot);
+		sampler_shaders[slot] = shader;
+		sampler_names[slot] = varname;
+		num_issued++;
+	}
+	else
+		num_elided++;
+}
+
+void GLState::setCap(GLenum cap, int& cached, bool enabled)
+{
+	if (cached == (int)enabled)
+	{
+		num_elided++;
+		return;
+	}
+	if (enabled)
+		glEnable(cap);
+	else
+		glDisable(cap);
+	cached = enabled;
+	num_issued++;
+}
+
+void GLState::setBlend(bool enabled)
+{
+	setCap(GL_BLEND, blend, enabled);
+}
+
+void GLState::setBlendFunc(GLenum src, GLenum dst)
+{
+	if (blend_src == src && blend_dst == dst)
+	{
+		num_elided++;
+		return;
+	}
+	glBlendFunc(src, dst);
+	blend_src = src;
+	blend_dst = dst;
+	num_issued++;
+}
+
+void GLState::setCullFace(bool enabled)
+{
+	setCap(GL_CULL_FACE, cull_face, enabled);
+}
+
+void GLState::setDepthTest(bool enabled)
+{
+	setCap(GL_DEPTH_TEST, depth_test, enabled);
+}
+
+void GLState::setDepthFunc(GLenum func)
+{
+	if (depth_func == func)
+	{
+		num_elided++;
+		return;
+	}
+	glDepthFunc(func);
+	depth_func = func;
+	num_issued++;
+}
+
+void GLState::bindUniformBuffer(int binding, UBO* ubo)
+{
+	assert(binding < UBO_MAX_BINDINGS);
+	if (uniform_buffers[binding] == ubo->ubo_id && uniform_offsets[binding] == 0)
+	{
+		num_elided++;
+		return;
+	}
+	ubo->bind(binding);
+	uniform_buffers[binding] = ubo->ubo_id;
+	uniform_offsets[binding] = 0;
+	num_issued++;
+}
+
+//the size is not cached, a block streamed twice at the same offset always has the same size
+void GLState::bindUniformBufferRange(int binding, GLuint buffer, int offset, int size)
+{
+	assert(binding < UBO_MAX_BINDINGS);
+	if (uniform_buffers[binding] == buffer && uniform_offsets[binding] == offset)
+	{
+		num_elided++;
+		return;
+	}
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+	uniform_buffers[binding] = buffer;
+	uniform_offsets[binding] = offset;
+	num_issued++;
+}
+
+void GLState::setDepthMask(bool enabled)
+{
+	if (depth_mask == (int)enabled)
+	{
+		num_elided++;
+		return;
+	}
+	glDepthMask(enabled);
+	depth_mask = enabled;
+	num_issued++;
+}
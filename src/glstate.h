@@ -0,0 +1,63 @@
+#pragma once
+#include "includes.h"
+#include "ubo.h"
+
+class Shader;
+class Texture;
+
+namespace GTR {
+
+	#define GLSTATE_MAX_TEXTURE_UNITS 16
+
+	// Keeps a copy of the GL state changed by the renderer so redundant calls are not sent to the driver.
+	// Anything that changes the state without passing through here (FBOs, toViewport, etc) must be followed by invalidate()
+	class GLState
+	{
+	public:
+		//-1 means unknown, so the next call is always issued
+		Shader* shader;
+		int active_unit;
+		GLuint textures[GLSTATE_MAX_TEXTURE_UNITS];
+		GLenum texture_targets[GLSTATE_MAX_TEXTURE_UNITS];
+		Shader* sampler_shaders[GLSTATE_MAX_TEXTURE_UNITS]; //shader whose sampler uniform already points to this unit
+		const char* sampler_names[GLSTATE_MAX_TEXTURE_UNITS];
+		int blend;
+		GLenum blend_src;
+		GLenum blend_dst;
+		int cull_face;
+		int depth_test;
+		GLenum depth_func;
+		int depth_mask;
+		GLuint uniform_buffers[UBO_MAX_BINDINGS];
+		int uniform_offsets[UBO_MAX_BINDINGS]; //start of the bound range (streamed blocks)
+
+		//stats
+		long num_issued;
+		long num_elided;
+
+		GLState();
+
+		//forget everything, next calls will be issued
+		void invalidate();
+		//leaves the default state (no program, no blending) and forgets everything
+		void endPass();
+		void resetCounters() { num_issued = num_elided = 0; }
+
+		void useShader(Shader* shader);
+		void setTexture(Shader* shader, const char* varname, Texture* texture, int slot);
+		void setTexture(Shader* shader, const char* varname, TBO* tbo, int slot);
+		void setBlend(bool enabled);
+		void setBlendFunc(GLenum src, GLenum dst);
+		void setCullFace(bool enabled);
+		void setDepthTest(bool enabled);
+		void setDepthFunc(GLenum func);
+		void setDepthMask(bool enabled);
+		void bindUniformBuffer(int binding, UBO* ubo);
+		void bindUniformBufferRange(int binding, GLuint buffer, int offset, int size);
+
+	private:
+		void setTexture(Shader* shader, const char* varname, GLuint texture_id, GLenum target, int slot);
+		void setCap(GLenum cap, int& cached, bool enabled);
+	};
+
+};
@@ -213,6 +213,12 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata)
 			if (primitive->indices && primitive->indices->count)
 				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 		}
+		if (Mesh::optimize_indices)
+			mesh->optimizeIndices();
+		if (Mesh::quantize_meshes && mesh->interleaveBuffers())
+			mesh->quantizeBuffers();
+		if (Mesh::generate_lods)
+			mesh->generateLODs();
 		mesh->uploadToVRAM();
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
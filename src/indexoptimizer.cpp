@@ -0,0 +1,240 @@
+#include "indexoptimizer.h"
+#include <algorithm>
+#include <cassert>
+
+//FIFO cache of the GPU, a vertex is in it while less than INDEXOPT_CACHE_SIZE vertices entered after it
+struct sFIFOCache {
+	std::vector<int> time;
+	int timestamp;
+	int misses;
+
+	sFIFOCache(int num_vertices) : time(num_vertices, -INDEXOPT_CACHE_SIZE), timestamp(0), misses(0) {}
+
+	void access(unsigned int v)
+	{
+		if (timestamp - time[v] < INDEXOPT_CACHE_SIZE)
+			return;
+		time[v] = timestamp++;
+		misses++;
+	}
+
+	//empties the cache
+	void reset() { timestamp += INDEXOPT_CACHE_SIZE; }
+};
+
+void optimizeVertexCache(unsigned int* indices, int num_indices, int num_vertices, std::vector<int>* clusters)
+{
+	int num_triangles = num_indices / 3;
+	if (clusters)
+		clusters->resize(0);
+	if (!num_triangles)
+		return;
+
+	//triangles of every vertex, and how many of them are still not emitted
+	std::vector<int> live(num_vertices, 0);
+	std::vector<int> offsets(num_vertices + 1, 0);
+	for (int i = 0; i < num_triangles * 3; ++i)
+		live[indices[i]]++;
+	for (int i = 0; i < num_vertices; ++i)
+		offsets[i + 1] = offsets[i] + live[i];
+	std::vector<int> adjacency(num_triangles * 3);
+	std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+	for (int i = 0; i < num_triangles * 3; ++i)
+		adjacency[fill[indices[i]]++] = i / 3;
+
+	std::vector<int> cache_time(num_vertices, 0);
+	std::vector<bool> emitted(num_triangles, false);
+	std::vector<unsigned int> dead_end; //vertices used lately, to continue from them when the fan has nowhere to go
+	std::vector<unsigned int> candidates;
+	std::vector<unsigned int> result;
+	result.reserve(num_triangles * 3);
+	int timestamp = INDEXOPT_CACHE_SIZE + 1;
+	int cursor = 0; //vertices before it have no triangles left
+
+	//next vertex with triangles: the last ones used, or the first one in the buffer (a new cluster)
+	auto skipDeadEnd = [&]() -> int {
+		while (dead_end.size())
+		{
+			unsigned int v = dead_end.back();
+			dead_end.pop_back();
+			if (live[v] > 0)
+				return v;
+		}
+		for (; cursor < num_vertices; ++cursor)
+			if (live[cursor] > 0)
+				return cursor;
+		return -1;
+	};
+
+	int fan = skipDeadEnd();
+	if (clusters)
+		clusters->push_back(0);
+	while (fan != -1)
+	{
+		//all the triangles around the vertex
+		candidates.resize(0);
+		for (int i = offsets[fan]; i < offsets[fan + 1]; ++i)
+		{
+			int t = adjacency[i];
+			if (emitted[t])
+				continue;
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = indices[t * 3 + k];
+				result.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (timestamp - cache_time[v] > INDEXOPT_CACHE_SIZE)
+					cache_time[v] = timestamp++;
+			}
+			emitted[t] = true;
+		}
+
+		//the vertex of the fan whose triangles will still find it in the cache, the oldest one in the cache first
+		int next = -1;
+		int best = -1;
+		for (unsigned int i = 0; i < candidates.size(); ++i)
+		{
+			unsigned int v = candidates[i];
+			if (live[v] <= 0)
+				continue;
+			int priority = 0;
+			if (timestamp - cache_time[v] + 2 * live[v] <= INDEXOPT_CACHE_SIZE)
+				priority = timestamp - cache_time[v];
+			if (priority > best)
+			{
+				best = priority;
+				next = v;
+			}
+		}
+		if (next == -1)
+		{
+			next = skipDeadEnd();
+			if (next != -1 && clusters)
+				clusters->push_back(result.size() / 3);
+		}
+		fan = next;
+	}
+
+	assert((int)result.size() == num_triangles * 3);
+	std::copy(result.begin(), result.end(), indices);
+}
+
+struct sCluster {
+	int start; //triangles
+	int length;
+	float sort; //distance to the center of the mesh in the direction of its normal
+};
+
+void optimizeOverdraw(unsigned int* indices, int num_indices, int num_vertices, const char* positions, int stride, const std::vector<int>& clusters, float threshold)
+{
+	int num_triangles = num_indices / 3;
+	if (clusters.size() < 1 || !num_triangles)
+		return;
+	#define POSITION(v) (*(const Vector3*)(positions + (v) * stride))
+
+	//more clusters where the cache is as good as in the whole cluster (splitting there costs little)
+	std::vector<sCluster> split;
+	sFIFOCache cache(num_vertices);
+	for (unsigned int c = 0; c < clusters.size(); ++c)
+	{
+		int start = clusters[c];
+		int end = c + 1 < clusters.size() ? clusters[c + 1] : num_triangles;
+		cache.reset();
+		cache.misses = 0;
+		for (int i = start * 3; i < end * 3; ++i)
+			cache.access(indices[i]);
+		float cluster_acmr = cache.misses / (float)(end - start);
+
+		cache.reset();
+		cache.misses = 0;
+		sCluster cluster = { start, 0, 0 };
+		for (int t = start; t < end; ++t)
+		{
+			for (int k = 0; k < 3; ++k)
+				cache.access(indices[t * 3 + k]);
+			cluster.length++;
+			if (t + 1 < end && cache.misses / (float)cluster.length <= cluster_acmr * threshold)
+			{
+				split.push_back(cluster);
+				cluster.start = t + 1;
+				cluster.length = 0;
+				cache.reset();
+				cache.misses = 0;
+			}
+		}
+		split.push_back(cluster);
+	}
+
+	//center of the mesh, weighted by the area of the triangles
+	Vector3 mesh_center(0, 0, 0);
+	float mesh_area = 0;
+	for (int t = 0; t < num_triangles; ++t)
+	{
+		const Vector3& a = POSITION(indices[t * 3]);
+		const Vector3& b = POSITION(indices[t * 3 + 1]);
+		const Vector3& c = POSITION(indices[t * 3 + 2]);
+		float area = (float)(b - a).cross(c - a).length();
+		mesh_center = mesh_center + (a + b + c) * (area / 3.0f);
+		mesh_area += area;
+	}
+	if (mesh_area > 0)
+		mesh_center = mesh_center * (1.0f / mesh_area);
+
+	for (unsigned int c = 0; c < split.size(); ++c)
+	{
+		sCluster& cluster = split[c];
+		Vector3 center(0, 0, 0);
+		Vector3 normal(0, 0, 0);
+		float area = 0;
+		for (int t = cluster.start; t < cluster.start + cluster.length; ++t)
+		{
+			const Vector3& a = POSITION(indices[t * 3]);
+			const Vector3& b = POSITION(indices[t * 3 + 1]);
+			const Vector3& c = POSITION(indices[t * 3 + 2]);
+			Vector3 n = (b - a).cross(c - a); //its length is twice the area
+			float triangle_area = (float)n.length();
+			center = center + (a + b + c) * (triangle_area / 3.0f);
+			normal = normal + n;
+			area += triangle_area;
+		}
+		if (area > 0)
+			center = center * (1.0f / area);
+		float normal_length = (float)normal.length();
+		cluster.sort = normal_length > 0 ? (center - mesh_center).dot(normal) / normal_length : 0;
+	}
+	#undef POSITION
+
+	//the most exterior first, the clusters with the same value keep their order
+	std::stable_sort(split.begin(), split.end(), [](const sCluster& a, const sCluster& b) { return a.sort > b.sort; });
+	std::vector<unsigned int> result;
+	result.reserve(num_triangles * 3);
+	for (unsigned int c = 0; c < split.size(); ++c)
+		result.insert(result.end(), indices + split[c].start * 3, indices + (split[c].start + split[c].length) * 3);
+	std::copy(result.begin(), result.end(), indices);
+}
+
+sVertexCacheStats computeVertexCacheStats(const unsigned int* indices, int num_indices, int num_vertices)
+{
+	sVertexCacheStats stats = { 0, 0 };
+	int num_triangles = num_indices / 3;
+	if (!num_triangles)
+		return stats;
+
+	sFIFOCache cache(num_vertices);
+	std::vector<bool> used(num_vertices, false);
+	int num_used = 0;
+	for (int i = 0; i < num_triangles * 3; ++i)
+	{
+		cache.access(indices[i]);
+		if (!used[indices[i]])
+		{
+			used[indices[i]] = true;
+			num_used++;
+		}
+	}
+	stats.acmr = cache.misses / (float)num_triangles;
+	stats.atvr = cache.misses / (float)num_used;
+	return stats;
+}
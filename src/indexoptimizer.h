@@ -0,0 +1,28 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+#define INDEXOPT_CACHE_SIZE 16 //vertices of the post-transform cache, used by the ordering and by the stats
+#define INDEXOPT_OVERDRAW_THRESHOLD 1.05f //a cluster is split where its ACMR so far is under the one of the whole cluster by this
+
+// Orders the triangles of an index buffer for the GPU, following "Fast Triangle Reordering for Vertex Locality
+// and Reduced Overdraw" (Sander, Nehab, Barczak 2007):
+// optimizeVertexCache (tipsify) emits the triangles around a vertex (a fan) and continues with the vertex of the fan
+// that will still be in the cache, so every vertex is transformed as few times as possible. Where it finds no vertex
+// to continue it starts a new cluster.
+// optimizeOverdraw splits the clusters more where it doesn't hurt the cache and sorts them so the ones facing out
+// of the mesh are drawn first, they usually hide the others (less overdraw with the depth test).
+
+struct sVertexCacheStats {
+	float acmr; //vertices transformed per triangle (0.5 is the best for a grid, 3 is no reuse at all)
+	float atvr; //vertices transformed per vertex used (1 is the best)
+};
+
+//reorders the triangles of indices, clusters gets the first triangle of every cluster
+void optimizeVertexCache(unsigned int* indices, int num_indices, int num_vertices, std::vector<int>* clusters = NULL);
+
+//sorts the clusters of optimizeVertexCache, positions are read every stride bytes
+void optimizeOverdraw(unsigned int* indices, int num_indices, int num_vertices, const char* positions, int stride, const std::vector<int>& clusters, float threshold = INDEXOPT_OVERDRAW_THRESHOLD);
+
+//simulates a FIFO cache of INDEXOPT_CACHE_SIZE vertices
+sVertexCacheStats computeVertexCacheStats(const unsigned int* indices, int num_indices, int num_vertices);
@@ -0,0 +1,125 @@
+#include "jobs.h"
+#include <cassert>
+
+using namespace GTR;
+
+JobPool* JobPool::instance = NULL;
+
+JobPool::JobPool(int num_threads)
+{
+	if (num_threads <= 0)
+		num_threads = std::thread::hardware_concurrency();
+	if (num_threads <= 0)
+		num_threads = 1;
+	this->num_threads = num_threads;
+
+	job = NULL;
+	job_count = 0;
+	job_chunks = 0;
+	generation = 0;
+	next_chunk = 0;
+	chunks_done = 0;
+	quit = false;
+
+	//the caller thread is one of them
+	for (int i = 1; i < num_threads; ++i)
+		workers.push_back(std::thread(&JobPool::workerLoop, this));
+}
+
+JobPool::~JobPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	start_cv.notify_all();
+	for (unsigned int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+JobPool* JobPool::Get()
+{
+	if (!instance)
+		instance = new JobPool();
+	return instance;
+}
+
+void JobPool::runChunks(const tJobFunc* job, int count, int num_chunks, unsigned int generation)
+{
+	//every thread grabs chunks until there are no more, only while the counter belongs to its job
+	while (true)
+	{
+		unsigned long long value = next_chunk.load();
+		int chunk = (int)(value & 0xFFFFFFFF);
+		if ((unsigned int)(value >> 32) != generation || chunk >= num_chunks)
+			break;
+		if (!next_chunk.compare_exchange_weak(value, value + 1))
+			continue;
+		int begin = (int)(((long long)count * chunk) / num_chunks);
+		int end = (int)(((long long)count * (chunk + 1)) / num_chunks);
+		(*job)(begin, end, chunk);
+		if (chunks_done.fetch_add(1) + 1 == num_chunks)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done_cv.notify_all();
+		}
+	}
+}
+
+void JobPool::workerLoop()
+{
+	unsigned int last_generation = 0;
+	while (true)
+	{
+		const tJobFunc* current_job;
+		int count, num_chunks;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_cv.wait(lock, [&] { return quit || generation != last_generation; });
+			if (quit)
+				return;
+			last_generation = generation;
+			current_job = job;
+			count = job_count;
+			num_chunks = job_chunks;
+		}
+		runChunks(current_job, count, num_chunks, last_generation);
+	}
+}
+
+void JobPool::parallelFor(int count, int num_chunks, const tJobFunc& job)
+{
+	if (count <= 0)
+		return;
+	if (num_chunks > count)
+		num_chunks = count;
+	if (num_chunks < 1)
+		num_chunks = 1;
+
+	//not worth waking anybody
+	if (num_chunks == 1 || workers.empty())
+	{
+		for (int i = 0; i < num_chunks; ++i)
+			job((int)(((long long)count * i) / num_chunks), (int)(((long long)count * (i + 1)) / num_chunks), i);
+		return;
+	}
+
+	unsigned int current_generation;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->job = &job;
+		job_count = count;
+		job_chunks = num_chunks;
+		chunks_done = 0;
+		current_generation = ++generation;
+		next_chunk = (unsigned long long)current_generation << 32;
+	}
+	start_cv.notify_all();
+
+	runChunks(&job, count, num_chunks, current_generation);
+
+	//wait until the workers finish their last chunk
+	std::unique_lock<std::mutex> lock(mutex);
+	done_cv.wait(lock, [&] { return chunks_done.load() == job_chunks; });
+	this->job = NULL;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+namespace GTR {
+
+	//function called for every chunk: range [begin, end) of the items and the index of the chunk
+	typedef std::function<void(int begin, int end, int chunk)> tJobFunc;
+
+	// Small pool of persistent worker threads, used to split loops of the renderer across the cores.
+	// The calling thread also works, so num_threads includes it.
+	class JobPool
+	{
+	public:
+		static JobPool* instance;
+
+		int num_threads;
+
+		JobPool(int num_threads = 0); //0 means use all the cores
+		~JobPool();
+
+		//splits [0,count) in num_chunks contiguous chunks (chunk i always gets the same range) and waits until all are done
+		void parallelFor(int count, int num_chunks, const tJobFunc& job);
+
+		static JobPool* Get();
+
+	private:
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable start_cv;
+		std::condition_variable done_cv;
+
+		//current job, the workers copy it under the mutex
+		const tJobFunc* job;
+		int job_count;
+		int job_chunks;
+		unsigned int generation;
+		std::atomic<unsigned long long> next_chunk; //generation in the high 32 bits, so a late worker can't take a chunk of the next job
+		std::atomic<int> chunks_done;
+		bool quit;
+
+		void workerLoop();
+		void runChunks(const tJobFunc* job, int count, int num_chunks, unsigned int generation);
+	};
+
+};
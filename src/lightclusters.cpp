@@ -0,0 +1,323 @@
+#include "lightclusters.h"
+#include "camera.h"
+#include "shader.h"
+#include "scene.h"
+#include "jobs.h"
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define CLUSTERS_SSE
+	#include <xmmintrin.h>
+#endif
+
+using namespace GTR;
+
+//fields of the candidates of a slice (SoA, one array of padded size each)
+enum {
+	CAND_X, CAND_Y, CAND_Z, CAND_R2, CAND_RANGE,
+	CAND_DX, CAND_DY, CAND_DZ, CAND_COS, CAND_SIN, CAND_SPOT,
+	CAND_FIELDS
+};
+
+LightClusters::LightClusters()
+{
+	use_simd = true;
+	num_directional = 0;
+	slice_scale = slice_bias = 0;
+	build_time = 0;
+	num_lights = num_pairs = max_per_cluster = 0;
+	memset(bounds_projection.m, 0, sizeof(bounds_projection.m));
+	grid.resize(CLUSTERS_NUM * 2, 0);
+}
+
+void LightClusters::computeBounds(Camera* camera)
+{
+	Matrix44& proj = camera->projection_matrix;
+	float near_plane = camera->near_plane;
+	float far_plane = camera->far_plane;
+
+	//exponential slices, the ones close to the camera are thinner
+	float log_ratio = log(far_plane / near_plane);
+	slice_scale = CLUSTERS_Z / log_ratio;
+	slice_bias = -CLUSTERS_Z * log(near_plane) / log_ratio;
+	for (int k = 0; k <= CLUSTERS_Z; ++k)
+		slice_near[k] = near_plane * pow(far_plane / near_plane, k / (float)CLUSTERS_Z);
+
+	//view space x at depth d of a ndc x is d * (ndc + M[2][0]) / M[0][0], the same for y
+	for (int k = 0; k < CLUSTERS_Z; ++k)
+	{
+		float d0 = slice_near[k];
+		float d1 = slice_near[k + 1];
+		for (int j = 0; j < CLUSTERS_Y; ++j)
+		for (int i = 0; i < CLUSTERS_X; ++i)
+		{
+			int c = k * CLUSTERS_TILES + j * CLUSTERS_X + i;
+			float ax0 = (-1.0f + 2.0f * i / CLUSTERS_X + proj.M[2][0]) / proj.M[0][0];
+			float ax1 = (-1.0f + 2.0f * (i + 1) / CLUSTERS_X + proj.M[2][0]) / proj.M[0][0];
+			float ay0 = (-1.0f + 2.0f * j / CLUSTERS_Y + proj.M[2][1]) / proj.M[1][1];
+			float ay1 = (-1.0f + 2.0f * (j + 1) / CLUSTERS_Y + proj.M[2][1]) / proj.M[1][1];
+			bounds_min[0][c] = std::min(ax0 * d0, ax0 * d1);
+			bounds_max[0][c] = std::max(ax1 * d0, ax1 * d1);
+			bounds_min[1][c] = std::min(ay0 * d0, ay0 * d1);
+			bounds_max[1][c] = std::max(ay1 * d0, ay1 * d1);
+			bounds_min[2][c] = d0;
+			bounds_max[2][c] = d1;
+
+			Vector3 bmin(bounds_min[0][c], bounds_min[1][c], d0);
+			Vector3 bmax(bounds_max[0][c], bounds_max[1][c], d1);
+			Vector3 center = (bmin + bmax) * 0.5f;
+			sphere[0][c] = center.x;
+			sphere[1][c] = center.y;
+			sphere[2][c] = center.z;
+			sphere[3][c] = (bmax - center).length();
+		}
+	}
+
+	bounds_projection = proj;
+}
+
+void LightClusters::build(Camera* camera, const std::vector<LightEntity*>& lights)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	if (memcmp(bounds_projection.m, camera->projection_matrix.m, sizeof(bounds_projection.m)) != 0)
+		computeBounds(camera);
+
+	//lights to view space (z flipped so it is the depth)
+	Matrix44& view = camera->view_matrix;
+	num_lights = lights.size();
+	num_directional = 0;
+	indices.resize(0);
+	light_ids.resize(0);
+	for (int i = 0; i < 3; ++i)
+	{
+		light_pos[i].resize(0);
+		light_dir[i].resize(0);
+	}
+	light_radius.resize(0);
+	light_cos.resize(0);
+	light_sin.resize(0);
+	light_is_spot.resize(0);
+
+	for (unsigned int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		if (light->light_type == DIRECTIONAL)
+		{
+			indices.push_back(i);
+			num_directional++;
+			continue;
+		}
+		Vector3 pos = view * light->model.getTranslation();
+		Vector3 dir = view.rotateVector(light->model.frontVector());
+		dir.normalize();
+		bool is_spot = light->light_type == SPOT && light->cone_angle < 90;
+		light_ids.push_back(i);
+		light_pos[0].push_back(pos.x);
+		light_pos[1].push_back(pos.y);
+		light_pos[2].push_back(-pos.z);
+		light_radius.push_back(light->max_dist);
+		light_dir[0].push_back(dir.x);
+		light_dir[1].push_back(dir.y);
+		light_dir[2].push_back(-dir.z);
+		light_cos.push_back(is_spot ? cos(light->cone_angle * DEG2RAD) : -1.0f);
+		light_sin.push_back(is_spot ? sin(light->cone_angle * DEG2RAD) : 0.0f);
+		light_is_spot.push_back(is_spot);
+	}
+
+	//every slice is independent
+	JobPool::Get()->parallelFor(CLUSTERS_Z, CLUSTERS_Z, [&](int begin, int end, int chunk) {
+		for (int k = begin; k < end; ++k)
+			buildSlice(k);
+	});
+
+	//merge the lists of the slices in order and move the offsets
+	num_pairs = 0;
+	max_per_cluster = 0;
+	for (int k = 0; k < CLUSTERS_Z; ++k)
+	{
+		uint32 base = indices.size();
+		for (int t = 0; t < CLUSTERS_TILES; ++t)
+		{
+			int c = k * CLUSTERS_TILES + t;
+			grid[c * 2] += base;
+			max_per_cluster = std::max(max_per_cluster, (int)grid[c * 2 + 1]);
+		}
+		indices.insert(indices.end(), slice_indices[k].begin(), slice_indices[k].end());
+		num_pairs += slice_indices[k].size();
+	}
+
+	build_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+}
+
+void LightClusters::buildSlice(int slice)
+{
+	std::vector<uint32>& out = slice_indices[slice];
+	std::vector<uint32>& candidates = slice_candidates[slice];
+	std::vector<float>& scratch = slice_scratch[slice];
+	out.resize(0);
+	candidates.resize(0);
+
+	//lights whose sphere reaches the depth range of the slice
+	float d0 = slice_near[slice];
+	float d1 = slice_near[slice + 1];
+	for (unsigned int i = 0; i < light_ids.size(); ++i)
+		if (light_pos[2][i] + light_radius[i] >= d0 && light_pos[2][i] - light_radius[i] <= d1)
+			candidates.push_back(i);
+
+	int first = slice * CLUSTERS_TILES;
+	if (candidates.empty())
+	{
+		for (int t = 0; t < CLUSTERS_TILES; ++t)
+			grid[(first + t) * 2] = grid[(first + t) * 2 + 1] = 0;
+		return;
+	}
+
+	//SoA copy padded to 4, the padding never passes the sphere test (negative radius^2)
+	int num = candidates.size();
+	int padded = (num + 3) & ~3;
+	scratch.resize(padded * CAND_FIELDS);
+	float* f[CAND_FIELDS];
+	for (int j = 0; j < CAND_FIELDS; ++j)
+		f[j] = &scratch[j * padded];
+	for (int n = 0; n < padded; ++n)
+	{
+		if (n >= num)
+		{
+			for (int j = 0; j < CAND_FIELDS; ++j)
+				f[j][n] = 0;
+			f[CAND_R2][n] = -1;
+			continue;
+		}
+		int i = candidates[n];
+		f[CAND_X][n] = light_pos[0][i];
+		f[CAND_Y][n] = light_pos[1][i];
+		f[CAND_Z][n] = light_pos[2][i];
+		f[CAND_R2][n] = light_radius[i] * light_radius[i];
+		f[CAND_RANGE][n] = light_radius[i];
+		f[CAND_DX][n] = light_dir[0][i];
+		f[CAND_DY][n] = light_dir[1][i];
+		f[CAND_DZ][n] = light_dir[2][i];
+		f[CAND_COS][n] = light_cos[i];
+		f[CAND_SIN][n] = light_sin[i];
+		f[CAND_SPOT][n] = light_is_spot[i] ? 1.0f : 0.0f;
+	}
+
+	for (int t = 0; t < CLUSTERS_TILES; ++t)
+	{
+		int c = first + t;
+		uint32 start = out.size();
+
+		float minx = bounds_min[0][c], miny = bounds_min[1][c], minz = bounds_min[2][c];
+		float maxx = bounds_max[0][c], maxy = bounds_max[1][c], maxz = bounds_max[2][c];
+		float sx = sphere[0][c], sy = sphere[1][c], sz = sphere[2][c], sr = sphere[3][c];
+
+#ifdef CLUSTERS_SSE
+		if (use_simd)
+		{
+			__m128 zero = _mm_setzero_ps();
+			__m128 vminx = _mm_set1_ps(minx), vminy = _mm_set1_ps(miny), vminz = _mm_set1_ps(minz);
+			__m128 vmaxx = _mm_set1_ps(maxx), vmaxy = _mm_set1_ps(maxy), vmaxz = _mm_set1_ps(maxz);
+			__m128 vsx = _mm_set1_ps(sx), vsy = _mm_set1_ps(sy), vsz = _mm_set1_ps(sz), vsr = _mm_set1_ps(sr);
+			__m128 vnsr = _mm_set1_ps(-sr);
+			__m128 half = _mm_set1_ps(0.5f);
+
+			for (int n = 0; n < padded; n += 4)
+			{
+				__m128 x = _mm_loadu_ps(f[CAND_X] + n);
+				__m128 y = _mm_loadu_ps(f[CAND_Y] + n);
+				__m128 z = _mm_loadu_ps(f[CAND_Z] + n);
+
+				//sphere vs aabb: distance from the center to the box
+				__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(vminx, x), _mm_sub_ps(x, vmaxx)), zero);
+				__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(vminy, y), _mm_sub_ps(y, vmaxy)), zero);
+				__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(vminz, z), _mm_sub_ps(z, vmaxz)), zero);
+				__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+				__m128 inside = _mm_cmple_ps(dist2, _mm_loadu_ps(f[CAND_R2] + n));
+				if (_mm_movemask_ps(inside) == 0)
+					continue;
+
+				//cone vs bounding sphere of the cluster, only for spots
+				__m128 vx = _mm_sub_ps(vsx, x);
+				__m128 vy = _mm_sub_ps(vsy, y);
+				__m128 vz = _mm_sub_ps(vsz, z);
+				__m128 v2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+				__m128 v1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_loadu_ps(f[CAND_DX] + n)), _mm_mul_ps(vy, _mm_loadu_ps(f[CAND_DY] + n))), _mm_mul_ps(vz, _mm_loadu_ps(f[CAND_DZ] + n)));
+				__m128 side = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(v2, _mm_mul_ps(v1, v1)), zero));
+				__m128 closest = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(f[CAND_COS] + n), side), _mm_mul_ps(v1, _mm_loadu_ps(f[CAND_SIN] + n)));
+				__m128 culled = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(closest, vsr), _mm_cmpgt_ps(v1, _mm_add_ps(vsr, _mm_loadu_ps(f[CAND_RANGE] + n)))), _mm_cmplt_ps(v1, vnsr));
+				culled = _mm_and_ps(culled, _mm_cmpgt_ps(_mm_loadu_ps(f[CAND_SPOT] + n), half));
+
+				int mask = _mm_movemask_ps(_mm_andnot_ps(culled, inside));
+				for (int b = 0; b < 4; ++b)
+					if (mask & (1 << b))
+						out.push_back(light_ids[candidates[n + b]]);
+			}
+		}
+		else
+#endif
+		{
+			for (int n = 0; n < num; ++n)
+			{
+				float x = f[CAND_X][n], y = f[CAND_Y][n], z = f[CAND_Z][n];
+				float dx = std::max(std::max(minx - x, x - maxx), 0.0f);
+				float dy = std::max(std::max(miny - y, y - maxy), 0.0f);
+				float dz = std::max(std::max(minz - z, z - maxz), 0.0f);
+				if (dx * dx + dy * dy + dz * dz > f[CAND_R2][n])
+					continue;
+				if (f[CAND_SPOT][n] > 0.5f)
+				{
+					float vx = sx - x, vy = sy - y, vz = sz - z;
+					float v2 = vx * vx + vy * vy + vz * vz;
+					float v1 = vx * f[CAND_DX][n] + vy * f[CAND_DY][n] + vz * f[CAND_DZ][n];
+					float closest = f[CAND_COS][n] * sqrt(std::max(v2 - v1 * v1, 0.0f)) - v1 * f[CAND_SIN][n];
+					if (closest > sr || v1 > sr + f[CAND_RANGE][n] || v1 < -sr)
+						continue;
+				}
+				out.push_back(light_ids[candidates[n]]);
+			}
+		}
+
+		//offset inside the slice, build() adds the start of the slice
+		grid[c * 2] = start;
+		grid[c * 2 + 1] = out.size() - start;
+	}
+}
+
+void LightClusters::upload(const void* lights_data, int light_size)
+{
+	if (!lights_tbo.buffer_id)
+	{
+		lights_tbo.create(GL_RGBA32F);
+		grid_tbo.create(GL_RG32UI);
+		indices_tbo.create(GL_R32UI);
+	}
+
+	//the shader can't fetch from empty buffers
+	static const float empty[16] = { 0 };
+	if (num_lights)
+		lights_tbo.update(lights_data, num_lights * light_size);
+	else
+		lights_tbo.update(empty, sizeof(empty));
+	grid_tbo.update(&grid[0], grid.size() * sizeof(uint32));
+	if (indices.size())
+		indices_tbo.update(&indices[0], indices.size() * sizeof(uint32));
+	else
+		indices_tbo.update(empty, sizeof(uint32));
+}
+
+void LightClusters::bind(Shader* shader, int first_unit)
+{
+	lights_tbo.bind(first_unit);
+	shader->setUniform1("u_light_data", first_unit);
+	grid_tbo.bind(first_unit + 1);
+	shader->setUniform1("u_cluster_grid", first_unit + 1);
+	indices_tbo.bind(first_unit + 2);
+	shader->setUniform1("u_light_indices", first_unit + 2);
+	glActiveTexture(GL_TEXTURE0);
+
+	shader->setUniform("u_cluster_slicing", Vector2(slice_scale, slice_bias));
+	shader->setUniform1("u_num_directional", num_directional);
+}
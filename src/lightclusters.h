@@ -0,0 +1,86 @@
+#pragma once
+#include "framework.h"
+#include "ubo.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+class Shader;
+
+namespace GTR {
+
+	class LightEntity;
+
+	//froxel grid: tiles on screen and exponential slices in depth (same values in get_clusters_uniforms)
+	#define CLUSTERS_X 16
+	#define CLUSTERS_Y 9
+	#define CLUSTERS_Z 24
+	#define CLUSTERS_TILES (CLUSTERS_X * CLUSTERS_Y)
+	#define CLUSTERS_NUM (CLUSTERS_TILES * CLUSTERS_Z)
+
+	// Bins the lights of the frame in view space clusters so the deferred pass can shade all of them
+	// in one full-screen quad, every pixel only reads the lights of its cluster.
+	// The culling is done on the CPU (one job per slice), testing 4 lights at once against every cluster.
+	class LightClusters
+	{
+	public:
+		bool use_simd; //SSE sphere/cone tests, otherwise the same tests one light at a time
+
+		//result of build, uploaded to the GPU
+		std::vector<uint32> grid;		//offset and count in indices of every cluster
+		std::vector<uint32> indices;	//directional lights first (they affect every pixel), then the list of every cluster
+		int num_directional;
+
+		//values to get the slice in the shader: slice = log(depth) * slice_scale + slice_bias
+		float slice_scale;
+		float slice_bias;
+
+		//stats
+		float build_time; //ms
+		int num_lights;
+		int num_pairs; //light-cluster pairs
+		int max_per_cluster;
+
+		LightClusters();
+
+		//bins the lights (index in the vector = index in the light buffer)
+		void build(Camera* camera, const std::vector<LightEntity*>& lights);
+
+		//uploads the lists and the data of every light (light_size bytes each)
+		void upload(const void* lights_data, int light_size);
+
+		//binds the buffers and sets the uniforms of get_clusters_uniforms, uses 3 texture units from first_unit
+		void bind(Shader* shader, int first_unit);
+
+	private:
+		//view space bounds of every cluster (z is the positive depth), one SoA block per slice
+		//recomputed only when the projection changes
+		float bounds_min[3][CLUSTERS_NUM];
+		float bounds_max[3][CLUSTERS_NUM];
+		float sphere[4][CLUSTERS_NUM]; //bounding sphere, used for the cone test
+		float slice_near[CLUSTERS_Z + 1];
+		Matrix44 bounds_projection;
+
+		//view space lights, SoA
+		std::vector<float> light_pos[3];
+		std::vector<float> light_radius;
+		std::vector<float> light_dir[3];
+		std::vector<float> light_cos;
+		std::vector<float> light_sin;
+		std::vector<int> light_is_spot;
+		std::vector<uint32> light_ids; //non directional lights
+
+		//output of every slice, merged after the jobs
+		std::vector<uint32> slice_indices[CLUSTERS_Z];
+		std::vector<float> slice_scratch[CLUSTERS_Z]; //lights touching the slice, SoA padded to 4
+		std::vector<uint32> slice_candidates[CLUSTERS_Z];
+
+		TBO lights_tbo;
+		TBO grid_tbo;
+		TBO indices_tbo;
+
+		void computeBounds(Camera* camera);
+		void buildSlice(int slice);
+	};
+
+};
@@ -15,6 +15,7 @@
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "benchmark.h"
 
 #include <iostream> //to output
 
@@ -212,6 +213,11 @@ void mainLoop(SDL_Window* window)
 
 int main(int argc, char **argv)
 {
+	//headless mode for the machines without display: renders the camera path offscreen and saves the timings
+	Benchmark benchmark;
+	if (benchmark.parseArgs(argc, argv))
+		return benchmark.run();
+
 	std::cout << "Initiating app..." << std::endl;
 
 	//prepare SDL
@@ -3,10 +3,13 @@
 
 #include "includes.h"
 #include "texture.h"
+#include "ubo.h"
+#include "prefab.h"
 
 using namespace GTR;
 
 std::map<std::string, Material*> Material::sMaterials;
+int Material::s_num_materials = 0;
 
 Material* Material::Get(const char* name)
 {
@@ -32,6 +35,8 @@ void Material::registerMaterial(const char* name)
 
 Material::~Material()
 {
+	if (ubo)
+		delete ubo;
 	if (name.size())
 	{
 		auto it = sMaterials.find(name);
@@ -40,6 +45,13 @@ Material::~Material()
 	}
 }
 
+void Material::fillBlock(sMaterialBlock& block)
+{
+	block.color = color;
+	block.emissive_factor = emissive_factor;
+	block.alpha_cutoff = alpha_mode == MASK ? alpha_cutoff : 0;
+}
+
 void Material::Release()
 {
 	std::vector<Material *>mats;
@@ -63,7 +75,8 @@ void Material::renderInMenu()
 #ifndef SKIP_IMGUI
 	ImGui::Text("Name: %s", name.c_str()); // Show String
 	ImGui::Checkbox("Two sided", &two_sided);
-	ImGui::Combo("AlphaMode", (int*)&alpha_mode, "NO_ALPHA\0MASK\0BLEND", 3);
+	if (ImGui::Combo("AlphaMode", (int*)&alpha_mode, "NO_ALPHA\0MASK\0BLEND", 3))
+		Node::s_edits++; //the order of the render calls depends on it
 	ImGui::SliderFloat("Alpha Cutoff", &alpha_cutoff, 0.0f, 1.0f);
 	ImGui::ColorEdit4("Color", color.v); // Edit 4 floats representing a color + alpha
 	ImGui::ColorEdit3("Emissive", emissive_factor.v);
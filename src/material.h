@@ -8,6 +8,7 @@
 //forward declaration
 class Mesh;
 class Texture;
+class UBO;
 
 namespace GTR {
 
@@ -29,6 +30,13 @@ namespace GTR {
 		DISPLACEMENT
 	};
 
+	//material factors as stored in the MaterialBlock of the shaders (std140)
+	struct sMaterialBlock {
+		Vector4 color;
+		Vector3 emissive_factor;
+		float alpha_cutoff;
+	};
+
 	struct Sampler {
 		Texture* texture;
 		int uv_channel;
@@ -45,6 +53,9 @@ namespace GTR {
 		std::string name;
 		void registerMaterial(const char* name);
 
+		static int s_num_materials;
+		int id; //unique number, used to sort the render calls by material
+
 		//parameters to control transparency
 		eAlphaMode alpha_mode;	//could be NO_ALPHA, MASK (alpha cut) or BLEND (alpha blend)
 		float alpha_cutoff;		//pixels with alpha than this value shouldnt be rendered
@@ -68,8 +79,14 @@ namespace GTR {
 		Sampler occlusion_texture;	//which areas receive ambient light
 		Sampler normal_texture;	//normalmap
 
+		//uniform buffer with the factors, only uploaded again when they change
+		UBO* ubo;
+		sMaterialBlock ubo_data;
+
 		//ctors
 		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
+			id = s_num_materials++;
+			ubo = NULL;
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 		}
 		Material(Texture* texture) : Material() { 
@@ -81,6 +98,9 @@ namespace GTR {
 
 		void renderInMenu();
 
+		//fills the block with the current factors
+		void fillBlock(sMaterialBlock& block);
+
 
 	};
 
@@ -4,10 +4,14 @@
 #include "shader.h"
 #include "includes.h"
 #include "framework.h"
+#include "ringbuffer.h"
+#include "indexoptimizer.h"
+#include "meshsimplifier.h"
 
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <unordered_map>
 #include <sys/stat.h>
 
 #include "camera.h"
@@ -20,10 +24,15 @@
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::weld_meshes = true;			//the triangle soups of OBJ and ASE are indexed when loaded
+bool Mesh::optimize_indices = true;		//sorts the triangles of indexed meshes when loaded
+bool Mesh::quantize_meshes = false;		//compact vertices for the loaded interleaved meshes
+bool Mesh::generate_lods = true;		//simplified levels of detail for the loaded indexed meshes
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+int Mesh::s_num_meshes = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -33,8 +42,10 @@ long Mesh::num_triangles_rendered = 0;
 Mesh::Mesh()
 {
 	radius = 0;
+	id = s_num_meshes++;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
 	collision_model = NULL;
+	mapped_file = NULL;
 
 	clear();
 }
@@ -99,9 +110,26 @@ void Mesh::clear()
 	colors.clear();
 	interleaved.clear();
 	m_indices.clear();
+	memset(index_stats, 0, sizeof(index_stats));
+	delete mapped_file;
+	mapped_file = NULL;
+	mapped_interleaved = mapped_quantized = false;
+	memset(mapped_offsets, 0, sizeof(mapped_offsets));
+	memset(mapped_bytes, 0, sizeof(mapped_bytes));
 	bones.clear();
 	weights.clear();
 	m_uvs1.clear();
+	quantized.clear();
+	quantized_colors.clear();
+	quantized_weights.clear();
+	quantization_offset.set(0, 0, 0);
+	quantization_scale.set(1, 1, 1);
+	for (unsigned int i = 0; i < lods.size(); ++i)
+		delete lods[i];
+	lods.clear();
+	lod_level = 0;
+	lod_error = 0;
+	lod_base_indices = 0;
 
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
@@ -115,6 +143,22 @@ int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
 
+//meshes that are not in VRAM (debug geometry) copy their arrays to the streaming buffer every draw
+static const void* streamArray(const void* data, int size)
+{
+	RingBuffer* ring = RingBuffer::Get();
+	int offset = ring->upload(data, size);
+	glBindBuffer(GL_ARRAY_BUFFER, ring->buffer_id);
+	return (const void*)(size_t)offset;
+}
+
+unsigned int Mesh::getNumVertices()
+{
+	if (mapped_file)
+		return mapped_bytes[STREAM_VERTICES] / (mapped_interleaved ? sizeof(tInterleaved) : sizeof(Vector3));
+	return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size();
+}
+
 void Mesh::enableBuffers(Shader* sh)
 {
 	vertex_location = sh->getAttribLocation("a_vertex");
@@ -128,14 +172,28 @@ void Mesh::enableBuffers(Shader* sh)
 	int offset_normal = 0;
 	int offset_uv = 0;
 
-	if (interleaved.size())
+	if (isInterleaved())
 	{
 		spacing = sizeof(tInterleaved);
 		offset_normal = sizeof(Vector3);
 		offset_uv = sizeof(Vector3) + sizeof(Vector3);
 	}
 
-	if (vertex_location != -1)
+	//compact vertices (quantizeBuffers), the shader goes back to floats with the scale and the offset of the mesh
+	bool quantized_layout = isQuantized();
+	sh->setUniform("u_vertex_scale", quantized_layout ? Vector4(quantization_scale.x, quantization_scale.y, quantization_scale.z, 1.0f) : Vector4(1, 1, 1, 0));
+	sh->setUniform("u_vertex_offset", quantized_layout ? quantization_offset : Vector3(0, 0, 0));
+
+	//the interleaved array is streamed once for all its attributes
+	int interleaved_offset = -1;
+	auto streamInterleaved = [&](int attribute_offset) -> const void* {
+		if (interleaved_offset == -1)
+			interleaved_offset = (int)(size_t)streamArray(&interleaved[0], interleaved.size() * sizeof(tInterleaved));
+		glBindBuffer(GL_ARRAY_BUFFER, RingBuffer::Get()->buffer_id);
+		return (const void*)(size_t)(interleaved_offset + attribute_offset);
+	};
+
+	if (vertex_location != -1 && !quantized_layout)
 	{
 		glEnableVertexAttribArray(vertex_location);
 		if (vertices_vbo_id || interleaved_vbo_id)
@@ -144,12 +202,12 @@ void Mesh::enableBuffers(Shader* sh)
 			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, 0);
 		}
 		else
-			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].vertex : &vertices[0]);
+			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? streamInterleaved(0) : streamArray(&vertices[0], vertices.size() * sizeof(Vector3)));
 		checkGLErrors();
 	}
 
 	normal_location = -1;
-	if (normals.size() || spacing)
+	if (!quantized_layout && (normals.size() || normals_vbo_id || spacing))
 	{
 		normal_location = sh->getAttribLocation("a_normal");
 		if (normal_location != -1)
@@ -161,13 +219,13 @@ void Mesh::enableBuffers(Shader* sh)
 				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
 			}
 			else
-				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].normal : &normals[0]);
+				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? streamInterleaved(offset_normal) : streamArray(&normals[0], normals.size() * sizeof(Vector3)));
 		}
 		checkGLErrors();
 	}
 
 	uv_location = -1;
-	if (uvs.size() || spacing)
+	if (!quantized_layout && (uvs.size() || uvs_vbo_id || spacing))
 	{
 		uv_location = sh->getAttribLocation("a_coord");
 		if (uv_location != -1)
@@ -179,13 +237,41 @@ void Mesh::enableBuffers(Shader* sh)
 				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
 			}
 			else
-				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].uv : &uvs[0]);
+				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? streamInterleaved(offset_uv) : streamArray(&uvs[0], uvs.size() * sizeof(Vector2)));
+		}
+		checkGLErrors();
+	}
+
+	//snorm16 positions, octahedral snorm8 normals and half float uvs
+	if (quantized_layout)
+	{
+		const char* base = NULL;
+		if (interleaved_vbo_id)
+			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id);
+		else
+			base = (const char*)streamArray(&quantized[0], quantized.size() * sizeof(tQuantized));
+		normal_location = sh->getAttribLocation("a_normal");
+		uv_location = sh->getAttribLocation("a_coord");
+		if (vertex_location != -1)
+		{
+			glEnableVertexAttribArray(vertex_location);
+			glVertexAttribPointer(vertex_location, 3, GL_SHORT, GL_TRUE, sizeof(tQuantized), base + offsetof(tQuantized, vertex));
+		}
+		if (normal_location != -1)
+		{
+			glEnableVertexAttribArray(normal_location);
+			glVertexAttribPointer(normal_location, 2, GL_BYTE, GL_TRUE, sizeof(tQuantized), base + offsetof(tQuantized, normal));
+		}
+		if (uv_location != -1)
+		{
+			glEnableVertexAttribArray(uv_location);
+			glVertexAttribPointer(uv_location, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(tQuantized), base + offsetof(tQuantized, uv));
 		}
 		checkGLErrors();
 	}
 
 	uv1_location = -1;
-	if (m_uvs1.size())
+	if (m_uvs1.size() || uvs1_vbo_id)
 	{
 		uv1_location = sh->getAttribLocation("a_coord1");
 		if (uv1_location != -1)
@@ -197,31 +283,37 @@ void Mesh::enableBuffers(Shader* sh)
 				glVertexAttribPointer(uv1_location, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
 			}
 			else
-				glVertexAttribPointer(uv1_location, 2, GL_FLOAT, GL_FALSE, 0, &m_uvs1[0]);
+				glVertexAttribPointer(uv1_location, 2, GL_FLOAT, GL_FALSE, 0, streamArray(&m_uvs1[0], m_uvs1.size() * sizeof(Vector2)));
 		}
 		checkGLErrors();
 	}
 
 	color_location = -1;
-	if (colors.size())
+	if (colors.size() || quantized_colors.size() || colors_vbo_id)
 	{
 		color_location = sh->getAttribLocation("a_color");
 		if (color_location != -1)
 		{
+			//rgba8 in the quantized layout
+			int type = quantized_layout ? GL_UNSIGNED_BYTE : GL_FLOAT;
 			glEnableVertexAttribArray(color_location);
 			if (colors_vbo_id)
 			{
 				glBindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
-				glVertexAttribPointer(color_location, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+				glVertexAttribPointer(color_location, 4, type, quantized_layout, 0, NULL);
 			}
 			else
-				glVertexAttribPointer(color_location, 4, GL_FLOAT, GL_FALSE, 0, &colors[0]);
+			{
+				int bytes = 0;
+				const void* data = getStream(STREAM_COLORS, bytes);
+				glVertexAttribPointer(color_location, 4, type, quantized_layout, 0, streamArray(data, bytes));
+			}
 		}
 		checkGLErrors();
 	}
 
 	bones_location = -1;
-	if (bones.size())
+	if (bones.size() || bones_vbo_id)
 	{
 		bones_location = sh->getAttribLocation("a_bones");
 		if (bones_location != -1)
@@ -233,23 +325,29 @@ void Mesh::enableBuffers(Shader* sh)
 				glVertexAttribPointer(bones_location, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, NULL);
 			}
 			else
-				glVertexAttribPointer(bones_location, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, &bones[0]);
+				glVertexAttribPointer(bones_location, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, streamArray(&bones[0], bones.size() * sizeof(Vector4ub)));
 		}
 	}
 	weights_location = -1;
-	if (weights.size())
+	if (weights.size() || quantized_weights.size() || weights_vbo_id)
 	{
 		weights_location = sh->getAttribLocation("a_weights");
 		if (weights_location != -1)
 		{
+			//unorm16 in the quantized layout
+			int type = quantized_layout ? GL_UNSIGNED_SHORT : GL_FLOAT;
 			glEnableVertexAttribArray(weights_location);
 			if (weights_vbo_id)
 			{
 				glBindBuffer(GL_ARRAY_BUFFER, weights_vbo_id);
-				glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+				glVertexAttribPointer(weights_location, 4, type, quantized_layout, 0, NULL);
 			}
 			else
-				glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, &weights[0]);
+			{
+				int bytes = 0;
+				const void* data = getStream(STREAM_WEIGHTS, bytes);
+				glVertexAttribPointer(weights_location, 4, type, quantized_layout, 0, streamArray(data, bytes));
+			}
 		}
 	}
 
@@ -265,7 +363,7 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	assert(getNumVertices() && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
@@ -283,33 +381,25 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
 	int start = 0; //in primitives
-	int size = (int)vertices.size();
-	if (m_indices.size())
-		size = (int)m_indices.size();
-	else
-	if (interleaved.size())
-		size = (int)interleaved.size();
+	int num_indices = getNumIndices();
+	int size = num_indices ? num_indices : (int)getNumVertices();
 
 	if (submesh_id > -1)
 	{
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
 	}
 
 	//DRAW
-	if (m_indices.size())
+	if (num_indices)
 	{
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
+			glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(unsigned int)), num_instances);
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
@@ -318,25 +408,26 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 			{
 				/*if (size != 90)*/ {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
+					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(unsigned int)));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
 			}
 			else
-				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its a vector3u pointer)
+			{
+				//indices of the debug geometry through the streaming buffer
+				RingBuffer* ring = RingBuffer::Get();
+				int offset = ring->upload(&m_indices[0], m_indices.size() * sizeof(unsigned int));
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ring->buffer_id);
+				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(offset + start * sizeof(unsigned int)));
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			}
 		}
 	}
 	else
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
@@ -358,50 +449,44 @@ void Mesh::disableBuffers(Shader* shader)
 	checkGLErrors();
 }
 
-GLuint instances_buffer_id = 0;
-
 //should be faster but in some system it is slower
 void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
 {
 	if (!num_instances)
 		return;
 
-	#ifdef OPENGL_ES3
-		Shader* shader = Shader::current;
-		assert(shader && "shader must be enabled");
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
 
-		if (instances_buffer_id == 0)
-			glGenBuffersARB(1, &instances_buffer_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
+	//the models go to the streaming buffer of the frame, no buffer is reallocated
+	RingBuffer* ring = RingBuffer::Get();
+	int models_offset = ring->upload(instanced_models, num_instances * sizeof(Matrix44));
+	glBindBuffer(GL_ARRAY_BUFFER, ring->buffer_id);
 
-		int attribLocation = shader->getAttribLocation("u_model");
-		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
-		if (attribLocation == -1)
-			return; //this shader doesnt support instanced model
+	int attribLocation = shader->getAttribLocation("u_model");
+	assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
+	if (attribLocation == -1)
+		return; //this shader doesnt support instanced model
 
-		//mat4 count as 4 different attributes of vec4... (thanks opengl...)
-		for (int k = 0; k < 4; ++k)
-		{
-			glEnableVertexAttribArray(attribLocation + k );
-			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
-			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
-			glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
-		}
+	//mat4 count as 4 different attributes of vec4... (thanks opengl...)
+	for (int k = 0; k < 4; ++k)
+	{
+		glEnableVertexAttribArray(attribLocation + k );
+		int offset = models_offset + sizeof(float) * 4 * k;
+		const Uint8* addr = (Uint8*)(size_t) offset;
+		glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
+		glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
+	}
 
-		//regular render
-		render(primitive, 0, num_instances);
+	//regular render (all the submeshes)
+	render(primitive, -1, num_instances);
 
-		//disable instanced attribs
-		for (int k = 0; k < 4; ++k)
-		{
-			glDisableVertexAttribArray(attribLocation + k);
-			glVertexAttribDivisor(attribLocation + k, 0);
-		}
-    #else
-		assert(0 && "not supported");
-    #endif
+	//disable instanced attribs
+	for (int k = 0; k < 4; ++k)
+	{
+		glDisableVertexAttribArray(attribLocation + k);
+		glVertexAttribDivisor(attribLocation + k, 0);
+	}
 }
 
 //super obsolete rendering method, do not use
@@ -501,7 +586,7 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 
 void Mesh::uploadToVRAM()
 {
-	assert(vertices.size() || interleaved.size());
+	assert(getNumVertices());
 
 	if (glGenBuffersARB == nullptr)
 	{
@@ -509,88 +594,57 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
-	if (interleaved.size())
-	{
-		// Vertex,Normal,UV
-		if (interleaved_vbo_id == 0)
-			glGenBuffersARB(1, &interleaved_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
-	}
-	else
-	{
-		// Vertices
-		if (vertices_vbo_id == 0)
-			glGenBuffersARB(1, &vertices_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3), &vertices[0], GL_STATIC_DRAW_ARB);
-
-		// UVs
-		if (uvs.size())
-		{
-			if (uvs_vbo_id == 0)
-				glGenBuffersARB(1, &uvs_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2), &uvs[0], GL_STATIC_DRAW_ARB);
-		}
-
-		// Normals
-		if (normals.size())
-		{
-			if (normals_vbo_id == 0)
-				glGenBuffersARB(1, &normals_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3), &normals[0], GL_STATIC_DRAW_ARB);
-		}
-	}
-
-	// UVs
-	if (m_uvs1.size())
-	{
-		if (uvs1_vbo_id == 0)
-			glGenBuffersARB(1, &uvs1_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs1_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, m_uvs1.size() * sizeof(Vector2), &m_uvs1[0], GL_STATIC_DRAW_ARB);
-	}
+	//the streams of a mapped mesh go from the file to the buffers without a copy
+	auto upload = [](unsigned int& id, unsigned int target, const void* data, int bytes) {
+		if (!data)
+			return;
+		if (id == 0)
+			glGenBuffersARB(1, &id);
+		glBindBufferARB(target, id);
+		glBufferDataARB(target, bytes, data, GL_STATIC_DRAW_ARB);
+	};
+	int bytes = 0;
+	const void* data = NULL;
 
-	// Colors
-	if (colors.size())
+	// Vertex,Normal,UV or the vertices, the positions of a quantized mesh are only for the CPU
+	if (isQuantized())
 	{
-		if (colors_vbo_id == 0)
-			glGenBuffersARB(1, &colors_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4), &colors[0], GL_STATIC_DRAW_ARB);
+		data = getStream(STREAM_QUANTIZED, bytes);
+		upload(interleaved_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
 	}
-
-	if (bones.size())
+	else
 	{
-		if (bones_vbo_id == 0)
-			glGenBuffersARB(1, &bones_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
+		data = getStream(STREAM_VERTICES, bytes);
+		upload(isInterleaved() ? interleaved_vbo_id : vertices_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
 	}
-	if (weights.size())
+	if (!isInterleaved() && !isQuantized())
 	{
-		if (weights_vbo_id == 0)
-			glGenBuffersARB(1, &weights_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(Vector4), &weights[0], GL_STATIC_DRAW_ARB);
+		data = getStream(STREAM_UVS, bytes);
+		upload(uvs_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
+		data = getStream(STREAM_NORMALS, bytes);
+		upload(normals_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
 	}
 
+	data = getStream(STREAM_UVS1, bytes);
+	upload(uvs1_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
+	data = getStream(STREAM_COLORS, bytes);
+	upload(colors_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
+	data = getStream(STREAM_BONES, bytes);
+	upload(bones_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
+	data = getStream(STREAM_WEIGHTS, bytes);
+	upload(weights_vbo_id, GL_ARRAY_BUFFER_ARB, data, bytes);
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
 	// Indices
-	if (m_indices.size())
-	{
-		if (indices_vbo_id == 0)
-			glGenBuffersARB(1, &indices_vbo_id);
-		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
-	}
+	data = getStream(STREAM_INDICES, bytes);
+	upload(indices_vbo_id, GL_ELEMENT_ARRAY_BUFFER, data, bytes);
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
 	checkGLErrors();
 	//clear buffers to save memory
+
+	for (unsigned int i = 0; i < lods.size(); ++i)
+		lods[i]->uploadToVRAM();
 }
 
 bool Mesh::createCollisionModel(bool is_static)
@@ -598,56 +652,26 @@ bool Mesh::createCollisionModel(bool is_static)
 	if (collision_model)
 		return true;
 
-	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
-
-	if (m_indices.size()) //indexed
-	{
-		collision_model->setTriangleNumber((int)m_indices.size() / 3);
-
-		if (interleaved.size())
-			for (unsigned int i = 0; i < m_indices.size(); i+=3)
-			{
-				auto v1 = interleaved[m_indices[i+0]];
-				auto v2 = interleaved[m_indices[i+1]];
-				auto v3 = interleaved[m_indices[i+2]];
-				collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-			}
-		else
-		for (unsigned int i = 0; i < m_indices.size(); i+=3)
-		{
-			auto v1 = vertices[m_indices[i+0]];
-			auto v2 = vertices[m_indices[i+1]];
-			auto v3 = vertices[m_indices[i+2]];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
-	}
-	else if (interleaved.size()) //is interleaved
-	{
-		collision_model->setTriangleNumber(interleaved.size() / 3);
-		for (unsigned int i = 0; i < interleaved.size(); i+=3)
-		{
-			auto v1 = interleaved[i];
-			auto v2 = interleaved[i+1];
-			auto v3 = interleaved[i+2];
-			collision_model->addTriangle(v1.vertex.v, v2.vertex.v, v3.vertex.v);
-		}
-	}
-	else if (vertices.size()) //non interleaved
-	{
-		collision_model->setTriangleNumber((int)vertices.size() / 3);
-		for (unsigned int i = 0; i < (int)vertices.size(); i+=3)
-		{
-			auto v1 = vertices[i];
-			auto v2 = vertices[i + 1];
-			auto v3 = vertices[i + 2];
-			collision_model->addTriangle(v1.v, v2.v, v3.v);
-		}
-	}
-	else
+	//read in place, also from the mapped file
+	int stride = 0;
+	const char* positions = (const char*)getPositions(stride);
+	const unsigned int* indices = getIndices();
+	int num = indices ? getNumIndices() : getNumVertices();
+	if (!positions)
 	{
 		assert(0 && "mesh without vertices, cannot create collision model");
 		return false;
 	}
+
+	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
+	collision_model->setTriangleNumber(num / 3);
+	for (int i = 0; i + 2 < num; i += 3)
+	{
+		Vector3 v1 = *(const Vector3*)(positions + (indices ? indices[i] : i) * stride);
+		Vector3 v2 = *(const Vector3*)(positions + (indices ? indices[i + 1] : i + 1) * stride);
+		Vector3 v3 = *(const Vector3*)(positions + (indices ? indices[i + 2] : i + 2) * stride);
+		collision_model->addTriangle(v1.v, v2.v, v3.v);
+	}
 	collision_model->finalize();
 	this->collision_model = collision_model;
 	return true;
@@ -714,6 +738,12 @@ bool Mesh::testSphereCollision(Matrix44 model, Vector3 center, float radius, Vec
 
 bool Mesh::interleaveBuffers()
 {
+	if (mapped_file)
+	{
+		if (mapped_interleaved || !mapped_bytes[STREAM_NORMALS] || !mapped_bytes[STREAM_UVS])
+			return false;
+		unmap();
+	}
 	if (!vertices.size() || !normals.size() || !uvs.size())
 		return false;
 
@@ -735,149 +765,573 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
-typedef struct 
+//bytes of every vertex in one stream, used to compare vertices without knowing which streams the mesh has
+struct sVertexStream {
+	const char* data;
+	int stride;
+};
+
+struct sVertexHash {
+	const std::vector<sVertexStream>* streams;
+	size_t operator()(unsigned int index) const
+	{
+		size_t hash = 2166136261u; //FNV-1a
+		for (unsigned int i = 0; i < streams->size(); ++i)
+		{
+			const sVertexStream& stream = (*streams)[i];
+			const char* bytes = stream.data + index * stream.stride;
+			for (int j = 0; j < stream.stride; ++j)
+				hash = (hash ^ (unsigned char)bytes[j]) * 16777619u;
+		}
+		return hash;
+	}
+};
+
+struct sVertexEqual {
+	const std::vector<sVertexStream>* streams;
+	bool operator()(unsigned int a, unsigned int b) const
+	{
+		for (unsigned int i = 0; i < streams->size(); ++i)
+		{
+			const sVertexStream& stream = (*streams)[i];
+			if (memcmp(stream.data + a * stream.stride, stream.data + b * stream.stride, stream.stride) != 0)
+				return false;
+		}
+		return true;
+	}
+};
+
+template<typename T> void addVertexStream(std::vector<sVertexStream>& streams, const std::vector<T>& v)
 {
-	int version;
-	int header_bytes;
-	int size;
-	int num_indices;
-	Vector3 aabb_min;
-	Vector3	aabb_max;
-	Vector3	center;
-	Vector3	halfsize;
-	float radius;
-	int num_bones;
-	int num_submeshes;
-	Matrix44 bind_matrix;
-	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
-} sMeshInfo;
+	if (!v.size())
+		return;
+	sVertexStream stream = { (const char*)&v[0], (int)sizeof(T) };
+	streams.push_back(stream);
+}
 
-bool Mesh::readBin(const char* filename, bool bFromNetwork)
+//keeps only the vertices in unique, in that order
+template<typename T> void compactVertexStream(std::vector<T>& v, const std::vector<unsigned int>& unique)
 {
-	FILE *f;
-	assert(filename);
+	if (!v.size())
+		return;
+	for (unsigned int i = 0; i < unique.size(); ++i)
+		v[i] = v[unique[i]]; //unique[i] >= i, so nothing is overwritten before being read
+	v.resize(unique.size());
+	v.shrink_to_fit();
+}
 
-	struct stat stbuffer;
+bool Mesh::weldVertices()
+{
+	if (getNumIndices())
+		return false;
+	unmap();
+
+	//a vertex is the same when all its streams have the same bytes
+	std::vector<sVertexStream> streams;
+	addVertexStream(streams, interleaved);
+	addVertexStream(streams, vertices);
+	addVertexStream(streams, normals);
+	addVertexStream(streams, uvs);
+	addVertexStream(streams, m_uvs1);
+	addVertexStream(streams, colors);
+	addVertexStream(streams, bones);
+	addVertexStream(streams, weights);
+	addVertexStream(streams, quantized);
+	addVertexStream(streams, quantized_colors);
+	addVertexStream(streams, quantized_weights);
+
+	unsigned int num_vertices = getNumVertices();
+	if (!num_vertices)
+		return false;
 
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
+	sVertexHash hash = { &streams };
+	sVertexEqual equal = { &streams };
+	std::unordered_map<unsigned int, unsigned int, sVertexHash, sVertexEqual> welded(num_vertices, hash, equal);
+	std::vector<unsigned int> unique; //first vertex of the soup of every welded vertex
+	std::vector<unsigned int> indices(num_vertices);
+	for (unsigned int i = 0; i < num_vertices; ++i)
+	{
+		auto it = welded.insert(std::make_pair(i, (unsigned int)unique.size()));
+		if (it.second)
+			unique.push_back(i);
+		indices[i] = it.first->second;
+	}
+	if (unique.size() == num_vertices)
 		return false;
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+	compactVertexStream(interleaved, unique);
+	compactVertexStream(vertices, unique);
+	compactVertexStream(normals, unique);
+	compactVertexStream(uvs, unique);
+	compactVertexStream(m_uvs1, unique);
+	compactVertexStream(colors, unique);
+	compactVertexStream(bones, unique);
+	compactVertexStream(weights, unique);
+	compactVertexStream(quantized, unique);
+	compactVertexStream(quantized_colors, unique);
+	if (quantized_weights.size()) //four per vertex
+	{
+		for (unsigned int i = 0; i < unique.size(); ++i)
+			memcpy(&quantized_weights[i * 4], &quantized_weights[unique[i] * 4], sizeof(unsigned short) * 4);
+		quantized_weights.resize(unique.size() * 4);
+	}
+
+	//the index of a vertex of the soup is its position, so the ranges of the submeshes are the same in indices
+	m_indices.swap(indices);
+	return true;
+}
 
-	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
-	{
-		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+bool Mesh::optimizeIndices()
+{
+	unsigned int num_vertices = getNumVertices();
+	if (!getNumIndices() || !num_vertices)
 		return false;
-	}
+	unmap();
 
-	char* pos = data + 4;
-	sMeshInfo info;
-	memcpy(&info,pos,sizeof(sMeshInfo));
-	pos += sizeof(sMeshInfo);
+	const char* positions = interleaved.size() ? (const char*)&interleaved[0].vertex : (const char*)&vertices[0];
+	int stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+	index_stats[0] = computeVertexCacheStats(&m_indices[0], m_indices.size(), num_vertices);
 
-	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
+	//every submesh on its own so their ranges are the same, the triangles only move inside them
+	std::vector<sSubmeshInfo> ranges = submeshes;
+	if (!ranges.size())
 	{
-		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
-		return false;
+		sSubmeshInfo all;
+		all.start = 0;
+		all.length = m_indices.size();
+		ranges.push_back(all);
+	}
+
+	std::vector<int> clusters;
+	for (unsigned int i = 0; i < ranges.size(); ++i)
+	{
+		int start = ranges[i].start;
+		int length = ranges[i].length;
+		if (start < 0 || length < 6 || length % 3 || start + length > (int)m_indices.size())
+			continue;
+		optimizeVertexCache(&m_indices[start], length, num_vertices, &clusters);
+		optimizeOverdraw(&m_indices[start], length, num_vertices, positions, stride, clusters);
 	}
 
-	if (info.streams[0] == 'I')
+	index_stats[1] = computeVertexCacheStats(&m_indices[0], m_indices.size(), num_vertices);
+	return true;
+}
+
+//round to nearest, the values out of range become infinite and the denormals zero
+static unsigned short floatToHalf(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	unsigned short sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+	unsigned int mantissa = bits & 0x7FFFFF;
+	if (exponent <= 0)
+		return sign;
+	if (exponent >= 31)
+		return sign | 0x7C00;
+	unsigned short half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) //the carry goes to the exponent when needed
+		half++;
+	return half;
+}
+
+static short quantizeSnorm16(float value)
+{
+	value = clamp(value, -1.0f, 1.0f);
+	return (short)floor(value * 32767.0f + (value >= 0 ? 0.5f : -0.5f));
+}
+
+//octahedral encoding: the normal projected to the octahedron |x|+|y|+|z| = 1, the lower half folded over the upper one
+static void encodeOctahedral(Vector3 n, signed char* result)
+{
+	float sum = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	float x = sum > 0 ? n.x / sum : 0;
+	float y = sum > 0 ? n.y / sum : 0;
+	if (n.z < 0)
 	{
-		interleaved.resize(info.size);
-		memcpy((void*)&interleaved[0], pos, sizeof(tInterleaved) * info.size);
-		pos += sizeof(tInterleaved) * info.size;
+		float folded_x = (1.0f - fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = folded_x;
 	}
-	else if (info.streams[0] == 'V')
+	result[0] = (signed char)floor(clamp(x, -1.0f, 1.0f) * 127.0f + 0.5f);
+	result[1] = (signed char)floor(clamp(y, -1.0f, 1.0f) * 127.0f + 0.5f);
+}
+
+bool Mesh::quantizeBuffers()
+{
+	if (isQuantized())
+		return false;
+	unmap();
+	if (!interleaved.size())
+		return false;
+
+	//the positions in the box of the mesh
+	Vector3 min_pos = interleaved[0].vertex;
+	Vector3 max_pos = min_pos;
+	for (unsigned int i = 1; i < interleaved.size(); ++i)
 	{
-		vertices.resize(info.size);
-		memcpy((void*)&vertices[0], pos, sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		min_pos.setMin(interleaved[i].vertex);
+		max_pos.setMax(interleaved[i].vertex);
 	}
+	quantization_offset = (min_pos + max_pos) * 0.5f;
+	quantization_scale = max_pos - quantization_offset;
+	for (int k = 0; k < 3; ++k)
+		if (quantization_scale.v[k] <= 0)
+			quantization_scale.v[k] = 1;
 
-	if (info.streams[1] == 'N')
+	quantized.resize(interleaved.size());
+	vertices.resize(interleaved.size());
+	for (unsigned int i = 0; i < interleaved.size(); ++i)
 	{
-		normals.resize(info.size);
-		memcpy((void*)&normals[0],pos,sizeof(Vector3) * info.size);
-		pos += sizeof(Vector3) * info.size;
+		const tInterleaved& v = interleaved[i];
+		tQuantized& q = quantized[i];
+		for (int k = 0; k < 3; ++k)
+			q.vertex[k] = quantizeSnorm16((v.vertex.v[k] - quantization_offset.v[k]) / quantization_scale.v[k]);
+		encodeOctahedral(v.normal, q.normal);
+		q.uv[0] = floatToHalf(v.uv.x);
+		q.uv[1] = floatToHalf(v.uv.y);
+		vertices[i] = v.vertex;
 	}
+	interleaved.resize(0);
+	interleaved.shrink_to_fit();
 
-	if (info.streams[2] == 'U')
+	if (colors.size())
 	{
-		uvs.resize(info.size);
-		memcpy((void*)&uvs[0],pos,sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		quantized_colors.resize(colors.size());
+		for (unsigned int i = 0; i < colors.size(); ++i)
+			for (int k = 0; k < 4; ++k)
+				quantized_colors[i].v[k] = (Uint8)floor(clamp(colors[i].v[k], 0.0f, 1.0f) * 255.0f + 0.5f);
+		colors.resize(0);
+		colors.shrink_to_fit();
 	}
 
-	if (info.streams[3] == 'C')
+	if (weights.size())
 	{
-		colors.resize(info.size);
-		memcpy((void*)&colors[0],pos,sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		quantized_weights.resize(weights.size() * 4);
+		for (unsigned int i = 0; i < weights.size(); ++i)
+			for (int k = 0; k < 4; ++k)
+				quantized_weights[i * 4 + k] = (unsigned short)floor(clamp(weights[i].v[k], 0.0f, 1.0f) * 65535.0f + 0.5f);
+		weights.resize(0);
+		weights.shrink_to_fit();
 	}
+	return true;
+}
 
-	if (info.streams[4] == 'I')
+//the vertices in used, in that order
+template<typename T> void copyVertexStream(std::vector<T>& dst, const std::vector<T>& src, const std::vector<unsigned int>& used, int per_vertex = 1)
+{
+	if (!src.size())
+		return;
+	dst.resize(used.size() * per_vertex);
+	for (unsigned int i = 0; i < used.size(); ++i)
+		for (int k = 0; k < per_vertex; ++k)
+			dst[i * per_vertex + k] = src[used[i] * per_vertex + k];
+}
+
+bool Mesh::generateLODs()
+{
+	for (unsigned int i = 0; i < lods.size(); ++i)
+		delete lods[i];
+	lods.clear();
+
+	unsigned int num_vertices = getNumVertices();
+	unsigned int num_indices = getNumIndices();
+	float mesh_radius = (float)box.halfsize.length();
+	if (lod_level || num_indices / 3 < MESH_LOD_MIN_TRIANGLES || mesh_radius <= 0)
+		return false;
+	unmap();
+
+	std::vector<sSubmeshInfo> ranges = submeshes;
+	if (ranges.empty())
+	{
+		sSubmeshInfo all;
+		memset(&all, 0, sizeof(all));
+		all.length = num_indices;
+		ranges.push_back(all);
+	}
+
+	int stride = 0;
+	const char* positions = (const char*)getPositions(stride);
+	std::vector<unsigned int> indices(num_indices);
+	std::vector<unsigned int> remap(num_vertices);
+	std::vector<unsigned int> used;
+	unsigned int previous = num_indices;
+	for (int level = 1; level <= MESH_MAX_LODS; ++level)
+	{
+		//every submesh on its own, so the ranges of the materials are kept
+		float ratio = 1.0f / (1 << level);
+		float error = 0;
+		std::vector<sSubmeshInfo> lod_submeshes = ranges;
+		int size = 0;
+		for (unsigned int i = 0; i < ranges.size(); ++i)
+		{
+			float submesh_error = 0;
+			lod_submeshes[i].start = size;
+			lod_submeshes[i].length = simplifyIndices(&indices[size], &m_indices[ranges[i].start], ranges[i].length, positions, stride, num_vertices, (int)(ranges[i].length * ratio), MESH_LOD_MAX_ERROR * mesh_radius, &submesh_error);
+			size += lod_submeshes[i].length;
+			error = std::max(error, submesh_error);
+		}
+
+		//not worth a level when the error stopped it too soon
+		if (size > previous * 0.8f || !size)
+			break;
+		previous = size;
+
+		//only the vertices it uses
+		std::fill(remap.begin(), remap.end(), (unsigned int)-1);
+		used.resize(0);
+		for (int i = 0; i < size; ++i)
+		{
+			unsigned int& v = remap[indices[i]];
+			if (v == (unsigned int)-1)
+			{
+				v = used.size();
+				used.push_back(indices[i]);
+			}
+		}
+
+		Mesh* lod = new Mesh();
+		lod->name = name + ".lod" + std::to_string(level);
+		lod->lod_level = level;
+		lod->lod_base_indices = num_indices;
+		lod->lod_error = std::max(error / mesh_radius, lods.size() ? lods.back()->lod_error : 0.0f); //never less than the previous level
+		lod->submeshes = submeshes.size() ? lod_submeshes : std::vector<sSubmeshInfo>();
+		lod->m_indices.resize(size);
+		for (int i = 0; i < size; ++i)
+			lod->m_indices[i] = remap[indices[i]];
+		copyVertexStream(lod->interleaved, interleaved, used);
+		copyVertexStream(lod->vertices, vertices, used);
+		copyVertexStream(lod->normals, normals, used);
+		copyVertexStream(lod->uvs, uvs, used);
+		copyVertexStream(lod->m_uvs1, m_uvs1, used);
+		copyVertexStream(lod->colors, colors, used);
+		copyVertexStream(lod->bones, bones, used);
+		copyVertexStream(lod->weights, weights, used);
+		copyVertexStream(lod->quantized, quantized, used);
+		copyVertexStream(lod->quantized_colors, quantized_colors, used);
+		copyVertexStream(lod->quantized_weights, quantized_weights, used, 4);
+		lod->quantization_offset = quantization_offset;
+		lod->quantization_scale = quantization_scale;
+		lod->bones_info = bones_info;
+		lod->bind_matrix = bind_matrix;
+
+		//the box of the level 0, the culling doesn't depend on the level
+		lod->aabb_min = aabb_min;
+		lod->aabb_max = aabb_max;
+		lod->box = box;
+		lod->radius = radius;
+		if (optimize_indices)
+			lod->optimizeIndices();
+		lods.push_back(lod);
+	}
+	return lods.size() > 0;
+}
+
+bool Mesh::readLODs(const char* filename)
+{
+	for (int level = 1; level <= MESH_MAX_LODS; ++level)
 	{
-		m_indices.resize(info.num_indices);
-		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		std::string lod_filename = std::string(filename) + ".lod" + std::to_string(level) + ".mbin";
+		Mesh* lod = new Mesh();
+		if (!lod->readBin(lod_filename.c_str(), false) || lod->lod_level != level || lod->lod_base_indices != (int)getNumIndices())
+		{
+			delete lod;
+			break;
+		}
+		lod->name = std::string(filename) + ".lod" + std::to_string(level);
+		lods.push_back(lod);
 	}
+	return lods.size() > 0;
+}
 
-	if (info.streams[5] == 'B')
+void Mesh::writeLODs(const char* filename)
+{
+	//the files of the levels it doesn't have anymore are removed, they belong to an older version of the mesh
+	for (int level = 1; level <= MESH_MAX_LODS; ++level)
 	{
-		bones.resize(info.size);
-		memcpy((void*)&bones[0], pos, sizeof(Vector4ub) * info.size);
-		pos += sizeof(Vector4ub) * info.size;
+		std::string lod_filename = std::string(filename) + ".lod" + std::to_string(level);
+		if (level <= (int)lods.size())
+			lods[level - 1]->writeBin(lod_filename.c_str());
+		else
+			remove((lod_filename + ".mbin").c_str());
 	}
+}
+
+//version 13: the quantization box in the header. version 12: every stream starts at an offset of the header aligned to MBIN_ALIGNMENT, so the file can be mapped and used in place
+typedef struct 
+{
+	int version;
+	int header_bytes;
+	int size;
+	int num_indices;
+	Vector3 aabb_min;
+	Vector3	aabb_max;
+	Vector3	center;
+	Vector3	halfsize;
+	float radius;
+	int num_bones;
+	int num_submeshes;
+	Matrix44 bind_matrix;
+	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
+	sVertexCacheStats index_stats[2]; //0 if the indices were not optimized
+	int offsets[MESH_NUM_STREAMS]; //from the start of the file
+	int bytes[MESH_NUM_STREAMS];
+	Vector3 quantization_offset; //of the quantized layout
+	Vector3 quantization_scale;
+	int lod_level; //0, 0 and 0 in the .mbin of the loaded meshes
+	float lod_error;
+	int lod_base_indices;
+	char extra[4]; //unused
+} sMeshInfo;
+
+template<typename T> void copyMappedStream(std::vector<T>& v, const char* data, int bytes)
+{
+	v.resize(bytes / sizeof(T));
+	if (bytes)
+		memcpy((void*)&v[0], data, bytes);
+}
+
+bool Mesh::readBin(const char* filename, bool bFromNetwork)
+{
+	assert(filename);
 
-	if (info.streams[6] == 'W')
+	MappedFile* file = new MappedFile();
+	if (!file->open(filename))
 	{
-		weights.resize(info.size);
-		memcpy((void*)&weights[0], pos, sizeof(Vector4) * info.size);
-		pos += sizeof(Vector4) * info.size;
+		delete file;
+		return false;
 	}
 
-	if (info.streams[7] == 'u')
+	//watermark
+	if (file->size < 4 + sizeof(sMeshInfo) || memcmp(file->data, "MBIN", 4) != 0)
 	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2) * info.size);
-		pos += sizeof(Vector2) * info.size;
+		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete file;
+		return false;
 	}
 
-	if (info.num_bones)
+	sMeshInfo info;
+	memcpy(&info, file->data + 4, sizeof(sMeshInfo));
+
+	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
 	{
-		bones_info.resize(info.num_bones);
-		memcpy((void*)&bones_info[0], pos, sizeof(BoneInfo) * info.num_bones);
-		pos += sizeof(BoneInfo) * info.num_bones;
+		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete file;
+		return false;
 	}
 
+	for (int i = 0; i < MESH_NUM_STREAMS; ++i)
+		if (info.bytes[i] < 0 || info.offsets[i] < 0 || (size_t)info.offsets[i] + info.bytes[i] > file->size)
+		{
+			std::cout << "[ERROR] loading BIN: stream out of the file: " << filename << std::endl;
+			delete file;
+			return false;
+		}
+
 	aabb_max = info.aabb_max;
 	aabb_min = info.aabb_min;
 	box.center = info.center;
 	box.halfsize = info.halfsize;
 	radius = info.radius;
 	bind_matrix = info.bind_matrix;
+	memcpy(index_stats, info.index_stats, sizeof(index_stats));
+	quantization_offset = info.quantization_offset;
+	quantization_scale = info.quantization_scale;
+	lod_level = info.lod_level;
+	lod_error = info.lod_error;
+	lod_base_indices = info.lod_base_indices;
+
+	//the vertex streams and the indices stay in the file, only the small ones are copied
+	copyMappedStream(bones_info, file->data + info.offsets[STREAM_BONES_INFO], info.bytes[STREAM_BONES_INFO]);
+	copyMappedStream(submeshes, file->data + info.offsets[STREAM_SUBMESHES], info.bytes[STREAM_SUBMESHES]);
+	mapped_file = file;
+	mapped_interleaved = info.streams[0] == 'I';
+	mapped_quantized = info.bytes[STREAM_QUANTIZED] > 0;
+	memcpy(mapped_offsets, info.offsets, sizeof(mapped_offsets));
+	memcpy(mapped_bytes, info.bytes, sizeof(mapped_bytes));
+
+	//the levels of detail are only rendered, the rays test the level 0
+	if (!lod_level)
+		createCollisionModel();
+	return true;
+}
 
-	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
-	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
+void Mesh::unmap()
+{
+	if (!mapped_file)
+		return;
+	const char* data = mapped_file->data;
+	if (mapped_interleaved)
+		copyMappedStream(interleaved, data + mapped_offsets[STREAM_VERTICES], mapped_bytes[STREAM_VERTICES]);
+	else
+		copyMappedStream(vertices, data + mapped_offsets[STREAM_VERTICES], mapped_bytes[STREAM_VERTICES]);
+	copyMappedStream(normals, data + mapped_offsets[STREAM_NORMALS], mapped_bytes[STREAM_NORMALS]);
+	copyMappedStream(uvs, data + mapped_offsets[STREAM_UVS], mapped_bytes[STREAM_UVS]);
+	if (mapped_quantized)
+	{
+		copyMappedStream(quantized, data + mapped_offsets[STREAM_QUANTIZED], mapped_bytes[STREAM_QUANTIZED]);
+		copyMappedStream(quantized_colors, data + mapped_offsets[STREAM_COLORS], mapped_bytes[STREAM_COLORS]);
+		copyMappedStream(quantized_weights, data + mapped_offsets[STREAM_WEIGHTS], mapped_bytes[STREAM_WEIGHTS]);
+	}
+	else
+	{
+		copyMappedStream(colors, data + mapped_offsets[STREAM_COLORS], mapped_bytes[STREAM_COLORS]);
+		copyMappedStream(weights, data + mapped_offsets[STREAM_WEIGHTS], mapped_bytes[STREAM_WEIGHTS]);
+	}
+	copyMappedStream(m_indices, data + mapped_offsets[STREAM_INDICES], mapped_bytes[STREAM_INDICES]);
+	copyMappedStream(bones, data + mapped_offsets[STREAM_BONES], mapped_bytes[STREAM_BONES]);
+	copyMappedStream(m_uvs1, data + mapped_offsets[STREAM_UVS1], mapped_bytes[STREAM_UVS1]);
+	delete mapped_file;
+	mapped_file = NULL;
+}
 
-	createCollisionModel();
-	return true;
+const void* Mesh::getStream(eMeshStream stream, int& bytes)
+{
+	if (mapped_file && stream != STREAM_BONES_INFO && stream != STREAM_SUBMESHES)
+	{
+		bytes = mapped_bytes[stream];
+		return bytes ? mapped_file->data + mapped_offsets[stream] : NULL;
+	}
+
+	#define VECTOR_STREAM(v) { bytes = (int)(v.size() * sizeof(v[0])); return v.size() ? (const void*)&v[0] : NULL; }
+	switch (stream)
+	{
+		case STREAM_VERTICES:
+			if (interleaved.size())
+				VECTOR_STREAM(interleaved)
+			VECTOR_STREAM(vertices)
+		case STREAM_NORMALS: VECTOR_STREAM(normals)
+		case STREAM_UVS: VECTOR_STREAM(uvs)
+		case STREAM_COLORS:
+			if (quantized_colors.size())
+				VECTOR_STREAM(quantized_colors)
+			VECTOR_STREAM(colors)
+		case STREAM_INDICES: VECTOR_STREAM(m_indices)
+		case STREAM_BONES: VECTOR_STREAM(bones)
+		case STREAM_WEIGHTS:
+			if (quantized_weights.size())
+				VECTOR_STREAM(quantized_weights)
+			VECTOR_STREAM(weights)
+		case STREAM_UVS1: VECTOR_STREAM(m_uvs1)
+		case STREAM_QUANTIZED: VECTOR_STREAM(quantized)
+		case STREAM_BONES_INFO: VECTOR_STREAM(bones_info)
+		case STREAM_SUBMESHES: VECTOR_STREAM(submeshes)
+		default: break;
+	}
+	#undef VECTOR_STREAM
+	bytes = 0;
+	return NULL;
 }
 
 bool Mesh::writeBin(const char* filename)
 {
-	assert( vertices.size() || interleaved.size() );
+	assert(getNumVertices());
 	std::string s_filename = filename;
 	s_filename += ".mbin";
 
+	//it could be the file mapped
+	unmap();
+
 	FILE* f = fopen(s_filename.c_str(),"wb");
 	if (f == NULL)
 	{
@@ -885,14 +1339,11 @@ bool Mesh::writeBin(const char* filename)
 		return false;
 	}
 
-	//watermark
-	fwrite("MBIN",sizeof(char),4,f);
-
 	sMeshInfo info;
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
 	info.header_bytes = sizeof(sMeshInfo);
-	info.size = interleaved.size() ? interleaved.size() : vertices.size();
+	info.size = getNumVertices();
 	info.num_indices = m_indices.size();
 	info.aabb_max = aabb_max;
 	info.aabb_min = aabb_min;
@@ -902,48 +1353,50 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	memcpy(info.index_stats, index_stats, sizeof(index_stats));
+	info.quantization_offset = quantization_offset;
+	info.quantization_scale = quantization_scale;
+	info.lod_level = lod_level;
+	info.lod_error = lod_error;
+	info.lod_base_indices = lod_base_indices;
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
 	info.streams[2] = uvs.size() ? 'U' : ' ';
-	info.streams[3] = colors.size() ? 'C' : ' ';
+	info.streams[3] = colors.size() ? 'C' : (quantized_colors.size() ? 'c' : ' '); //rgba8
 	info.streams[4] = m_indices.size() ? 'I' : ' ';
 	info.streams[5] = bones.size() ? 'B' : ' ';
-	info.streams[6] = weights.size() ? 'W' : ' ';
+	info.streams[6] = weights.size() ? 'W' : (quantized_weights.size() ? 'w' : ' '); //unorm16
 	info.streams[7] = m_uvs1.size() ? 'u' : ' '; //uv second set
 
+	//the streams after the header, each one aligned
+	const void* data[MESH_NUM_STREAMS];
+	int offset = 4 + sizeof(sMeshInfo);
+	for (int i = 0; i < MESH_NUM_STREAMS; ++i)
+	{
+		data[i] = getStream((eMeshStream)i, info.bytes[i]);
+		offset = (offset + MBIN_ALIGNMENT - 1) & ~(MBIN_ALIGNMENT - 1);
+		info.offsets[i] = offset;
+		offset += info.bytes[i];
+	}
+
+	//watermark
+	fwrite("MBIN",sizeof(char),4,f);
+
 	//write info
 	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
 	//write streams
-	if (interleaved.size())
-		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
-	else
+	const char padding[MBIN_ALIGNMENT] = { 0 };
+	offset = 4 + sizeof(sMeshInfo);
+	for (int i = 0; i < MESH_NUM_STREAMS; ++i)
 	{
-		fwrite((void*)&vertices[0], vertices.size() * sizeof(Vector3), 1, f);
-		if (normals.size())
-			fwrite((void*)&normals[0], normals.size() * sizeof(Vector3), 1, f);
-		if (uvs.size())
-			fwrite((void*)&uvs[0], uvs.size() * sizeof(Vector2), 1, f);
+		fwrite(padding, 1, info.offsets[i] - offset, f);
+		if (info.bytes[i])
+			fwrite(data[i], info.bytes[i], 1, f);
+		offset = info.offsets[i] + info.bytes[i];
 	}
 
-	if (colors.size())
-		fwrite((void*)&colors[0], colors.size() * sizeof(Vector4), 1, f);
-
-	if (m_indices.size())
-		fwrite((void*)&m_indices[0], m_indices.size() * sizeof(unsigned int), 1, f);
-
-	if (bones.size())
-		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
-	if (weights.size())
-		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
-	if (m_uvs1.size())
-		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2), 1, f);
-
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
-
 	fclose(f);
 	return true;
 }
@@ -1440,6 +1893,7 @@ void Mesh::createSubdividedPlane(float size, int subdivisions, bool centered )
 void Mesh::displace(Image* heightmap, float altitude)
 {
 	assert(heightmap && heightmap->data && "image without data");
+	unmap();
 	assert(uvs.size() && "cannot displace without uvs");
 
 	bool is_interleaved = interleaved.size() != 0;
@@ -1461,6 +1915,36 @@ void Mesh::displace(Image* heightmap, float altitude)
 }
 
 
+void Mesh::createCone(int segments)
+{
+	vertices.clear();
+	normals.clear();
+	uvs.clear();
+	colors.clear();
+
+	//the edges of the polygon are tangent to the circle, so it doesn't cut the cone of the light
+	float radius = 1.0f / cos(PI / segments);
+	Vector3 apex(0.0f, 0.0f, 0.0f);
+	Vector3 center(0.0f, 0.0f, 1.0f);
+	for (int i = 0; i < segments; ++i)
+	{
+		float a0 = (2.0f * PI * i) / segments;
+		float a1 = (2.0f * PI * (i + 1)) / segments;
+		Vector3 p0(radius * cos(a0), radius * sin(a0), 1.0f);
+		Vector3 p1(radius * cos(a1), radius * sin(a1), 1.0f);
+
+		//counter clockwise seen from outside
+		vertices.push_back(apex);
+		vertices.push_back(p1);
+		vertices.push_back(p0);
+		vertices.push_back(center);
+		vertices.push_back(p0);
+		vertices.push_back(p1);
+	}
+
+	updateBoundingBox();
+}
+
 void Mesh::createGrid(float dist)
 {
 	int num_lines = 2000;
@@ -1483,22 +1967,17 @@ void Mesh::createGrid(float dist)
 
 void Mesh::updateBoundingBox()
 {
-	if (vertices.size())
+	int stride = 0;
+	const char* positions = (const char*)getPositions(stride);
+	int num = getNumVertices();
+	if (positions)
 	{
-		aabb_max = aabb_min = vertices[0];
-		for (int i = 1; i < vertices.size(); ++i)
+		aabb_max = aabb_min = *(const Vector3*)positions;
+		for (int i = 1; i < num; ++i)
 		{
-			aabb_min.setMin(vertices[i]);
-			aabb_max.setMax(vertices[i]);
-		}
-	}
-	else if (interleaved.size())
-	{
-		aabb_max = aabb_min = interleaved[0].vertex;
-		for (int i = 1; i < vertices.size(); ++i)
-		{
-			aabb_min.setMin(interleaved[i].vertex);
-			aabb_max.setMax(interleaved[i].vertex);
+			const Vector3& v = *(const Vector3*)(positions + i * stride);
+			aabb_min.setMin(v);
+			aabb_max.setMax(v);
 		}
 	}
 	box.center = (aabb_max + aabb_min) * 0.5f;
@@ -1556,6 +2035,18 @@ Mesh* Mesh::getQuad()
 	return quad;
 }
 
+Mesh* Mesh::getCone()
+{
+	static Mesh* cone = NULL;
+	if (!cone)
+	{
+		cone = new Mesh();
+		cone->createCone();
+		cone->uploadToVRAM();
+	}
+	return cone;
+}
+
 Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 {
 	assert(filename);
@@ -1597,19 +2088,57 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 	//try loading the binary version
 	if (use_binary && m->readBin(binfilename.c_str(), bFromNetwork) )
 	{
-		if (interleave_meshes && m->interleaved.size() == 0)
+		//caches written before the welding, the optimization of the indices or the quantization are written again
+		bool changed = false;
+		if (weld_meshes && (file_format == FORMAT_OBJ || file_format == FORMAT_ASE) && m->weldVertices())
+		{
+			std::cout << "[WELD] ";
+			changed = true;
+		}
+		if (optimize_indices && m->index_stats[1].acmr == 0 && m->optimizeIndices())
+		{
+			std::cout << "[OPT] ";
+			changed = true;
+		}
+
+		if (interleave_meshes && !m->isInterleaved() && !m->isQuantized())
 		{
 			std::cout << "[INTERL] ";
 			m->interleaveBuffers();
 		}
 
+		if (quantize_meshes && m->isInterleaved() && m->quantizeBuffers())
+		{
+			std::cout << "[QUANT] ";
+			changed = true;
+		}
+		if (changed && file_format != FORMAT_MBIN)
+			m->writeBin(filename);
+
+		//the levels of detail are cached next to the .mbin, they are generated again when it changes or they come
+		//from another version of it (and the files of the levels it can't make are removed)
+		if (generate_lods && (changed || !m->readLODs(filename)))
+		{
+			if (m->generateLODs())
+				std::cout << "[LODS " << m->lods.size() << "] ";
+			m->writeLODs(filename);
+		}
+
 		if (auto_upload_to_vram)
 		{
 			std::cout << "[VRAM] ";
 			m->uploadToVRAM();
 		}
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		//without VRAM the mesh is rendered from the vectors
+		if (!auto_upload_to_vram)
+		{
+			m->unmap();
+			for (unsigned int i = 0; i < m->lods.size(); ++i)
+				m->lods[i]->unmap();
+		}
+
+		std::cout << "[OK BIN]  Faces: " << (m->getNumIndices() ? m->getNumIndices() : m->getNumVertices()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 		sMeshesLoaded[filename] = m;
 		return m;
 	}
@@ -1632,6 +2161,18 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		return NULL;
 	}
 
+	//the loaders of OBJ and ASE repeat the vertices of every face
+	if (weld_meshes && (file_format == FORMAT_OBJ || file_format == FORMAT_ASE))
+	{
+		int num_vertices = m->getNumVertices();
+		if (m->weldVertices())
+			std::cout << "[WELD " << num_vertices << " -> " << m->getNumVertices() << " vertices] ";
+	}
+
+	//triangles in the order of the vertex cache
+	if (optimize_indices && m->optimizeIndices())
+		std::cout << "[OPT ACMR " << m->index_stats[0].acmr << " -> " << m->index_stats[1].acmr << "] ";
+
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
@@ -1639,6 +2180,14 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		m->interleaveBuffers();
 	}
 
+	//compact vertices
+	if (quantize_meshes && m->quantizeBuffers())
+		std::cout << "[QUANT] ";
+
+	//simplified versions, in the same layout
+	if (generate_lods && m->generateLODs())
+		std::cout << "[LODS " << m->lods.size() << "] ";
+
 	//and upload them to VRAM
 	if (auto_upload_to_vram)
 	{
@@ -1646,11 +2195,12 @@ Mesh* Mesh::Get(const char* filename, bool bFromNetwork, bool skip_load)
 		m->uploadToVRAM();
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	std::cout << "[OK]  Faces: " << (m->getNumIndices() ? m->getNumIndices() : m->getNumVertices()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
 		m->writeBin(filename);
+		m->writeLODs(filename); //without levels it only removes the old files
 		std::cout << "[OK]" << std::endl;
 	}
 
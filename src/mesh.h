@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "framework.h"
+#include "indexoptimizer.h"
 
 #include <map>
 #include <string>
@@ -10,9 +11,29 @@
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
-
-//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+class MappedFile;
+
+#define MESH_BIN_VERSION 13 //this is used to regenerate bins if the format changes
+#define MBIN_ALIGNMENT 16 //of the offsets of the streams in the file
+#define MESH_MAX_LODS 3 //simplified levels of a mesh, each one with about half the triangles of the previous
+#define MESH_LOD_MAX_ERROR 0.05f //of the simplification, relative to the radius of the box
+#define MESH_LOD_MIN_TRIANGLES 256 //smaller meshes have no levels
+
+//streams of a mesh, in the order they are in the .mbin
+enum eMeshStream {
+	STREAM_VERTICES, //or the interleaved ones
+	STREAM_NORMALS,
+	STREAM_UVS,
+	STREAM_COLORS,
+	STREAM_INDICES,
+	STREAM_BONES,
+	STREAM_WEIGHTS,
+	STREAM_UVS1,
+	STREAM_QUANTIZED,
+	STREAM_BONES_INFO,
+	STREAM_SUBMESHES,
+	MESH_NUM_STREAMS
+};
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -23,8 +44,8 @@ struct sSubmeshInfo
 {
 	char name[64];
 	char material[64];
-	int start;//in primitive
-	int length;//in primitive
+	int start;//in primitive (in indices for indexed meshes)
+	int length;//in primitive (in indices for indexed meshes)
 };
 
 class Mesh
@@ -34,10 +55,16 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool weld_meshes; //loaded triangle soups (OBJ, ASE) will be indexed
+	static bool optimize_indices; //the triangles of loaded indexed meshes will be sorted for the vertex cache and the overdraw
+	static bool quantize_meshes; //loaded interleaved meshes will use the compact layout (tQuantized)
+	static bool generate_lods; //loaded indexed meshes get simplified levels, cached in .lodN.mbin files next to the .mbin
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static int s_num_meshes;
 
 	std::string name;
+	int id; //unique number, used to group render calls
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
 
@@ -55,7 +82,28 @@ public:
 
 	std::vector< tInterleaved > interleaved; //to render interleaved
 
+	//compact layout of the interleaved vertices, 12 bytes instead of 32
+	struct tQuantized {
+		short vertex[3]; //snorm16, vertex = value * quantization_scale + quantization_offset
+		signed char normal[2]; //octahedral snorm8
+		unsigned short uv[2]; //half float
+	};
+
+	std::vector< tQuantized > quantized; //only in the GPU, the positions stay in vertices for the CPU (collision, occlusion)
+	std::vector< Vector4ub > quantized_colors; //rgba8 instead of colors
+	std::vector< unsigned short > quantized_weights; //unorm16, four per vertex, instead of weights
+	Vector3 quantization_offset;
+	Vector3 quantization_scale;
+
 	std::vector<unsigned int> m_indices; //for indexed meshes
+	sVertexCacheStats index_stats[2]; //of the indices as they were imported and after optimizeIndices (0 if not optimized)
+
+	//meshes read from a .mbin keep the file mapped and use its vertex streams and indices in place (the vectors are empty)
+	MappedFile* mapped_file;
+	bool mapped_interleaved;
+	bool mapped_quantized;
+	int mapped_offsets[MESH_NUM_STREAMS];
+	int mapped_bytes[MESH_NUM_STREAMS];
 
 	//for animated meshes
 	std::vector< Vector4ub > bones; //tells which bones afect the vertex (4 max)
@@ -69,6 +117,12 @@ public:
 
 	float radius;
 
+	//levels of detail, lods[0] is the level 1. They are owned by the mesh and not registered
+	std::vector<Mesh*> lods;
+	int lod_level; //0 for the loaded meshes
+	float lod_error; //distance of the simplification relative to the radius of the box
+	int lod_base_indices; //of the level 0 it was simplified from, so the cached levels of another version are not used
+
 	unsigned int vertices_vbo_id;
 	unsigned int uvs_vbo_id;
 	unsigned int normals_vbo_id;
@@ -97,9 +151,16 @@ public:
 
 	bool readBin(const char* filename, bool bFromNetwork);
 	bool writeBin(const char* filename);
+	void unmap(); //copies the streams of the mapped file to the vectors and closes it, before changing them
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumVertices();
+	unsigned int getNumIndices() { return mapped_file ? mapped_bytes[STREAM_INDICES] / sizeof(unsigned int) : (unsigned int)m_indices.size(); }
+	bool isInterleaved() { return mapped_file ? mapped_interleaved : interleaved.size() > 0; }
+	bool isQuantized() { return mapped_file ? mapped_quantized : quantized.size() > 0; }
+	const unsigned int* getIndices() { int bytes; return (const unsigned int*)getStream(STREAM_INDICES, bytes); }
+	const Vector3* getPositions(int& stride) { int bytes; stride = isInterleaved() ? sizeof(tInterleaved) : sizeof(Vector3); return (const Vector3*)getStream(STREAM_VERTICES, bytes); }
+	const void* getStream(eMeshStream stream, int& bytes); //from the vectors or the mapped file, NULL if the mesh doesn't have it
 
 	//collision testing
 	void* collision_model;
@@ -120,14 +181,22 @@ public:
 	void createCube();
 	void createWireBox();
 	void createGrid(float dist);
+	void createCone(int segments = 24); //apex at the origin opening to +Z, base of radius 1 at z = 1 (the polygon contains the circle)
 	void displace(Image* heightmap, float altitude);
 	static Mesh* getQuad(); //get global quad
+	static Mesh* getCone(); //get global cone, used as the volume of the spot lights
 
 	void updateBoundingBox();
 
 	//optimize meshes
 	void uploadToVRAM();
 	bool interleaveBuffers();
+	bool weldVertices(); //joins the equal vertices of an unindexed mesh and fills m_indices, false if nothing changed
+	bool optimizeIndices(); //reorders the triangles of every submesh for the vertex cache and then the overdraw
+	bool quantizeBuffers(); //moves an interleaved mesh to the compact layout (tQuantized, rgba8 colors, unorm16 weights)
+	bool generateLODs(); //fills lods simplifying the triangles of every submesh (see meshsimplifier.h), false if there are none
+	bool readLODs(const char* filename); //the levels cached for the mesh of this file
+	void writeLODs(const char* filename); //and removes the files of the levels it doesn't have
 
 private:
 	bool loadASE(const char* filename);
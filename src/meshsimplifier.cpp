@@ -0,0 +1,270 @@
+#include "meshsimplifier.h"
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <cstring>
+
+//sum of planes: error(p) = p^T A p + 2 b.p + c, A symmetric. Divided by the weight (area) it is a squared distance
+struct sQuadric {
+	double a00, a11, a22, a01, a02, a12;
+	double b0, b1, b2;
+	double c;
+	double weight;
+
+	//plane n.p + d = 0 with n normalized
+	void addPlane(const Vector3& n, double d, double w)
+	{
+		a00 += w * n.x * n.x; a11 += w * n.y * n.y; a22 += w * n.z * n.z;
+		a01 += w * n.x * n.y; a02 += w * n.x * n.z; a12 += w * n.y * n.z;
+		b0 += w * n.x * d; b1 += w * n.y * d; b2 += w * n.z * d;
+		c += w * d * d;
+		weight += w;
+	}
+
+	void add(const sQuadric& q)
+	{
+		a00 += q.a00; a11 += q.a11; a22 += q.a22;
+		a01 += q.a01; a02 += q.a02; a12 += q.a12;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2;
+		c += q.c;
+		weight += q.weight;
+	}
+
+	double error(const Vector3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double e = a00 * x * x + a11 * y * y + a22 * z * z + 2 * (a01 * x * y + a02 * x * z + a12 * y * z) + 2 * (b0 * x + b1 * y + b2 * z) + c;
+		return weight > 0 ? fabs(e) / weight : 0;
+	}
+};
+
+enum eVertexKind {
+	VERTEX_MANIFOLD, //moves to any neighbour
+	VERTEX_BORDER, //only along its open edges
+	VERTEX_LOCKED //seams and non manifold vertices, only receive collapses
+};
+
+struct sPositionHash {
+	size_t operator()(const Vector3& p) const
+	{
+		const unsigned int* bits = (const unsigned int*)&p;
+		return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+	}
+};
+
+struct sPositionEqual {
+	bool operator()(const Vector3& a, const Vector3& b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+};
+
+struct sCollapse {
+	unsigned int from;
+	unsigned int to;
+	float error; //squared distance
+};
+
+static unsigned long long edgeKey(unsigned int a, unsigned int b) { return ((unsigned long long)a << 32) | b; }
+
+int simplifyIndices(unsigned int* destination, const unsigned int* indices, int num_indices, const char* positions, int stride, int num_vertices, int target_indices, float max_error, float* error)
+{
+	#define POSITION(v) (*(const Vector3*)(positions + (v) * stride))
+	std::vector<unsigned int> result(indices, indices + num_indices - num_indices % 3);
+	float max_error_done = 0;
+
+	//the vertices with the same position, the first one of every position represents it
+	std::vector<unsigned int> position_of(num_vertices);
+	std::vector<int> vertices_at(num_vertices, 0);
+	std::unordered_map<Vector3, unsigned int, sPositionHash, sPositionEqual> unique_positions;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		auto it = unique_positions.insert(std::make_pair(POSITION(i), (unsigned int)i));
+		position_of[i] = it.first->second;
+	}
+	std::vector<bool> referenced(num_vertices, false);
+	for (unsigned int i = 0; i < result.size(); ++i)
+		if (!referenced[result[i]])
+		{
+			referenced[result[i]] = true;
+			vertices_at[position_of[result[i]]]++;
+		}
+
+	//open edges: the ones without the opposite edge, between positions so the seams are not open
+	std::unordered_map<unsigned long long, int> edges;
+	auto buildEdges = [&]() {
+		edges.clear();
+		for (unsigned int i = 0; i < result.size(); ++i)
+		{
+			unsigned int a = position_of[result[i]];
+			unsigned int b = position_of[result[i - i % 3 + (i + 1) % 3]];
+			edges[edgeKey(a, b)]++;
+		}
+	};
+	buildEdges();
+	std::vector<int> border_edges(num_vertices, 0); //of every position, going out and coming in
+	std::vector<bool> non_manifold(num_vertices, false);
+	for (auto it = edges.begin(); it != edges.end(); ++it)
+	{
+		unsigned int a = (unsigned int)(it->first >> 32);
+		unsigned int b = (unsigned int)(it->first & 0xFFFFFFFF);
+		if (it->second > 1)
+			non_manifold[a] = non_manifold[b] = true;
+		else if (edges.find(edgeKey(b, a)) == edges.end())
+		{
+			border_edges[a]++;
+			border_edges[b]++;
+		}
+	}
+	std::vector<char> kind(num_vertices, VERTEX_MANIFOLD);
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		unsigned int p = position_of[i];
+		if (non_manifold[p] || vertices_at[p] > 1)
+			kind[i] = VERTEX_LOCKED;
+		else if (border_edges[p] == 2)
+			kind[i] = VERTEX_BORDER;
+		else if (border_edges[p])
+			kind[i] = VERTEX_LOCKED; //more than one border goes through it
+	}
+
+	//planes of the triangles weighted by their area, and perpendicular ones along the open edges
+	std::vector<sQuadric> quadrics(num_vertices);
+	memset(&quadrics[0], 0, sizeof(sQuadric) * num_vertices);
+	for (unsigned int t = 0; t < result.size(); t += 3)
+	{
+		const Vector3& a = POSITION(result[t]);
+		const Vector3& b = POSITION(result[t + 1]);
+		const Vector3& c = POSITION(result[t + 2]);
+		Vector3 normal = (b - a).cross(c - a);
+		float length = (float)normal.length();
+		if (length == 0)
+			continue;
+		normal = normal * (1.0f / length);
+		for (int k = 0; k < 3; ++k)
+			quadrics[result[t + k]].addPlane(normal, -normal.dot(a), length * 0.5f);
+
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v0 = result[t + k];
+			unsigned int v1 = result[t + (k + 1) % 3];
+			if (edges.find(edgeKey(position_of[v1], position_of[v0])) != edges.end())
+				continue;
+			Vector3 edge = POSITION(v1) - POSITION(v0);
+			Vector3 side = edge.cross(normal);
+			float side_length = (float)side.length();
+			if (side_length == 0)
+				continue;
+			side = side * (1.0f / side_length);
+			double weight = edge.dot(edge) * SIMPLIFY_BORDER_WEIGHT;
+			quadrics[v0].addPlane(side, -side.dot(POSITION(v0)), weight);
+			quadrics[v1].addPlane(side, -side.dot(POSITION(v0)), weight);
+		}
+	}
+
+	std::vector<int> offsets(num_vertices + 1);
+	std::vector<int> adjacency;
+	std::vector<sCollapse> collapses;
+	std::vector<unsigned int> remap(num_vertices);
+	std::vector<bool> touched(num_vertices);
+	float max_error_sq = max_error * max_error;
+	for (int pass = 0; pass < SIMPLIFY_MAX_PASSES && (int)result.size() > target_indices; ++pass)
+	{
+		int num_triangles = result.size() / 3;
+
+		//triangles of every vertex
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for (unsigned int i = 0; i < result.size(); ++i)
+			offsets[result[i] + 1]++;
+		for (int i = 0; i < num_vertices; ++i)
+			offsets[i + 1] += offsets[i];
+		adjacency.resize(result.size());
+		std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+		for (unsigned int i = 0; i < result.size(); ++i)
+			adjacency[fill[result[i]]++] = i / 3;
+
+		//every edge in the two directions, the open ones only from the border vertices (the collapses change the edges)
+		if (pass)
+			buildEdges();
+		collapses.resize(0);
+		for (unsigned int i = 0; i < result.size(); ++i)
+		{
+			unsigned int a = result[i];
+			unsigned int b = result[i - i % 3 + (i + 1) % 3];
+			for (int k = 0; k < 2; ++k)
+			{
+				unsigned int from = k ? b : a;
+				unsigned int to = k ? a : b;
+				if (kind[from] == VERTEX_LOCKED)
+					continue;
+				if (kind[from] == VERTEX_BORDER && edges.find(edgeKey(position_of[to], position_of[from])) != edges.end() && edges.find(edgeKey(position_of[from], position_of[to])) != edges.end())
+					continue;
+				sQuadric q = quadrics[from];
+				q.add(quadrics[to]);
+				sCollapse collapse = { from, to, (float)q.error(POSITION(to)) };
+				collapses.push_back(collapse);
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const sCollapse& a, const sCollapse& b) { return a.error < b.error; });
+
+		//the cheapest ones that don't touch the triangles of another collapse, about two triangles go with each one
+		int wanted = std::max((num_triangles - target_indices / 3) / 2, 1);
+		int done = 0;
+		for (int i = 0; i < num_vertices; ++i)
+			remap[i] = i;
+		std::fill(touched.begin(), touched.end(), false);
+		for (unsigned int i = 0; i < collapses.size() && done < wanted; ++i)
+		{
+			const sCollapse& collapse = collapses[i];
+			if (collapse.error > max_error_sq)
+				break;
+			if (touched[collapse.from] || touched[collapse.to])
+				continue;
+
+			//the triangles that stay must not flip (or turn too much)
+			const Vector3& target = POSITION(collapse.to);
+			bool flips = false;
+			for (int j = offsets[collapse.from]; j < offsets[collapse.from + 1] && !flips; ++j)
+			{
+				const unsigned int* tri = &result[adjacency[j] * 3];
+				if (tri[0] == collapse.to || tri[1] == collapse.to || tri[2] == collapse.to)
+					continue;
+				Vector3 p[3] = { POSITION(tri[0]), POSITION(tri[1]), POSITION(tri[2]) };
+				Vector3 before = (p[1] - p[0]).cross(p[2] - p[0]);
+				for (int k = 0; k < 3; ++k)
+					if (tri[k] == collapse.from)
+						p[k] = target;
+				Vector3 after = (p[1] - p[0]).cross(p[2] - p[0]);
+				flips = after.dot(before) <= 0.25f * after.length() * before.length();
+			}
+			if (flips)
+				continue;
+
+			remap[collapse.from] = collapse.to;
+			quadrics[collapse.to].add(quadrics[collapse.from]);
+			for (int j = offsets[collapse.from]; j < offsets[collapse.from + 1]; ++j)
+				for (int k = 0; k < 3; ++k)
+					touched[result[adjacency[j] * 3 + k]] = true;
+			max_error_done = std::max(max_error_done, collapse.error);
+			done++;
+		}
+		if (!done)
+			break;
+
+		//without the triangles that lost an edge
+		int size = 0;
+		for (unsigned int t = 0; t < result.size(); t += 3)
+		{
+			unsigned int a = remap[result[t]], b = remap[result[t + 1]], c = remap[result[t + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			result[size++] = a;
+			result[size++] = b;
+			result[size++] = c;
+		}
+		result.resize(size);
+	}
+	#undef POSITION
+
+	std::copy(result.begin(), result.end(), destination);
+	if (error)
+		*error = sqrt(max_error_done);
+	return result.size();
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+#define SIMPLIFY_BORDER_WEIGHT 10.0f //of the planes that keep the open edges, against the ones of the triangles
+#define SIMPLIFY_MAX_PASSES 32
+
+// Simplifies an index buffer with edge collapses ordered by the quadric error, following "Surface Simplification
+// Using Quadric Error Metrics" (Garland, Heckbert 1997):
+// every vertex keeps the sum of the planes of its triangles (a quadric), so the error of moving it is the sum of
+// the squared distances to them. The collapses are half edge (a vertex goes to the position of a neighbour), so the
+// result uses the same vertex buffer and only the indices change.
+// The vertices in more than one place of the buffer with the same position (seams of the uvs or the normals) are
+// locked, and the ones of the open edges only move along them, so the textures and the outline don't break.
+
+//writes in destination (num_indices at most) the triangles of a simplified version with about target_indices,
+//returns how many indices it has. It stops before when the error of a collapse is more than max_error (distance
+//in the units of the positions, read every stride bytes), error gets the largest one done.
+int simplifyIndices(unsigned int* destination, const unsigned int* indices, int num_indices, const char* positions, int stride, int num_vertices, int target_indices, float max_error, float* error = NULL);
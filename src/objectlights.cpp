@@ -0,0 +1,167 @@
+#include "objectlights.h"
+#include "scene.h"
+#include "jobs.h"
+#include <chrono>
+#include <algorithm>
+
+using namespace GTR;
+
+#define OBJECT_LIGHTS_CHUNK 256 //objects per job
+
+ObjectLights::ObjectLights()
+{
+	cull_lights = true;
+	build_time = 0;
+	num_objects = num_lights = num_pairs = max_per_object = 0;
+}
+
+void ObjectLights::build(const std::vector<BoundingBox>& boxes, const std::vector<LightEntity*>& lights)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	num_objects = boxes.size();
+	num_lights = lights.size();
+	lights_info.resize(lights.size());
+	for (unsigned int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		sLight& info = lights_info[i];
+		info.position = light->model.getTranslation();
+		info.radius = light->max_dist;
+		info.direction = light->model.frontVector();
+		info.direction.normalize();
+		info.cos_angle = cos(light->cone_angle * DEG2RAD);
+		info.sin_angle = sin(light->cone_angle * DEG2RAD);
+		if (light->light_type == DIRECTIONAL || !cull_lights)
+			info.type = 0;
+		else if (light->light_type == SPOT && light->cone_angle < 90)
+			info.type = 2;
+		else
+			info.type = 1;
+	}
+
+	//every chunk writes its own list, the offsets are moved when merging
+	ranges.resize(num_objects * 2);
+	int num_chunks = (num_objects + OBJECT_LIGHTS_CHUNK - 1) / OBJECT_LIGHTS_CHUNK;
+	if ((int)chunk_indices.size() < num_chunks)
+	{
+		chunk_indices.resize(num_chunks);
+		chunk_ends.resize(num_chunks);
+	}
+	if (num_chunks)
+		JobPool::Get()->parallelFor(num_objects, num_chunks, [&](int begin, int end, int chunk) {
+			buildChunk(boxes, begin, end, chunk);
+			chunk_ends[chunk] = end;
+		});
+
+	//merge the lists of the chunks in order and move the offsets
+	indices.resize(0);
+	max_per_object = 0;
+	int object = 0;
+	for (int k = 0; k < num_chunks; ++k)
+	{
+		uint32 base = indices.size();
+		for (; object < chunk_ends[k]; ++object)
+		{
+			ranges[object * 2] += base;
+			max_per_object = std::max(max_per_object, (int)ranges[object * 2 + 1]);
+		}
+		indices.insert(indices.end(), chunk_indices[k].begin(), chunk_indices[k].end());
+	}
+	num_pairs = indices.size();
+
+	build_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+}
+
+void ObjectLights::buildChunk(const std::vector<BoundingBox>& boxes, int begin, int end, int chunk)
+{
+	std::vector<uint32>& out = chunk_indices[chunk];
+	out.resize(0);
+
+	for (int o = begin; o < end; ++o)
+	{
+		const BoundingBox& box = boxes[o];
+		Vector3 box_min = box.center - box.halfsize;
+		Vector3 box_max = box.center + box.halfsize;
+		float box_radius = box.halfsize.length();
+		uint32 start = out.size();
+
+		for (unsigned int i = 0; i < lights_info.size(); ++i)
+		{
+			sLight& light = lights_info[i];
+			if (light.type)
+			{
+				//sphere vs aabb: distance from the center to the box
+				Vector3& p = light.position;
+				float dx = std::max(std::max(box_min.x - p.x, p.x - box_max.x), 0.0f);
+				float dy = std::max(std::max(box_min.y - p.y, p.y - box_max.y), 0.0f);
+				float dz = std::max(std::max(box_min.z - p.z, p.z - box_max.z), 0.0f);
+				if (dx * dx + dy * dy + dz * dz > light.radius * light.radius)
+					continue;
+
+				//cone vs bounding sphere of the box
+				if (light.type == 2)
+				{
+					Vector3 v = box.center - p;
+					float v1 = v.dot(light.direction);
+					float closest = light.cos_angle * sqrt(std::max(v.dot(v) - v1 * v1, 0.0f)) - v1 * light.sin_angle;
+					if (closest > box_radius || v1 > box_radius + light.radius || v1 < -box_radius)
+						continue;
+				}
+			}
+			out.push_back(i);
+		}
+
+		//offset inside the chunk, build() adds the start of the chunk
+		ranges[o * 2] = start;
+		ranges[o * 2 + 1] = out.size() - start;
+	}
+}
+
+void ObjectLights::upload(const void* lights_data, int light_size)
+{
+	if (!lights_tbo.buffer_id)
+	{
+		lights_tbo.create(GL_RGBA32F);
+		ranges_tbo.create(GL_RG32UI);
+		indices_tbo.create(GL_R32UI);
+	}
+
+	//the shader can't fetch from empty buffers
+	static const float empty[16] = { 0 };
+	if (num_lights)
+		lights_tbo.update(lights_data, num_lights * light_size);
+	else
+		lights_tbo.update(empty, sizeof(empty));
+	if (num_objects)
+		ranges_tbo.update(&ranges[0], ranges.size() * sizeof(uint32));
+	else
+		ranges_tbo.update(empty, sizeof(uint32) * 2);
+	if (indices.size())
+		indices_tbo.update(&indices[0], indices.size() * sizeof(uint32));
+	else
+		indices_tbo.update(empty, sizeof(uint32));
+}
+
+void ObjectLights::getLights(int first, int count, std::vector<uint32>& result, std::vector<uint32>& marks)
+{
+	if (count == 1)
+	{
+		result.insert(result.end(), indices.begin() + ranges[first * 2], indices.begin() + ranges[first * 2] + ranges[first * 2 + 1]);
+		return;
+	}
+
+	int start = result.size();
+	marks.assign(num_lights, 0);
+	for (int o = first; o < first + count; ++o)
+		for (uint32 k = 0; k < ranges[o * 2 + 1]; ++k)
+		{
+			uint32 light = indices[ranges[o * 2] + k];
+			if (!marks[light])
+			{
+				marks[light] = 1;
+				result.push_back(light);
+			}
+		}
+	std::sort(result.begin() + start, result.end());
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "framework.h"
+#include "ubo.h"
+#include <vector>
+
+namespace GTR {
+
+	class LightEntity;
+
+	// List of the lights that reach every render call, computed once per frame on the CPU
+	// by testing the light spheres (and the cones of the spots) against the world box of the object.
+	// The single pass shader only loops the lights of its object and the multipass only renders those passes.
+	// The objects are split in chunks, one job each.
+	class ObjectLights
+	{
+	public:
+		bool cull_lights; //if false every object gets all the lights (to compare)
+
+		//result of build, uploaded to the GPU
+		std::vector<uint32> ranges;		//offset and count in indices of every object
+		std::vector<uint32> indices;	//lights of every object, sorted like the light vector
+
+		//stats
+		float build_time; //ms
+		int num_objects;
+		int num_lights;
+		int num_pairs; //light-object pairs
+		int max_per_object;
+
+		//buffers read by get_lightslist_uniforms
+		TBO lights_tbo;
+		TBO ranges_tbo;
+		TBO indices_tbo;
+
+		ObjectLights();
+
+		//finds the lights of every box (index in the vector = index in the light buffer)
+		void build(const std::vector<BoundingBox>& boxes, const std::vector<LightEntity*>& lights);
+
+		//uploads the lists and the data of every light (light_size bytes each)
+		void upload(const void* lights_data, int light_size);
+
+		//adds to result the lights that reach any of the objects [first, first + count), sorted, without repetitions
+		//(marks is a buffer of the caller, so several threads can ask at the same time)
+		void getLights(int first, int count, std::vector<uint32>& result, std::vector<uint32>& marks);
+
+	private:
+		struct sLight {
+			Vector3 position;
+			float radius;
+			Vector3 direction;
+			float cos_angle;
+			float sin_angle;
+			int type; //0 directional (always), 1 sphere, 2 sphere and cone
+		};
+		std::vector<sLight> lights_info;
+
+		//output of every chunk, merged after the jobs
+		std::vector< std::vector<uint32> > chunk_indices;
+		std::vector<int> chunk_ends; //last object (not included) of every chunk
+
+		void buildChunk(const std::vector<BoundingBox>& boxes, int begin, int end, int chunk);
+	};
+
+};
@@ -0,0 +1,336 @@
+#include "occlusion.h"
+#include "jobs.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define OCCLUSION_SSE
+	#include <xmmintrin.h>
+#endif
+
+using namespace GTR;
+
+static const Vector3 box_corners[8] = { {1,1,1}, {1,1,-1}, {1,-1,1}, {1,-1,-1}, {-1,1,1}, {-1,1,-1}, {-1,-1,1}, {-1,-1,-1} };
+
+OcclusionBuffer::OcclusionBuffer(int width, int height)
+{
+	use_simd = true;
+	num_occluders = num_triangles = num_tested = num_occluded = 0;
+	resize(width, height);
+}
+
+void OcclusionBuffer::resize(int width, int height)
+{
+	//whole tiles, so the rasterizer never checks the borders of the buffer
+	tiles_x = (width + OCCLUSION_TILE_W - 1) / OCCLUSION_TILE_W;
+	tiles_y = (height + OCCLUSION_TILE_H - 1) / OCCLUSION_TILE_H;
+	this->width = tiles_x * OCCLUSION_TILE_W;
+	this->height = tiles_y * OCCLUSION_TILE_H;
+	depth.resize(this->width * this->height);
+	tile_max.resize(tiles_x * tiles_y);
+	tile_triangles.resize(tiles_x * tiles_y);
+}
+
+void OcclusionBuffer::begin(const Matrix44& viewprojection)
+{
+	this->viewprojection = viewprojection;
+	std::fill(depth.begin(), depth.end(), 1.0f);
+	std::fill(tile_max.begin(), tile_max.end(), 1.0f);
+	for (unsigned int i = 0; i < tile_triangles.size(); ++i)
+		tile_triangles[i].resize(0);
+	triangles.resize(0);
+	num_occluders = num_triangles = num_tested = num_occluded = 0;
+}
+
+void OcclusionBuffer::addOccluder(const Matrix44& model, const Vector3* vertices, int stride, int num_vertices, const unsigned int* indices, int num_indices)
+{
+	Matrix44 mvp = model * viewprojection;
+	int num = indices ? num_indices : num_vertices;
+	num_occluders++;
+
+	for (int i = 0; i + 2 < num; i += 3)
+	{
+		Vector4 clip[3];
+		for (int j = 0; j < 3; ++j)
+		{
+			int index = indices ? indices[i + j] : i + j;
+			const Vector3& v = *(const Vector3*)((const char*)vertices + index * stride);
+			clip[j] = mvp * Vector4(v.x, v.y, v.z, 1.0f);
+		}
+
+		//clip against the near plane and a guard band around the sides,
+		//so the screen coordinates stay small enough for the float edge functions
+		Vector4 poly[2][9];
+		int n = 3;
+		poly[0][0] = clip[0];
+		poly[0][1] = clip[1];
+		poly[0][2] = clip[2];
+		int src = 0;
+		for (int plane = 0; plane < 5 && n >= 3; ++plane)
+		{
+			Vector4* in = poly[src];
+			Vector4* out = poly[1 - src];
+			int num_out = 0;
+			for (int j = 0; j < n; ++j)
+			{
+				int k = (j + 1) % n;
+				float dj = clipDistance(in[j], plane);
+				float dk = clipDistance(in[k], plane);
+				if (dj >= 0)
+					out[num_out++] = in[j];
+				if ((dj >= 0) != (dk >= 0))
+					out[num_out++] = lerp(in[j], in[k], dj / (dj - dk));
+			}
+			n = num_out;
+			src = 1 - src;
+		}
+
+		for (int j = 1; j + 1 < n; ++j)
+			addTriangle(poly[src][0], poly[src][j], poly[src][j + 1]);
+	}
+}
+
+//signed distance to the clipping planes: near, left, right, bottom, top (with guard band)
+float OcclusionBuffer::clipDistance(const Vector4& v, int plane)
+{
+	const float guard = 2.0f;
+	switch (plane)
+	{
+		case 0: return v.z + v.w;
+		case 1: return v.w * guard + v.x;
+		case 2: return v.w * guard - v.x;
+		case 3: return v.w * guard + v.y;
+		default: return v.w * guard - v.y;
+	}
+}
+
+void OcclusionBuffer::addTriangle(const Vector4& a, const Vector4& b, const Vector4& c)
+{
+	const Vector4* v[3] = { &a, &b, &c };
+	sTriangle tri;
+	for (int j = 0; j < 3; ++j)
+	{
+		float inv_w = 1.0f / v[j]->w;
+		tri.x[j] = (v[j]->x * inv_w * 0.5f + 0.5f) * width;
+		tri.y[j] = (v[j]->y * inv_w * 0.5f + 0.5f) * height;
+		tri.z[j] = v[j]->z * inv_w * 0.5f + 0.5f;
+	}
+
+	//counter clockwise, so the edge functions are positive inside
+	float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.y[1] - tri.y[0]) * (tri.x[2] - tri.x[0]);
+	if (fabs(area) < 1e-8f)
+		return;
+	if (area < 0)
+	{
+		std::swap(tri.x[1], tri.x[2]);
+		std::swap(tri.y[1], tri.y[2]);
+		std::swap(tri.z[1], tri.z[2]);
+	}
+
+	float min_x = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+	float max_x = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+	float min_y = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+	float max_y = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+	if (max_x < 0 || max_y < 0 || min_x >= width || min_y >= height)
+		return;
+
+	int index = triangles.size();
+	triangles.push_back(tri);
+	num_triangles++;
+
+	//bin it in every tile touched by its bounds
+	int tx0 = (int)std::max(0.0f, min_x) / OCCLUSION_TILE_W;
+	int tx1 = (int)std::min(width - 1.0f, max_x) / OCCLUSION_TILE_W;
+	int ty0 = (int)std::max(0.0f, min_y) / OCCLUSION_TILE_H;
+	int ty1 = (int)std::min(height - 1.0f, max_y) / OCCLUSION_TILE_H;
+	for (int ty = ty0; ty <= ty1; ++ty)
+		for (int tx = tx0; tx <= tx1; ++tx)
+			tile_triangles[ty * tiles_x + tx].push_back(index);
+}
+
+void OcclusionBuffer::rasterize()
+{
+	//tiles don't share pixels, one job each
+	JobPool::Get()->parallelFor(tiles_x * tiles_y, tiles_x * tiles_y, [&](int begin, int end, int chunk) {
+		for (int t = begin; t < end; ++t)
+			rasterizeTile(t);
+	});
+}
+
+void OcclusionBuffer::rasterizeTile(int tile)
+{
+	std::vector<int>& list = tile_triangles[tile];
+	if (list.empty())
+		return;
+
+	int tile_x0 = (tile % tiles_x) * OCCLUSION_TILE_W;
+	int tile_y0 = (tile / tiles_x) * OCCLUSION_TILE_H;
+	int tile_x1 = tile_x0 + OCCLUSION_TILE_W - 1;
+	int tile_y1 = tile_y0 + OCCLUSION_TILE_H - 1;
+
+	for (unsigned int i = 0; i < list.size(); ++i)
+	{
+		sTriangle& tri = triangles[list[i]];
+
+		//pixels whose center is inside the bounds
+		float min_x = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+		float max_x = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+		float min_y = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+		float max_y = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+		int x0 = std::max(tile_x0, (int)ceil(min_x - 0.5f));
+		int x1 = std::min(tile_x1, (int)floor(max_x - 0.5f));
+		int y0 = std::max(tile_y0, (int)ceil(min_y - 0.5f));
+		int y1 = std::min(tile_y1, (int)floor(max_y - 0.5f));
+		if (x0 > x1 || y0 > y1)
+			continue;
+		x0 &= ~3; //groups of 4 pixels, the tile starts aligned
+
+		//edge functions E(x,y) = a*x + b*y + c and depth plane
+		float ea[3], eb[3], ec[3];
+		for (int e = 0; e < 3; ++e)
+		{
+			int f = (e + 1) % 3;
+			ea[e] = -(tri.y[f] - tri.y[e]);
+			eb[e] = tri.x[f] - tri.x[e];
+			ec[e] = -(ea[e] * tri.x[e] + eb[e] * tri.y[e]);
+		}
+		float area = eb[0] * (tri.y[2] - tri.y[0]) + ea[0] * (tri.x[2] - tri.x[0]);
+		float dzdx = ((tri.z[1] - tri.z[0]) * (tri.y[2] - tri.y[0]) - (tri.z[2] - tri.z[0]) * (tri.y[1] - tri.y[0])) / area;
+		float dzdy = ((tri.z[2] - tri.z[0]) * (tri.x[1] - tri.x[0]) - (tri.z[1] - tri.z[0]) * (tri.x[2] - tri.x[0])) / area;
+		float zc = tri.z[0] - dzdx * tri.x[0] - dzdy * tri.y[0];
+
+		for (int y = y0; y <= y1; ++y)
+		{
+			float cy = y + 0.5f;
+			float* row = &depth[y * width];
+#ifdef OCCLUSION_SSE
+			if (use_simd)
+			{
+				__m128 zero = _mm_setzero_ps();
+				__m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+				__m128 va0 = _mm_set1_ps(ea[0]), va1 = _mm_set1_ps(ea[1]), va2 = _mm_set1_ps(ea[2]);
+				__m128 row0 = _mm_set1_ps(eb[0] * cy + ec[0]);
+				__m128 row1 = _mm_set1_ps(eb[1] * cy + ec[1]);
+				__m128 row2 = _mm_set1_ps(eb[2] * cy + ec[2]);
+				__m128 vdzdx = _mm_set1_ps(dzdx);
+				__m128 rowz = _mm_set1_ps(dzdy * cy + zc);
+				for (int x = x0; x <= x1; x += 4)
+				{
+					__m128 cx = _mm_add_ps(_mm_set1_ps((float)x), offsets);
+					__m128 e0 = _mm_add_ps(_mm_mul_ps(va0, cx), row0);
+					__m128 e1 = _mm_add_ps(_mm_mul_ps(va1, cx), row1);
+					__m128 e2 = _mm_add_ps(_mm_mul_ps(va2, cx), row2);
+					__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+					if (_mm_movemask_ps(inside) == 0)
+						continue;
+					__m128 z = _mm_add_ps(_mm_mul_ps(vdzdx, cx), rowz);
+					__m128 old = _mm_loadu_ps(row + x);
+					__m128 closest = _mm_min_ps(old, z);
+					_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, closest), _mm_andnot_ps(inside, old)));
+				}
+				continue;
+			}
+#endif
+			for (int x = x0; x <= x1; ++x)
+			{
+				float cx = x + 0.5f;
+				if (ea[0] * cx + eb[0] * cy + ec[0] < 0 || ea[1] * cx + eb[1] * cy + ec[1] < 0 || ea[2] * cx + eb[2] * cy + ec[2] < 0)
+					continue;
+				float z = dzdx * cx + dzdy * cy + zc;
+				if (z < row[x])
+					row[x] = z;
+			}
+		}
+	}
+
+	float farthest = 0;
+	for (int y = tile_y0; y <= tile_y1; ++y)
+		for (int x = tile_x0; x <= tile_x1; ++x)
+			farthest = std::max(farthest, depth[y * width + x]);
+	tile_max[tile] = farthest;
+}
+
+//screen bounds (pixels) and closest depth of the box, false if it crosses the near plane
+bool OcclusionBuffer::projectBox(const BoundingBox& box, float& min_x, float& min_y, float& max_x, float& max_y, float& min_z)
+{
+	min_x = min_y = min_z = 1e10f;
+	max_x = max_y = -1e10f;
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 corner = box.center + box.halfsize * box_corners[i];
+		Vector4 clip = viewprojection * Vector4(corner.x, corner.y, corner.z, 1.0f);
+		if (clip.w <= 1e-6f || clip.z < -clip.w)
+			return false;
+		float inv_w = 1.0f / clip.w;
+		float x = (clip.x * inv_w * 0.5f + 0.5f) * width;
+		float y = (clip.y * inv_w * 0.5f + 0.5f) * height;
+		float z = clip.z * inv_w * 0.5f + 0.5f;
+		min_x = std::min(min_x, x);
+		max_x = std::max(max_x, x);
+		min_y = std::min(min_y, y);
+		max_y = std::max(max_y, y);
+		min_z = std::min(min_z, z);
+	}
+	return true;
+}
+
+float OcclusionBuffer::projectedArea(const BoundingBox& box)
+{
+	float min_x, min_y, max_x, max_y, min_z;
+	if (!projectBox(box, min_x, min_y, max_x, max_y, min_z))
+		return 1.0f;
+	float w = std::min(max_x, (float)width) - std::max(min_x, 0.0f);
+	float h = std::min(max_y, (float)height) - std::max(min_y, 0.0f);
+	if (w <= 0 || h <= 0)
+		return 0.0f;
+	return (w * h) / (width * height);
+}
+
+bool OcclusionBuffer::testBox(const BoundingBox& box)
+{
+	num_tested++;
+	float min_x, min_y, max_x, max_y, min_z;
+	if (!projectBox(box, min_x, min_y, max_x, max_y, min_z))
+		return true;
+
+	//every pixel touched by the bounds
+	if (max_x < 0 || max_y < 0 || min_x >= width || min_y >= height)
+		return true;
+	int x0 = (int)std::max(0.0f, floorf(min_x));
+	int x1 = (int)std::min(width - 1.0f, floorf(max_x));
+	int y0 = (int)std::max(0.0f, floorf(min_y));
+	int y1 = (int)std::min(height - 1.0f, floorf(max_y));
+
+	for (int ty = y0 / OCCLUSION_TILE_H; ty <= y1 / OCCLUSION_TILE_H; ++ty)
+	for (int tx = x0 / OCCLUSION_TILE_W; tx <= x1 / OCCLUSION_TILE_W; ++tx)
+	{
+		//all the tile is closer than the box
+		if (tile_max[ty * tiles_x + tx] < min_z)
+			continue;
+
+		int px0 = std::max(x0, tx * OCCLUSION_TILE_W);
+		int px1 = std::min(x1, tx * OCCLUSION_TILE_W + OCCLUSION_TILE_W - 1);
+		int py0 = std::max(y0, ty * OCCLUSION_TILE_H);
+		int py1 = std::min(y1, ty * OCCLUSION_TILE_H + OCCLUSION_TILE_H - 1);
+		for (int y = py0; y <= py1; ++y)
+		{
+			const float* row = &depth[y * width];
+			int x = px0;
+#ifdef OCCLUSION_SSE
+			if (use_simd)
+			{
+				__m128 vz = _mm_set1_ps(min_z);
+				for (; x + 3 <= px1; x += 4)
+					if (_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(row + x), vz)))
+						return true;
+			}
+#endif
+			for (; x <= px1; ++x)
+				if (row[x] >= min_z)
+					return true;
+		}
+	}
+
+	num_occluded++;
+	return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+namespace GTR {
+
+	//size of the tiles of the occlusion buffer (the width must be a multiple of 4)
+	#define OCCLUSION_TILE_W 32
+	#define OCCLUSION_TILE_H 16
+
+	// Low resolution depth buffer rasterized on the CPU, used to discard objects hidden behind big occluders
+	// before sending them to the GPU. It doesn't use OpenGL at all, so it can be used (and tested) without a context.
+	// Usage: begin(viewprojection), addOccluder() for every occluder, rasterize(), then testBox() for every object.
+	// The triangles are binned in tiles and every tile is rasterized by a different job, 4 pixels at once (SSE).
+	class OcclusionBuffer
+	{
+	public:
+		int width;
+		int height;
+		int tiles_x;
+		int tiles_y;
+		std::vector<float> depth; //window depth [0..1] of the closest occluder, 1 where there is nothing
+		std::vector<float> tile_max; //farthest depth of every tile, to accept/reject whole tiles
+		Matrix44 viewprojection;
+		bool use_simd;
+
+		//stats
+		int num_occluders;
+		int num_triangles; //after clipping
+		int num_tested;
+		int num_occluded;
+
+		OcclusionBuffer(int width = 256, int height = 128);
+
+		void resize(int width, int height);
+
+		//clears the buffer and sets the camera
+		void begin(const Matrix44& viewprojection);
+
+		//transforms, clips and bins the triangles of a mesh (positions every stride bytes, indices can be NULL)
+		void addOccluder(const Matrix44& model, const Vector3* vertices, int stride, int num_vertices, const unsigned int* indices, int num_indices);
+
+		//rasterizes all the binned triangles
+		void rasterize();
+
+		//false if the box is hidden behind the occluders for sure
+		bool testBox(const BoundingBox& box);
+
+		//fraction of the buffer covered by the projection of the box (1 if it crosses the near plane)
+		float projectedArea(const BoundingBox& box);
+
+	private:
+		struct sTriangle {
+			float x[3]; //pixels
+			float y[3];
+			float z[3]; //window depth
+		};
+		std::vector<sTriangle> triangles;
+		std::vector< std::vector<int> > tile_triangles;
+
+		static float clipDistance(const Vector4& v, int plane);
+		void addTriangle(const Vector4& a, const Vector4& b, const Vector4& c);
+		void rasterizeTile(int tile);
+		bool projectBox(const BoundingBox& box, float& min_x, float& min_y, float& max_x, float& max_y, float& min_z);
+	};
+
+};
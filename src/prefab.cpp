@@ -17,8 +17,9 @@
 using namespace GTR;
 
 int Node::s_NodeID = 0;
+int Node::s_edits = 0;
 
-Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF)
+Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), occluder(false), layers(0xFF)
 {
 	m_Id = s_NodeID++;
 }
@@ -148,11 +149,15 @@ void Node::renderInMenu()
 {
 #ifndef SKIP_IMGUI
 	ImGui::Text("Name: %s", name.c_str()); // Edit 3 floats representing a color
+	ImGui::Checkbox("Occluder", &occluder);
 
 	ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.75f, 0.75f, 0.75f, 1.0f));
 
 	//Model edit
+	Matrix44 prev_model = model;
 	ImGuiMatrix44(model, "Model");
+	if (memcmp(prev_model.m, model.m, sizeof(model.m)) != 0)
+		s_edits++;
 
 	//Material
 	if (material && ImGui::TreeNode(material, "Material"))
@@ -27,6 +27,7 @@ namespace GTR {
 	{
 	public:
 		static int s_NodeID;
+		static int s_edits; //changes done from the menu, the renderer rebuilds what it keeps of the prefabs
 		int m_Id;
 
 	public:
@@ -35,6 +36,7 @@ namespace GTR {
 	public:
 		std::string name;
 		bool visible;
+		bool occluder; //always used as occluder by the software occlusion culling
 		int layers;
 
 		Mesh* mesh;
@@ -12,6 +12,9 @@
 #include <random>
 #include "framework.h"
 #include "application.h"
+#include "jobs.h"
+#include "ringbuffer.h"
+#include <chrono>
 
 using namespace GTR;
 
@@ -21,6 +24,73 @@ GTR::Renderer::Renderer()
 	this->rendering_shadowmap = TRUE;
 	this->pipeline_mode = ePipelineMode::FORWARD;
 	this->show_gbuffers = false;
+	this->render_width = width;
+	this->render_height = height;
+	this->gbuffer_layout = GBUFFER_BASIC;
+	this->use_hdr_illumination = false;
+	this->use_stencil_volumes = true;
+	this->light_pixel_stats = false;
+	this->num_light_queries = 0;
+
+	this->use_parallel_collect = true;
+	this->compare_collect = false;
+	this->collect_match = true;
+	this->collect_time = 0;
+	this->use_bvh = true;
+
+	this->use_lods = true;
+	this->lod_max_error = 1.0f;
+	this->lod_hysteresis = 0.25f;
+
+	this->use_occlusion = true;
+	this->occluder_min_area = 0.05;
+	this->occluder_max_triangles = 20000;
+	this->max_occluders = 16;
+	this->occlusion_time = 0;
+	this->num_occlusion_culled = 0;
+
+	this->use_render_cache = true;
+	this->max_patched_entities = 8;
+	this->render_list_state = LIST_COLLECTED;
+	this->num_patched_entities = 0;
+	this->render_list_valid = false;
+
+	this->use_sort_keys = true;
+	this->sort_stats = false;
+	this->shader_switches = this->material_switches = 0;
+	this->dist_shader_switches = this->dist_material_switches = 0;
+
+	this->use_state_cache = true;
+
+	this->use_instancing = true;
+	this->num_instanced_draws = this->num_instanced_rcs = 0;
+
+	//the shaders read these blocks from fixed binding points
+	Shader::registerUniformBlock("CameraBlock", UBO_CAMERA);
+	Shader::registerUniformBlock("LightsBlock", UBO_LIGHTS);
+	Shader::registerUniformBlock("MaterialBlock", UBO_MATERIAL);
+	this->num_block_lights = 0;
+
+	this->use_parallel_record = true;
+	this->record_time = 0;
+
+	this->use_depth_prepass = true;
+	this->depth_prepass_done = false;
+	this->num_prepass_triangles = 0;
+	this->fragments_query = 0;
+	this->fragments_query_prepass = -1;
+	this->num_fragments_shaded = 0;
+	this->fragments_shaded[0] = this->fragments_shaded[1] = 0;
+
+	this->use_oit = true;
+	this->num_transparent_rcs = 0;
+	this->transparency_depth = NULL;
+
+	this->use_shadows = true;
+
+	this->use_light_clusters = true;
+	this->run_light_benchmark = false;
+	this->bench_num_lights = 0;
 
 	color_buffer = new Texture(Application::instance->window_width, Application::instance->window_height);
 	this->fbo.setTexture(color_buffer); // para evitar de hacerlo en cada frame 
@@ -29,6 +99,11 @@ GTR::Renderer::Renderer()
 
 // render in texture
 void Renderer::render2FBO(GTR::Scene* scene, Camera* camera) {
+	if (run_light_benchmark)
+	{
+		benchmarkLights(scene, camera);
+		run_light_benchmark = false;
+	}
 	renderScene(scene, camera);
 	//drawGrid();
 	//fbo.bind();
@@ -60,10 +135,100 @@ struct sortRC {
 
 void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 {
+	gl_state.resetCounters();
+	num_instanced_draws = num_instanced_rcs = 0;
+
+	//the streamed data of this frame goes to a part the GPU has finished reading
+	RingBuffer::Get()->nextFrame();
+
+	//the time of the old frames decides the scale of this one
+	dynamic_resolution.beginFrame();
+	width = Application::instance->window_width;
+	height = Application::instance->window_height;
+	render_width = width;
+	render_height = height;
+	if (pipeline_mode == DEFERRED)
+		dynamic_resolution.getSize(width, height, render_width, render_height);
 	
-	collectRenderCalls(scene, camera);
+	auto t0 = std::chrono::high_resolution_clock::now();
+
+	//the list of the last frame is still valid if nothing moved, or only needs the entities that moved
+	int num_moved = use_render_cache ? checkRenderList(scene, camera) : -1;
+	if (num_moved == 0)
+	{
+		collectLights(scene, camera);
+		render_list_state = LIST_REUSED;
+		num_patched_entities = 0;
+	}
+	else if (num_moved > 0 && num_moved <= max_patched_entities)
+	{
+		patchRenderList(scene, camera);
+		render_list_state = LIST_PATCHED;
+		num_patched_entities = num_moved;
+	}
+	else
+	{
+		if (use_bvh)
+			collectRenderCallsBVH(scene, camera);
+		else if (use_parallel_collect)
+			collectRenderCallsParallel(scene, camera);
+		else
+			collectRenderCalls(scene, camera);
+		if (use_render_cache)
+			storeRenderList(scene, camera);
+		render_list_state = LIST_COLLECTED;
+		num_patched_entities = 0;
+	}
+	collect_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+
+	//debug: run the other path and check both lists are identical (same order, same bits)
+	if (compare_collect && render_list_state == LIST_COLLECTED)
+	{
+		std::vector<RenderCall> rcs = this->rc_data_list;
+		std::vector<LightEntity*> lights = this->light_entities;
+		if (use_bvh || use_parallel_collect)
+			collectRenderCalls(scene, camera);
+		else
+			collectRenderCallsParallel(scene, camera);
+		collect_match = rcs.size() == rc_data_list.size() && lights == light_entities;
+		for (unsigned int i = 0; collect_match && i < rcs.size(); ++i)
+		{
+			RenderCall& a = rcs[i];
+			RenderCall& b = rc_data_list[i];
+			collect_match = a.mesh == b.mesh && a.material == b.material && memcmp(a.model.m, b.model.m, sizeof(a.model.m)) == 0 && memcmp(&a.dist2camera, &b.dist2camera, sizeof(float)) == 0;
+		}
+		if (!collect_match)
+			std::cout << "[WARN] fast and serial render calls differ: " << rcs.size() << " vs " << rc_data_list.size() << std::endl;
+	}
+
+	//remove what is hidden behind big objects
+	if (use_occlusion && render_list_state != LIST_REUSED)
+		occlusionCull(camera);
+
+	//extra lights of the benchmark
+	if (bench_num_lights)
+		light_entities.insert(light_entities.end(), bench_lights.begin(), bench_lights.begin() + bench_num_lights);
+
 	//sort each rcs after rendering one pass of all the scene
-	std::sort(this->rc_data_list.begin(), this->rc_data_list.end(), sortRC());
+	if (render_list_state != LIST_REUSED)
+		sortRenderCalls(pipeline_mode == DEFERRED ? GBUFFERS : render_mode, camera);
+
+	//shadow maps of the lights that changed (the light data says where they are)
+	updateShadows(scene, camera);
+
+	//per frame data for all the shaders
+	uploadLightsBlock();
+	uploadCameraBlock(scene, camera);
+
+	num_transparent_rcs = 0;
+	for (unsigned int i = 0; i < rc_data_list.size(); ++i)
+		if (rc_data_list[i].material->alpha_mode == BLEND)
+			num_transparent_rcs++;
+
+	//only the lights that touch every object in the forward light modes (and in the transparency pass)
+	bool transparency_pass = useTransparencyPass(pipeline_mode == DEFERRED ? GBUFFERS : render_mode) && num_transparent_rcs;
+	if ((pipeline_mode == FORWARD && (render_mode == SINGLE || render_mode == MULTI)) || transparency_pass)
+		computeObjectLights();
 
 	
 	if (pipeline_mode == FORWARD) 
@@ -72,6 +237,8 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 	else if (pipeline_mode == DEFERRED)
 		renderDeferred(scene, this->rc_data_list, camera);
 
+	dynamic_resolution.endFrame();
+
 	
 	
 }
@@ -82,6 +249,7 @@ void Renderer::collectRenderCalls(GTR::Scene* scene, Camera* camera) {
 	//clear data_lists
 	this->rc_data_list.resize(0); //like .clear but keep the capacity, so there are fewer reallocations.
 	this->light_entities.resize(0);
+	this->entity_num_rcs.assign(scene->entities.size(), 0);
 
 	//render entities
 	for (int i = 0; i < scene->entities.size(); ++i)
@@ -94,10 +262,12 @@ void Renderer::collectRenderCalls(GTR::Scene* scene, Camera* camera) {
 		if (ent->entity_type == PREFAB)
 		{
 			PrefabEntity* pent = (GTR::PrefabEntity*)ent; //down-cast 
+			int first = rc_data_list.size();
 			if (pent->prefab)
 
-				getRCsfromPrefab(ent->model, pent->prefab, camera);
+				getRCsfromPrefab(ent->model, pent->prefab, camera, pent->lod_levels);
 
+			entity_num_rcs[i] = rc_data_list.size() - first;
 		}
 
 		//is a light!
@@ -118,126 +288,703 @@ void Renderer::collectRenderCalls(GTR::Scene* scene, Camera* camera) {
 	}
 }
 
+//collect all RC using the worker threads. Each chunk of entities writes in its own buffer
+//and then they are appended in chunk order, so the result is the same as the serial one
+void Renderer::collectRenderCallsParallel(GTR::Scene* scene, Camera* camera) {
 
-void GTR::Renderer::renderForward(GTR::Scene* scene, std::vector <RenderCall>& rendercalls, Camera* camera)
+	JobPool* pool = JobPool::Get();
+	int num_entities = scene->entities.size();
+	//some more chunks than threads because prefabs can be very different in size
+	int num_chunks = std::min(num_entities, pool->num_threads * 4);
+	if (num_chunks < 1)
+		num_chunks = 1;
+
+	if ((int)rc_thread_lists.size() < num_chunks) {
+		rc_thread_lists.resize(num_chunks);
+		light_thread_lists.resize(num_chunks);
+	}
+	entity_num_rcs.assign(num_entities, 0); //every job writes the ones of its entities
+
+	pool->parallelFor(num_entities, num_chunks, [&](int begin, int end, int chunk) {
+		std::vector<RenderCall>& rcs = rc_thread_lists[chunk];
+		std::vector<LightEntity*>& lights = light_thread_lists[chunk];
+		rcs.resize(0);
+		lights.resize(0);
+
+		for (int i = begin; i < end; ++i)
+		{
+			BaseEntity* ent = scene->entities[i];
+			if (!ent->visible)
+				continue;
+
+			if (ent->entity_type == PREFAB)
+			{
+				PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+				int first = rcs.size();
+				int lod_index = 0;
+				if (pent->prefab)
+					getRCsfromNodeTo(rcs, ent->model, Matrix44(), &pent->prefab->root, camera, pent->lod_levels, lod_index);
+				entity_num_rcs[i] = rcs.size() - first;
+			}
+			else if (ent->entity_type == LIGHT)
+			{
+				LightEntity* lig = (GTR::LightEntity*)ent;
+				Vector3 light_pos = lig->model.getTranslation();
+				if (lig->light_type != eLightType::DIRECTIONAL && camera->testSphereInFrustum(light_pos, lig->max_dist) == CLIP_OUTSIDE)
+					continue;
+				lights.push_back(lig);
+			}
+		}
+	});
+
+	//merge
+	int total = 0;
+	for (int i = 0; i < num_chunks; ++i)
+		total += rc_thread_lists[i].size();
+	this->rc_data_list.resize(total);
+	this->light_entities.resize(0);
+	int pos = 0;
+	for (int i = 0; i < num_chunks; ++i)
+	{
+		std::vector<RenderCall>& rcs = rc_thread_lists[i];
+		if (rcs.size())
+			std::copy(rcs.begin(), rcs.end(), rc_data_list.begin() + pos);
+		pos += rcs.size();
+		light_entities.insert(light_entities.end(), light_thread_lists[i].begin(), light_thread_lists[i].end());
+	}
+}
+void Renderer::collectRenderCallsBVH(GTR::Scene* scene, Camera* camera) {
+
+	//refit what moved since the last frame and go down the tree
+	bvh.update(scene);
+	bvh.cull(camera, bvh_visible);
+
+	this->rc_data_list.resize(bvh_visible.size());
+	for (unsigned int i = 0; i < bvh_visible.size(); ++i)
+	{
+		SceneBVH::sLeaf& leaf = bvh.leaves[bvh_visible[i]];
+		RenderCall& rc = rc_data_list[i];
+		std::vector<unsigned char>& lod_levels = ((PrefabEntity*)leaf.entity)->lod_levels;
+		if ((int)lod_levels.size() <= leaf.index)
+			lod_levels.resize(leaf.index + 1, 0);
+		rc.model = leaf.model;
+		rc.material = leaf.node->material;
+		rc.mesh = selectLOD(leaf.node->mesh, leaf.box, camera, lod_levels[leaf.index]);
+		rc.dist2camera = camera->eye.distance(leaf.box.center);
+		rc.sort_key = 0;
+		rc.occluder = leaf.node->occluder;
+	}
+
+	//render calls of every entity, the leaves are in the order of the scene
+	entity_num_rcs.assign(scene->entities.size(), 0);
+	unsigned int entity = 0;
+	for (unsigned int i = 0; i < bvh_visible.size(); ++i)
+	{
+		BaseEntity* ent = bvh.leaves[bvh_visible[i]].entity;
+		while (entity < scene->entities.size() && scene->entities[entity] != ent)
+			entity++;
+		if (entity < scene->entities.size())
+			entity_num_rcs[entity]++;
+	}
+
+	//lights are few, no tree for them
+	collectLights(scene, camera);
+}
+
+void Renderer::collectLights(GTR::Scene* scene, Camera* camera)
+{
+	this->light_entities.resize(0);
+	for (unsigned int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible || ent->entity_type != LIGHT)
+			continue;
+		LightEntity* lig = (GTR::LightEntity*)ent;
+		Vector3 light_pos = lig->model.getTranslation();
+		if (lig->light_type != eLightType::DIRECTIONAL && camera->testSphereInFrustum(light_pos, lig->max_dist) == CLIP_OUTSIDE)
+			continue;
+		this->light_entities.push_back(lig);
+	}
+}
+
+void Renderer::getRenderListKey(GTR::Scene* scene, Camera* camera, sRenderListKey& key)
+{
+	memset(&key, 0, sizeof(key)); //the padding is compared too
+	key.scene = scene;
+	key.camera_version = camera->version;
+	key.node_edits = Node::s_edits;
+	key.mode = pipeline_mode == DEFERRED ? GBUFFERS : render_mode;
+	key.use_occlusion = use_occlusion;
+	key.occluder_min_area = occluder_min_area;
+	key.occluder_max_triangles = occluder_max_triangles;
+	key.max_occluders = max_occluders;
+	key.use_sort_keys = use_sort_keys;
+	key.use_oit = use_oit;
+	key.use_lods = use_lods;
+	key.lod_max_error = lod_max_error;
+	key.lod_hysteresis = lod_hysteresis;
+}
+
+int Renderer::checkRenderList(GTR::Scene* scene, Camera* camera)
 {
+	//the versions of the entities are updated even if the list is not valid, so the next frame compares with this one
+	int num_moved = 0;
+	for (unsigned int i = 0; i < scene->entities.size(); ++i)
+		scene->entities[i]->checkChanges();
 
-	//set the clear color (the background color)
-	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-	// Clear the color and the depth buffer
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	checkGLErrors();
+	sRenderListKey key;
+	getRenderListKey(scene, camera, key);
+	if (!render_list_valid || memcmp(&key, &render_list_key, sizeof(key)) != 0 || cached_entities.size() != scene->entities.size())
+		return -1;
 
-	//render RenderCalls through reference 
-	for (int i = 0; i < rendercalls.size(); i++)
+	for (unsigned int i = 0; i < scene->entities.size(); ++i)
 	{
-		RenderCall& rc = rendercalls[i];
-		renderMeshWithMaterial(this->render_mode, rc.model, rc.mesh, rc.material, camera);
+		BaseEntity* ent = scene->entities[i];
+		sCachedEntity& cached = cached_entities[i];
+		if (cached.entity != ent)
+			return -1;
+		//the lights are collected every frame
+		cached.moved = ent->version != cached.version && ent->entity_type == PREFAB;
+		cached.version = ent->version;
+		if (cached.moved)
+			num_moved++;
 	}
+	return num_moved;
+}
 
+void Renderer::storeRenderList(GTR::Scene* scene, Camera* camera)
+{
+	getRenderListKey(scene, camera, render_list_key);
+	cached_entities.resize(scene->entities.size());
+	for (unsigned int i = 0; i < scene->entities.size(); ++i)
+	{
+		cached_entities[i].entity = scene->entities[i];
+		cached_entities[i].version = scene->entities[i]->version;
+		cached_entities[i].moved = false;
+	}
+	rc_collected = rc_data_list;
+	render_list_valid = true;
 }
 
-void GTR::Renderer::renderDeferred(GTR::Scene* scene, std::vector <RenderCall>& rendercalls, Camera* camera)
+void Renderer::patchRenderList(GTR::Scene* scene, Camera* camera)
 {
+	//the tree is used by the shadows and the next collect
+	if (use_bvh)
+		bvh.update(scene);
+
+	//same order as a collect: the entities in the order of the scene
+	rc_patched.resize(0);
+	int first = 0;
+	for (unsigned int i = 0; i < cached_entities.size(); ++i)
+	{
+		int num_rcs = entity_num_rcs[i];
+		if (!cached_entities[i].moved)
+			rc_patched.insert(rc_patched.end(), rc_collected.begin() + first, rc_collected.begin() + first + num_rcs);
+		else
+		{
+			BaseEntity* ent = cached_entities[i].entity;
+			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+			int size = rc_patched.size();
+			int lod_index = 0;
+			if (ent->visible && pent->prefab)
+				getRCsfromNodeTo(rc_patched, ent->model, Matrix44(), &pent->prefab->root, camera, pent->lod_levels, lod_index);
+			entity_num_rcs[i] = rc_patched.size() - size;
+			cached_entities[i].moved = false;
+		}
+		first += num_rcs;
+	}
+	rc_collected.swap(rc_patched);
+	rc_data_list = rc_collected;
+
+	collectLights(scene, camera);
+}
 
-	if (gbuffers_fbo.fbo_id == 0) { //this att tell me if it is already created (by default is 0). Memory is reserved?
+void Renderer::occlusionCull(Camera* camera)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+	occlusion.begin(camera->viewprojection_matrix);
+
+	//occluders: the flagged nodes first and then the opaque meshes that cover more screen
+	rc_boxes.resize(rc_data_list.size());
+	occluder_candidates.resize(0);
+	for (unsigned int i = 0; i < rc_data_list.size(); ++i)
+	{
+		RenderCall& rc = rc_data_list[i];
+		rc_boxes[i] = transformBoundingBox(rc.model, rc.mesh->box);
+		if (rc.material->alpha_mode != GTR::eAlphaMode::NO_ALPHA)
+			continue;
+		int num_triangles = (rc.mesh->getNumIndices() ? rc.mesh->getNumIndices() : rc.mesh->getNumVertices()) / 3;
+		if (num_triangles == 0 || num_triangles > occluder_max_triangles)
+			continue;
+		float area = occlusion.projectedArea(rc_boxes[i]);
+		if (rc.occluder)
+			area += 2.0f;
+		else if (area < occluder_min_area)
+			continue;
+		occluder_candidates.push_back(std::make_pair(area, i));
+	}
+	std::sort(occluder_candidates.begin(), occluder_candidates.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first > b.first; });
 
-		//we reserve memory to each textures...
-		gbuffers_fbo.create(this->width, 
-							this->height,
-							3, // num of textures to create
-							GL_RGBA, // four channels
-							GL_UNSIGNED_BYTE, //1byte
-							true); //add depth_texture
+	for (int i = 0; i < (int)occluder_candidates.size() && i < max_occluders; ++i)
+	{
+		RenderCall& rc = rc_data_list[occluder_candidates[i].second];
+		Mesh* mesh = rc.mesh;
+		int stride = 0;
+		const Vector3* vertices = mesh->getPositions(stride);
+		occlusion.addOccluder(rc.model, vertices, stride, mesh->getNumVertices(), mesh->getIndices(), mesh->getNumIndices());
 	}
-	//start rendeing inside the gbuffers
-	gbuffers_fbo.bind(); 
+	occlusion.rasterize();
+
+	//keep the visible ones, in the same order
+	int num_visible = 0;
+	for (unsigned int i = 0; i < rc_data_list.size(); ++i)
+		if (occlusion.testBox(rc_boxes[i]))
+			rc_data_list[num_visible++] = rc_data_list[i];
+	num_occlusion_culled = rc_data_list.size() - num_visible;
+	rc_data_list.resize(num_visible);
+
+	occlusion_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+}
 
-	// if we want to clear all in once
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	checkGLErrors();
+//fields of the sort key, see renderer.h
+static inline int keyShader(uint64 key) { return (key >> 62) == KEY_BLEND ? (key >> 32) & 0x3F : (key >> 56) & 0x3F; }
+static inline int keyMaterial(uint64 key) { return (key >> 62) == KEY_BLEND ? (key >> 16) & 0xFFFF : (key >> 40) & 0xFFFF; }
 
+static inline void markId(std::vector<int>& ranks, int id)
+{
+	if (id >= (int)ranks.size())
+		ranks.resize(id + 1, -1);
+	ranks[id] = 0;
+}
 
+//numbers the marked ids in their order, returns how many there are
+static int rankIds(std::vector<int>& ranks)
+{
+	int count = 0;
+	for (unsigned int i = 0; i < ranks.size(); ++i)
+		if (ranks[i] != -1)
+			ranks[i] = count++;
+	return count;
+}
 
-	/* //if clear each GB independently
-	//Now we clear in several passes, so we can control the clear color independently for every gbuffer
-	//disable all but the GB0 (and the depth) 
-	gbuffers_fbo.enableSingleBuffer(0);
+void Renderer::computeSortKeys(eRenderMode mode, Camera* camera)
+{
+	float inv_far = 1.0 / camera->far_plane;
+	const uint64 max_depth = (1 << 24) - 1;
+	bool transparency_pass = useTransparencyPass(mode);
+
+	//the ids grow with every resource loaded, the keys use their ranks among the ones of the list so the fields don't wrap
+	sort_shaders.resize(rc_data_list.size());
+	std::fill(shader_ranks.begin(), shader_ranks.end(), -1);
+	std::fill(material_ranks.begin(), material_ranks.end(), -1);
+	std::fill(mesh_ranks.begin(), mesh_ranks.end(), -1);
+	for (unsigned int i = 0; i < rc_data_list.size(); ++i)
+	{
+		RenderCall& rc = rc_data_list[i];
+		bool blend = rc.material->alpha_mode == BLEND;
+		Shader* shader = getShader(blend && transparency_pass ? TRANSPARENCY : mode, rc.material);
+		sort_shaders[i] = shader;
+		if (shader)
+			markId(shader_ranks, shader->id);
+		markId(material_ranks, rc.material->id);
+		markId(mesh_ranks, rc.mesh->id);
+	}
+	int num_shaders = rankIds(shader_ranks);
+	int num_materials = rankIds(material_ranks);
+	int num_meshes = rankIds(mesh_ranks);
+	static bool overflow_reported = false;
+	if ((num_shaders > 0x40 || num_materials > 0x10000 || num_meshes > 0x10000) && !overflow_reported)
+	{
+		std::cout << "[WARN] too many shaders, materials or meshes for the sort keys: " << num_shaders << " " << num_materials << " " << num_meshes << std::endl;
+		overflow_reported = true;
+	}
 
-	//clear the 1 GB with the color (and depth)
-	glClearColor( 0.1 , 0.1 , 0.1 , 1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	checkGLErrors();
+	for (unsigned int i = 0; i < rc_data_list.size(); ++i)
+	{
+		RenderCall& rc = rc_data_list[i];
+		bool blend = rc.material->alpha_mode == BLEND;
+		Shader* shader = sort_shaders[i];
+		uint64 shader_id = shader ? (shader_ranks[shader->id] & 0x3F) : 0;
+		uint64 material_id = material_ranks[rc.material->id] & 0xFFFF;
+		uint64 mesh_id = mesh_ranks[rc.mesh->id] & 0xFFFF;
+
+		//distance quantized to 24 bits
+		float d = clamp(rc.dist2camera * inv_far, 0.0f, 1.0f);
+		uint64 depth = (uint64)(d * max_depth);
+
+		if (blend && transparency_pass)
+			rc.sort_key = ((uint64)KEY_BLEND << 62) | (shader_id << 32) | (material_id << 16) | mesh_id;
+		else if (blend)
+			rc.sort_key = ((uint64)KEY_BLEND << 62) | ((max_depth - depth) << 38) | (shader_id << 32) | (material_id << 16);
+		else
+		{
+			uint64 alpha_class = rc.material->alpha_mode == MASK ? KEY_MASK : KEY_OPAQUE;
+			rc.sort_key = (alpha_class << 62) | (shader_id << 56) | (material_id << 40) | (mesh_id << 24) | depth;
+		}
+	}
+}
 
-	//now enable the 2 GB and clear. This time we haven't clear the GL_COLOR
-	gbuffers_fbo.enableSingleBuffer(1);
-	glClearColor( 0, 0, 0, 1.0);
-	glClear(GL_DEPTH_BUFFER_BIT);
-	checkGLErrors();
+//LSD radix sort of 8 bits per pass, stable. Passes where all the keys have the same byte are skipped
+static void radixSort(std::vector<sSortItem>& items, std::vector<sSortItem>& tmp)
+{
+	int n = items.size();
+	if (n < 2)
+		return;
+	tmp.resize(n);
 
-	// clear 3 GB
+	//all the histograms in one read
+	int counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < n; ++i)
+	{
+		uint64 key = items[i].key;
+		for (int b = 0; b < 8; ++b)
+			counts[b][(key >> (b * 8)) & 0xFF]++;
+	}
 
-	// clear 4 GB
+	sSortItem* src = &items[0];
+	sSortItem* dst = &tmp[0];
+	for (int b = 0; b < 8; ++b)
+	{
+		int* count = counts[b];
+		int shift = b * 8;
+		if (count[(src[0].key >> shift) & 0xFF] == n)
+			continue;
 
-	//enable all buffers back
-	gbuffers_fbo.enableAllBuffers();
+		//offsets
+		int sum = 0;
+		for (int j = 0; j < 256; ++j)
+		{
+			int c = count[j];
+			count[j] = sum;
+			sum += c;
+		}
 
+		for (int i = 0; i < n; ++i)
+			dst[count[(src[i].key >> shift) & 0xFF]++] = src[i];
+		std::swap(src, dst);
+	}
 
-	*/
+	if (src != &items[0])
+		memcpy(&items[0], src, n * sizeof(sSortItem));
+}
 
+void Renderer::sortRenderCalls(eRenderMode mode, Camera* camera)
+{
+	computeSortKeys(mode, camera);
 
-	//render all what we want
-	for (int i = 0; i < rendercalls.size(); i++)
+	//how the old sort would have done it
+	if (sort_stats)
 	{
-		RenderCall& rc = rendercalls[i];
-		// solo queremos que coja los shaders de Gbuffers
-		// no quiero cambiar modo de render -> ahora always este modo
-		renderMeshWithMaterial(eRenderMode::GBUFFERS, rc.model, rc.mesh, rc.material, camera);
+		rc_sorted = rc_data_list;
+		std::sort(rc_sorted.begin(), rc_sorted.end(), sortRC());
+		countStateSwitches(rc_sorted, dist_shader_switches, dist_material_switches);
 	}
 
-	//stop rendering to the gbuffers
-	gbuffers_fbo.unbind();
+	if (!use_sort_keys)
+		std::sort(this->rc_data_list.begin(), this->rc_data_list.end(), sortRC());
+	else
+	{
+		//sort only (key, index) pairs and move every render call once
+		int n = rc_data_list.size();
+		sort_items.resize(n);
+		for (int i = 0; i < n; ++i)
+		{
+			sort_items[i].key = rc_data_list[i].sort_key;
+			sort_items[i].index = i;
+		}
+		radixSort(sort_items, sort_tmp);
 
-	//clear 
-	//glClearColor(0, 0, 0, 0);
-	//glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		rc_sorted.resize(n);
+		for (int i = 0; i < n; ++i)
+			rc_sorted[i] = rc_data_list[sort_items[i].index];
+		rc_data_list.swap(rc_sorted);
+	}
 
-	//desactivo los flags
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	countStateSwitches(rc_data_list, shader_switches, material_switches);
+}
 
-	
-	//---------Ilumination_Pass--------------
-	//create and FBO
-	
-	if (illumination_fbo.fbo_id == 0) {
+void Renderer::countStateSwitches(std::vector<RenderCall>& rcs, int& shaders, int& materials)
+{
+	shaders = materials = 0;
+	for (unsigned int i = 0; i < rcs.size(); ++i)
+	{
+		if (i == 0 || keyShader(rcs[i].sort_key) != keyShader(rcs[i - 1].sort_key))
+			shaders++;
+		if (i == 0 || rcs[i].material != rcs[i - 1].material)
+			materials++;
+	}
+}
+
+void Renderer::uploadLightsBlock()
+{
+	num_block_lights = std::min((int)light_entities.size(), UBO_MAX_LIGHTS);
+	lights_data.resize(light_entities.size());
+	for (unsigned int i = 0; i < light_entities.size(); ++i)
+	{
+		LightEntity* light = light_entities[i];
+		sLightData& data = lights_data[i];
+		data.position = light->model.getTranslation();
+		data.max_dist = light->max_dist;
+		data.color = light->color;
+		data.intensity = light->intensity;
+		data.vector = light->model.frontVector();
+		data.type = light->light_type;
+		data.spot_cosine_cutoff = cosf(light->cone_angle * DEG2RAD);
+		data.spot_exponent = light->spot_exp;
+		data.area_size = light->area_size;
+		data.shadow = i < shadow_atlas.light_tiles.size() ? shadow_atlas.light_tiles[i] : -1;
+	}
+
+	//only the used part is copied but the range has the size of the block, the clusters read all of them from their own buffer
+	RingBuffer* ring = RingBuffer::Get();
+	int block_size = sizeof(sLightData) * UBO_MAX_LIGHTS;
+	int offset = ring->upload(lights_data.size() ? &lights_data[0] : NULL, num_block_lights * sizeof(sLightData), ring->uniform_alignment, block_size);
+	gl_state.bindUniformBufferRange(UBO_LIGHTS, ring->buffer_id, offset, block_size);
+}
+
+void Renderer::computeObjectLights()
+{
+	//boxes in the final order of the list, the same index is used when drawing
+	rc_boxes.resize(rc_data_list.size());
+	for (unsigned int i = 0; i < rc_data_list.size(); ++i)
+		rc_boxes[i] = transformBoundingBox(rc_data_list[i].model, rc_data_list[i].mesh->box);
+
+	object_lights.build(rc_boxes, light_entities);
+	object_lights.upload(lights_data.size() ? &lights_data[0] : NULL, sizeof(sLightData));
+}
+
+void Renderer::uploadCameraBlock(GTR::Scene* scene, Camera* camera)
+{
+	sCameraBlock block;
+	block.viewprojection = camera->viewprojection_matrix;
+	block.camera_position = camera->eye;
+	block.num_lights = num_block_lights;
+	block.ambient_light = scene->ambient_light;
+	block.padding = 0;
+	RingBuffer* ring = RingBuffer::Get();
+	int offset = ring->upload(&block, sizeof(sCameraBlock), ring->uniform_alignment);
+	gl_state.bindUniformBufferRange(UBO_CAMERA, ring->buffer_id, offset, sizeof(sCameraBlock));
+}
+
+void Renderer::bindMaterialBlock(GTR::Material* material)
+{
+	//same material as the previous draw
+	if (material->ubo && gl_state.uniform_buffers[UBO_MATERIAL] == material->ubo->ubo_id)
+	{
+		gl_state.num_elided++;
+		return;
+	}
 
-		//create 3 textures of 4 components
-		illumination_fbo.create(this->width, 
-								this->height,
-								1, 			//three textures
-								GL_RGB, 		//three channels
-								GL_UNSIGNED_BYTE, //1 byte
-								false);		//add depth_texture
+	sMaterialBlock block;
+	material->fillBlock(block);
+	if (!material->ubo)
+	{
+		material->ubo = new UBO();
+		material->ubo->create(sizeof(sMaterialBlock), &block);
+		material->ubo_data = block;
+	}
+	else if (memcmp(&block, &material->ubo_data, sizeof(sMaterialBlock)) != 0)
+	{
+		material->ubo->update(&block);
+		material->ubo_data = block;
+	}
+	gl_state.bindUniformBuffer(UBO_MATERIAL, material->ubo);
+}
 
+void GTR::Renderer::renderForward(GTR::Scene* scene, std::vector <RenderCall>& rendercalls, Camera* camera)
+{
+	auto render = [&]() {
+		//set the clear color (the background color)
+		glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+		// Clear the color and the depth buffer
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		checkGLErrors();
+
+		//render RenderCalls through reference 
+		gl_state.invalidate();
+		renderRenderCalls(this->render_mode, rendercalls, camera);
+		gl_state.endPass();
+	};
+
+	if (!useTransparencyPass(render_mode) || !num_transparent_rcs)
+	{
+		render();
+		return;
 	}
 
-	illumination_fbo.bind();
+	//the transparency pass needs the depth in a texture, the opaque image is rendered in targets of the graph
+	frame_graph.reset();
+	FrameGraph::sTextureDesc color_desc = { width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0 };
+	FrameGraph::sTextureDesc depth_desc = { width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0 };
+	std::vector<int> targets;
+	targets.push_back(frame_graph.createTexture("color", color_desc));
+	targets.push_back(frame_graph.createTexture("depth", depth_desc));
+	frame_graph.addPass("forward", std::vector<int>(), targets, render);
+	addTransparencyPasses(rendercalls, camera, targets[0], targets[1]);
+	frame_graph.compile();
+	frame_graph.execute();
+}
 
-	// if we want to clear all in once
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	checkGLErrors();
+void GTR::Renderer::renderDeferred(GTR::Scene* scene, std::vector <RenderCall>& rendercalls, Camera* camera)
+{
+	//the targets only live during the frame, the graph gives them textures of its pool
+	frame_graph.reset();
+	FrameGraph::sTextureDesc descs[4];
+	getGBufferDescs(gbuffer_layout, descs);
+	FrameGraph::sTextureDesc illumination_desc = { render_width, render_height, GL_RGB, GL_UNSIGNED_BYTE, 0 };
+	if (use_hdr_illumination)
+		illumination_desc = { render_width, render_height, GL_RGB, GL_FLOAT, GL_R11F_G11F_B10F };
+	const char* names[4] = { "color", "normal", "extra", "depth" };
+	int targets[4]; //-1 for the ones the layout doesn't use
+	std::vector<int> gbuffers;
+	for (int i = 0; i < 4; ++i)
+	{
+		targets[i] = descs[i].width ? frame_graph.createTexture(names[i], descs[i]) : -1;
+		if (targets[i] != -1)
+			gbuffers.push_back(targets[i]);
+	}
+	int illumination = frame_graph.createTexture("illumination", illumination_desc);
 
-	
+	//the light volumes are tested against a copy of the depth with a stencil
+	std::vector<int> illumination_writes(1, illumination);
+	bool clustered = use_light_clusters && camera->type == Camera::PERSPECTIVE;
+	if (use_stencil_volumes && !clustered)
+	{
+		FrameGraph::sTextureDesc stencil_desc = { render_width, render_height, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, GL_DEPTH24_STENCIL8 };
+		illumination_writes.push_back(frame_graph.createTexture("light volumes", stencil_desc));
+	}
+
+	//the variants of the layout are compiled here, the recording jobs only find them
+	getGBufferShader("gbuffers");
+	getGBufferShader("gbuffers_instanced");
+
+	//---------GBuffers_Pass--------------
+	frame_graph.addPass("gbuffers", std::vector<int>(), gbuffers, [&]() {
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		checkGLErrors();
+
+		//render all what we want
+		// solo queremos que coja los shaders de Gbuffers
+		gl_state.invalidate();
+		renderRenderCalls(eRenderMode::GBUFFERS, rendercalls, camera);
+		gl_state.endPass();
+	});
+
+	//---------Ilumination_Pass--------------
+	std::vector<int> illumination_reads = gbuffers;
+	if (shadow_atlas.fbo.depth_texture)
+		illumination_reads.push_back(frame_graph.importTexture("shadow atlas", shadow_atlas.fbo.depth_texture));
+	frame_graph.addPass("illumination", illumination_reads, illumination_writes, [&]() {
+		Texture* textures[4];
+		for (int i = 0; i < 4; ++i)
+			textures[i] = targets[i] != -1 ? frame_graph.getTexture(targets[i]) : NULL;
+
+		//desactivo los flags
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_BLEND);
+
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+		checkGLErrors();
+
+		if (clustered)
+			renderClusteredLights(scene, camera, textures);
+		else
+			renderDeferredLights(scene, camera, textures);
+
+		//set to back //be sure blending is not active
+		glFrontFace(GL_CCW);
+		glDisable(GL_BLEND);
+	});
+
+	//and render the texture into the screen, with the transparent calls on top
+	if (useTransparencyPass(GBUFFERS) && num_transparent_rcs)
+		addTransparencyPasses(rendercalls, camera, illumination, targets[3]);
+	else
+		frame_graph.addPass("present", std::vector<int>(1, illumination), std::vector<int>(), [&]() {
+			Texture* texture = frame_graph.getTexture(illumination);
+			setUpscaleFilter(texture, true);
+			texture->toViewport();
+			setUpscaleFilter(texture, false);
+		}, true);
+
+	//to plot every textures in the viewport
+	if (show_gbuffers)
+		frame_graph.addPass("show gbuffers", gbuffers, std::vector<int>(), [&]() {
+			//GB0 color
+			glViewport(0, 0, width * 0.5, height * 0.5);
+			frame_graph.getTexture(targets[0])->toViewport();
+
+			//GB1 normal
+			glViewport(width * 0.5, 0, width * 0.5, height * 0.5);
+			frame_graph.getTexture(targets[1])->toViewport();
+
+			//GB2 material. properties (in the normal and color targets when the layout has no extra)
+			glViewport(width * 0.5, height * 0.5, width * 0.5, height * 0.5);
+			if (targets[2] != -1)
+				frame_graph.getTexture(targets[2])->toViewport();
+
+			//GB3 depth_buffer
+			glViewport(0, height * 0.5, width * 0.5, height * 0.5);
+			// para linealizar necesito el near and far de la camara.
+			Shader* depth_sh = Shader::Get("depth");
+			depth_sh->enable();
+			depth_sh->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+			frame_graph.getTexture(targets[3])->toViewport(depth_sh);
+
+			//Volver a poner el tamao de VPort. 0,0 en una textura esta abajo iz!
+			glViewport(0, 0, width, height);
+		}, true);
+
+	frame_graph.compile();
+	frame_graph.execute();
+}
+
+void Renderer::getGBufferDescs(eGBufferLayout layout, FrameGraph::sTextureDesc* descs)
+{
+	FrameGraph::sTextureDesc color_desc = { render_width, render_height, GL_RGBA, GL_UNSIGNED_BYTE, 0 };
+	FrameGraph::sTextureDesc normal10_desc = { render_width, render_height, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, GL_RGB10_A2 };
+	FrameGraph::sTextureDesc depth_desc = { render_width, render_height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0 };
+	FrameGraph::sTextureDesc none = { 0, 0, 0, 0, 0 };
+	descs[0] = color_desc;
+	descs[1] = layout == GBUFFER_OCTAHEDRAL_10 ? normal10_desc : color_desc;
+	descs[2] = layout == GBUFFER_BASIC ? color_desc : none;
+	descs[3] = depth_desc;
+}
+
+int Renderer::getGBufferBytesPerPixel(eGBufferLayout layout)
+{
+	FrameGraph::sTextureDesc descs[4];
+	getGBufferDescs(layout, descs);
+	int bytes = 0;
+	for (int i = 0; i < 4; ++i)
+		if (descs[i].width)
+			bytes += FrameGraph::textureBytes(descs[i]);
+	return bytes / (render_width * render_height);
+}
+
+Shader* Renderer::getGBufferShader(const char* name)
+{
+	static const char* macros[NUM_GBUFFER_LAYOUTS] = { "", "#define GBUFFER_OCTAHEDRAL", "#define GBUFFER_OCTAHEDRAL" };
+	return Shader::GetVariant(name, macros[gbuffer_layout]);
+}
+
+void Renderer::renderDeferredLights(GTR::Scene* scene, Camera* camera, Texture** gbuffers)
+{
+	if (light_pixel_stats)
+		readLightQueries();
+
+	//one quad per directional light and one sphere per point light, a cone per spot
 	Mesh* quad = Mesh::getQuad(); 
-	Shader* shader = Shader::Get("deferred");
+	Shader* shader = getGBufferShader("deferred");
 	shader->enable();
-	shader->setTexture("u_color_texture", gbuffers_fbo.color_textures[0], 0);
-	shader->setTexture("u_normal_texture", gbuffers_fbo.color_textures[1], 1);
-	shader->setTexture("u_extra_texture", gbuffers_fbo.color_textures[2], 2);
-	shader->setTexture("u_depth_texture", gbuffers_fbo.depth_texture, 3);
+	shader->setTexture("u_color_texture", gbuffers[0], 0);
+	shader->setTexture("u_normal_texture", gbuffers[1], 1);
+	if (gbuffers[2])
+		shader->setTexture("u_extra_texture", gbuffers[2], 2);
+	shader->setTexture("u_depth_texture", gbuffers[3], 3);
 	shader->setUniform("u_ambient_light", scene->ambient_light);
 	
 
@@ -250,143 +997,294 @@ void GTR::Renderer::renderDeferred(GTR::Scene* scene, std::vector <RenderCall>&
 	{
 		light = this->light_entities[i];
 		//we assume that there is always at least one directional ///luego si da tiempo corregir para el caso de no directional light
+		if (i >= num_block_lights)
+			break;
 		if (light->light_type == DIRECTIONAL) {
-			light->uploadToShader(shader);
-		
+			shader->setUniform("u_light_index", i);
+	
+			beginLightQuery(i);
 			quad->render(GL_TRIANGLES);
+			endLightQuery();
 
 			//in case there are more than one directional light:
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_ONE, GL_ONE);
 			shader->setUniform("u_ambient_light", Vector3(0, 0, 0));
 		}
+	
 		
-			
 	}
-	
+
 	//glDisable(GL_BLEND);
 
 	//using geomrtry
 	// 
-	//we can use a sphere mesh for point lights
+	//we can use a sphere mesh for point lights and a cone for the spots
 	Mesh* sphere = Mesh::Get("data/meshes/sphere.obj", true, false);
 
-	glDisable(GL_CULL_FACE); 
-	
+	//the volumes are tested against the depth of the gbuffers, copied to the depth of the pass (it can't be tested while it is read)
+	Shader* stencil_shader = Shader::Get("flat");
+	if (use_stencil_volumes)
+	{
+		Shader* copy_shader = Shader::Get("depth_copy");
+		copy_shader->enable();
+		copy_shader->setTexture("u_depth_texture", gbuffers[3], 3);
+		glColorMask(false, false, false, false);
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_ALWAYS);
+		glDepthMask(true);
+		quad->render(GL_TRIANGLES);
+		glColorMask(true, true, true, true);
+		glDepthMask(false);
+		glEnable(GL_STENCIL_TEST);
+	}
+
+	//only the back faces, so every pixel is shaded once also when the camera is outside the volume
+	glEnable(GL_CULL_FACE);
+	glCullFace(GL_FRONT);
+
 	//this deferred_ws shader uses the basic.vs instead of quad.vs
-	shader = Shader::Get("deferred_ws");
+	shader = getGBufferShader("deferred_ws");
 
 	shader->enable();
-	shader->setTexture("u_color_texture", gbuffers_fbo.color_textures[0], 0);
-	shader->setTexture("u_normal_texture", gbuffers_fbo.color_textures[1], 1);
-	shader->setTexture("u_extra_texture", gbuffers_fbo.color_textures[2], 2);
-	shader->setTexture("u_depth_texture", gbuffers_fbo.depth_texture, 3);
-	
-	//basic.vs will need the model and the viewproj of the camera
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+	shader->setTexture("u_color_texture", gbuffers[0], 0);
+	shader->setTexture("u_normal_texture", gbuffers[1], 1);
+	if (gbuffers[2])
+		shader->setTexture("u_extra_texture", gbuffers[2], 2);
+	shader->setTexture("u_depth_texture", gbuffers[3], 3);
+
+	//basic.vs will need the model (the viewproj of the camera is in the CameraBlock)
 	shader->setUniform("u_inverse_viewprojection", inv_vp);
-	shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-	
-	Matrix44 m; Vector3 pos; 
+	shader->setUniform("u_iRes", Vector2(1.0 / (float)render_width, 1.0 / (float)render_height));
+
+	Matrix44 m;
 	for (int i = 0; i < this->light_entities.size(); i++)
 	{
 		light = this->light_entities[i];
+		if (i >= num_block_lights)
+			break;
 		if (light->light_type == DIRECTIONAL)
 			continue;
-		//we must translate the model to the center of the light
-		// and scale it according to the max_distance of the light
-		pos = light->model.getTranslation();
-		m.setTranslation(pos.x, pos.y, pos.z);
-		m.scale(light->max_dist, light->max_dist, light->max_dist);
-		shader->setUniform("u_model", m); //pass the model to render the sphere
-
-		light->uploadToShader(shader);
-		glFrontFace(GL_CW);
-		sphere->render(GL_TRIANGLES);
-		
-		//glEnable(GL_BLEND);
+		Mesh* volume = light->light_type == SPOT ? getLightVolume(light, m) : NULL;
+		if (!volume)
+		{
+			//we must translate the model to the center of the light
+			// and scale it according to the max_distance of the light
+			Vector3 pos = light->model.getTranslation();
+			m.setTranslation(pos.x, pos.y, pos.z);
+			m.scale(light->max_dist, light->max_dist, light->max_dist);
+			volume = sphere;
+		}
 
-		//only pixels behind a surface are rendered
-		//glEnable(GL_DEPTH_TEST); //no s donde poner
+		if (use_stencil_volumes)
+		{
+			//1. marks the pixels whose surface is inside the volume: behind the front faces and in front of the back faces
+			stencil_shader->enable();
+			stencil_shader->setUniform("u_model", m);
+			glColorMask(false, false, false, false);
+			glEnable(GL_DEPTH_TEST);
+			glDepthFunc(GL_LEQUAL);
+			glDisable(GL_CULL_FACE);
+			glStencilFunc(GL_ALWAYS, 0, 0xFF);
+			glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+			glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+			volume->render(GL_TRIANGLES);
+
+			//2. shades them with the back faces (the camera can be inside the volume), clearing the mark for the next light
+			shader->enable();
+			glColorMask(true, true, true, true);
+			glDisable(GL_DEPTH_TEST);
+			glEnable(GL_CULL_FACE);
+			glCullFace(GL_FRONT);
+			glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+			glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+		}
+
+		shader->setUniform("u_model", m); //pass the model to render the volume
+		shader->setUniform("u_light_index", i);
+		beginLightQuery(i);
+		volume->render(GL_TRIANGLES);
+		endLightQuery();
+	
+		//glEnable(GL_BLEND);
 
-		glDepthFunc(GL_GREATER);
 		glBlendFunc(GL_ONE, GL_ONE);// sum each pixels with the befors...
 	}
 
+	glDisable(GL_CULL_FACE);
+	glCullFace(GL_BACK);
+	if (use_stencil_volumes)
+	{
+		glDisable(GL_STENCIL_TEST);
+		glDepthMask(true);
+		glDepthFunc(GL_LESS);
+	}
+}
 
-	//stop rendering to the fbo, render to screen
-	illumination_fbo.unbind();
-
-	//set to back //be sure blending is not active
-	glFrontFace(GL_CCW);
-	glDisable(GL_BLEND);
-
-	//and render the texture into the screen
-	illumination_fbo.color_textures[0]->toViewport();
-
-
-	
-	//quad->render(GL_TRIANGLES);
-
-	
-
+Mesh* Renderer::getLightVolume(LightEntity* light, Matrix44& model)
+{
+	//a wide cone is bigger than the sphere
+	if (light->light_type != SPOT || light->cone_angle > 60)
+		return NULL;
 
+	//the cone of the unit mesh opens to +Z, the front of the light, the flat base at max_dist contains the sphere
+	float radius = tan(light->cone_angle * DEG2RAD) * light->max_dist;
+	model = light->model;
+	model.scale(radius, radius, light->max_dist);
+	return Mesh::getCone();
+}
 
+void Renderer::beginLightQuery(int light)
+{
+	if (!light_pixel_stats)
+		return;
+	if (num_light_queries == (int)light_queries.size())
+	{
+		GLuint query = 0;
+		glGenQueries(1, &query);
+		light_queries.push_back(query);
+		light_query_lights.push_back(-1);
+	}
+	light_query_lights[num_light_queries] = light;
+	glBeginQuery(GL_SAMPLES_PASSED, light_queries[num_light_queries]);
+}
 
+void Renderer::endLightQuery()
+{
+	if (!light_pixel_stats)
+		return;
+	glEndQuery(GL_SAMPLES_PASSED);
+	num_light_queries++;
+}
 
+//the queries of the last frame are done by now, no wait
+void Renderer::readLightQueries()
+{
+	light_pixels.assign(light_entities.size(), -1);
+	for (int i = 0; i < num_light_queries; ++i)
+	{
+		GLuint samples = 0;
+		glGetQueryObjectuiv(light_queries[i], GL_QUERY_RESULT, &samples);
+		if (light_query_lights[i] < (int)light_pixels.size())
+			light_pixels[light_query_lights[i]] = samples;
+	}
+	num_light_queries = 0;
+}
 
+void Renderer::renderClusteredLights(GTR::Scene* scene, Camera* camera, Texture** gbuffers)
+{
+	//bin the lights, the buffer of lights has the same order than light_entities
+	light_clusters.build(camera, light_entities);
+	light_clusters.upload(lights_data.size() ? &lights_data[0] : NULL, sizeof(sLightData));
 
-	//to plot every textures in the viewport
-	//gbuffers_fbo.color_textures[0]->toViewport(Shader::Get("showAlpha"));// pq puedo llamar directamente el shader?
-	if (show_gbuffers){
+	Mesh* quad = Mesh::getQuad();
+	Shader* shader = getGBufferShader("deferred_clustered");
+	shader->enable();
+	shader->setTexture("u_color_texture", gbuffers[0], 0);
+	shader->setTexture("u_normal_texture", gbuffers[1], 1);
+	if (gbuffers[2])
+		shader->setTexture("u_extra_texture", gbuffers[2], 2);
+	shader->setTexture("u_depth_texture", gbuffers[3], 3);
+	light_clusters.bind(shader, 4);
+	shader->setTexture("u_shadow_atlas", shadow_atlas.fbo.depth_texture, 7);
+	shadow_atlas.data_tbo.bind(8);
+	shader->setUniform1("u_shadow_data", 8);
+	glActiveTexture(GL_TEXTURE0);
 
-		//int width = Application::instance->window_width;
-		//int height = Application::instance->window_height;
+	Matrix44 inv_vp = camera->viewprojection_matrix;
+	inv_vp.inverse();
+	shader->setUniform("u_inverse_viewprojection", inv_vp);
+	shader->setUniform("u_view", camera->view_matrix);
 
-		//GB0 color
-		glViewport(0, 0, width * 0.5, height * 0.5);
-		gbuffers_fbo.color_textures[0]->toViewport();
+	quad->render(GL_TRIANGLES);
+	shader->disable();
+}
 
-		//GB1 normal
-		glViewport(width * 0.5, 0, width * 0.5, height * 0.5);
-		gbuffers_fbo.color_textures[1]->toViewport();
+void Renderer::benchmarkLights(GTR::Scene* scene, Camera* camera)
+{
+	const int counts[] = { 16, 64, 256, 1024, 4096 };
+	const int num_frames = 10;
 
-		//GB2 material. properties
-		glViewport( width*0.5, height * 0.5, width * 0.5, height * 0.5);
-		gbuffers_fbo.color_textures[2]->toViewport();
+	//the lights are spread over the boxes of the visible meshes
+	collectRenderCalls(scene, camera);
+	if (rc_data_list.empty())
+		return;
+	BoundingBox area = transformBoundingBox(rc_data_list[0].model, rc_data_list[0].mesh->box);
+	for (unsigned int i = 1; i < rc_data_list.size(); ++i)
+		area = mergeBoundingBoxes(area, transformBoundingBox(rc_data_list[i].model, rc_data_list[i].mesh->box));
+	float size = std::max(area.halfsize.x, area.halfsize.z);
+
+	ePipelineMode prev_pipeline = pipeline_mode;
+	bool prev_clusters = use_light_clusters;
+	pipeline_mode = DEFERRED;
+
+	std::cout << "Light benchmark (" << num_frames << " frames, " << width << "x" << height << ")" << std::endl;
+	std::cout << "lights\tspheres ms\tclusters ms\tbinning ms\tpairs" << std::endl;
+	for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c)
+	{
+		int count = counts[c];
+		while ((int)bench_lights.size() < count)
+		{
+			LightEntity* light = new LightEntity();
+			light->light_type = bench_lights.size() % 4 == 3 ? SPOT : POINT;
+			light->model.setTranslation(area.center.x + random(2.0f, -1) * area.halfsize.x, area.center.y + random(2.0f, -1) * area.halfsize.y, area.center.z + random(2.0f, -1) * area.halfsize.z);
+			light->model.rotate(random(2.0f * PI), Vector3(0, 1, 0));
+			light->color.set(random(1.0f), random(1.0f), random(1.0f));
+			light->intensity = 0.5;
+			light->max_dist = size * (0.02 + random(0.08f));
+			light->cone_angle = 30;
+			light->spot_exp = 5;
+			bench_lights.push_back(light);
+		}
+		bench_num_lights = count;
 
-		//GB3 depth_buffer
-		glViewport(0, height * 0.5, width * 0.5, height * 0.5);
-		//need to pass a linear with shader depth, to be able to see. No se ve-> pq necesita parm
-		// para linealizar necesito el near and far de la camara.
-		Shader* depth_sh = Shader::Get("depth");
-		depth_sh->enable();
-		depth_sh->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
-		//depth_sh->disable();
-		gbuffers_fbo.depth_texture->toViewport(depth_sh);
+		float times[2] = { -1, -1 };
+		float binning = 0;
+		for (int mode = 0; mode < 2; ++mode)
+		{
+			use_light_clusters = mode == 1;
+			//the spheres read the lights from the UBO
+			if (!use_light_clusters && count > UBO_MAX_LIGHTS)
+				continue;
+			renderScene(scene, camera); //warm up
+			glFinish();
+			auto t0 = std::chrono::high_resolution_clock::now();
+			binning = 0;
+			for (int f = 0; f < num_frames; ++f)
+			{
+				renderScene(scene, camera);
+				binning += light_clusters.build_time;
+			}
+			glFinish();
+			times[mode] = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count() / num_frames;
+		}
 
-		//Volver a poner el tamao de VPort. 0,0 en una textura esta abajo iz!
-		glViewport(0, 0, width, height);
+		std::cout << count << "\t";
+		if (times[0] < 0)
+			std::cout << "-";
+		else
+			std::cout << times[0];
+		std::cout << "\t" << times[1] << "\t" << binning / num_frames << "\t" << light_clusters.num_pairs << std::endl;
 	}
 
-
-
-
-
+	bench_num_lights = 0;
+	use_light_clusters = prev_clusters;
+	pipeline_mode = prev_pipeline;
 }
 
 //renders all the prefab
-void Renderer::getRCsfromPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
+void Renderer::getRCsfromPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<unsigned char>& lod_levels)
 {
 	assert(prefab && "PREFAB IS NULL");
 	//assign the model to the root node
 
-	getRCsfromNode(model, &prefab->root, camera);
+	int lod_index = 0;
+	getRCsfromNode(model, &prefab->root, camera, lod_levels, lod_index);
 	
 }
 
 //renders a node of the prefab and its children
-void Renderer::getRCsfromNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+void Renderer::getRCsfromNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera, std::vector<unsigned char>& lod_levels, int& lod_index)
 {
 	if (!node->visible)
 		return;
@@ -398,6 +1296,10 @@ void Renderer::getRCsfromNode(const Matrix44& prefab_model, GTR::Node* node, Cam
 	//does this node have a mesh? then we must render it
 	if (node->mesh && node->material)
 	{
+		//the level of the last frame, also for the nodes outside the frustum so the next ones keep their index
+		if ((int)lod_levels.size() <= lod_index)
+			lod_levels.resize(lod_index + 1, 0);
+		unsigned char& lod_level = lod_levels[lod_index++];
 	
 		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
 		BoundingBox world_bounding = transformBoundingBox(node_model,node->mesh->box);
@@ -409,8 +1311,9 @@ void Renderer::getRCsfromNode(const Matrix44& prefab_model, GTR::Node* node, Cam
 			RenderCall rc;
 			rc.model = node_model;
 			rc.material = node->material;
-			rc.mesh = node->mesh;
+			rc.mesh = selectLOD(node->mesh, world_bounding, camera, lod_level);
 			rc.dist2camera = camera->eye.distance(world_bounding.center);
+			rc.occluder = node->occluder;
 			this->rc_data_list.push_back(rc);
 			
 			//node->mesh->renderBounding(node_model, true);
@@ -419,303 +1322,716 @@ void Renderer::getRCsfromNode(const Matrix44& prefab_model, GTR::Node* node, Cam
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		getRCsfromNode(prefab_model, node->children[i], camera);
+		getRCsfromNode(prefab_model, node->children[i], camera, lod_levels, lod_index);
 	
 }
 
+//same as getRCsfromNode but without writing in the node (prefabs are shared between entities and threads)
+void Renderer::getRCsfromNodeTo(std::vector<RenderCall>& rcs, const Matrix44& prefab_model, const Matrix44& parent_global, GTR::Node* node, Camera* camera, std::vector<unsigned char>& lod_levels, int& lod_index)
+{
+	if (!node->visible)
+		return;
 
-//renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(eRenderMode mode, const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+	//same operations as node->getGlobalMatrix(true) so the result is bit exact
+	Matrix44 global = node->parent ? node->model * parent_global : node->model;
+	Matrix44 node_model = global * prefab_model;
+
+	if (node->mesh && node->material)
+	{
+		if ((int)lod_levels.size() <= lod_index)
+			lod_levels.resize(lod_index + 1, 0);
+		unsigned char& lod_level = lod_levels[lod_index++];
+		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
+		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+		{
+			RenderCall rc;
+			rc.model = node_model;
+			rc.material = node->material;
+			rc.mesh = selectLOD(node->mesh, world_bounding, camera, lod_level);
+			rc.dist2camera = camera->eye.distance(world_bounding.center);
+			rc.occluder = node->occluder;
+			rcs.push_back(rc);
+		}
+	}
+
+	for (unsigned int i = 0; i < node->children.size(); ++i)
+		getRCsfromNodeTo(rcs, prefab_model, global, node->children[i], camera, lod_levels, lod_index);
+}
+
+Mesh* Renderer::selectLOD(Mesh* mesh, const BoundingBox& world_bounding, Camera* camera, unsigned char& level)
+{
+	if (!use_lods || mesh->lods.empty())
+	{
+		level = 0;
+		return mesh;
+	}
+
+	//the errors of the levels grow, the coarsest one whose error on the screen is under the limit
+	float size = camera->getProjectedScale(world_bounding.center, (float)world_bounding.halfsize.length());
+	int num_lods = (int)mesh->lods.size();
+	auto coarsest = [&](float limit) {
+		int result = 0;
+		while (result < num_lods && mesh->lods[result]->lod_error * size <= limit)
+			result++;
+		return result;
+	};
+
+	//a coarser level when its error is under the band, a finer one when the error of the current one is over it
+	int current = std::min((int)level, num_lods);
+	int coarser = coarsest(lod_max_error * (1.0f - lod_hysteresis));
+	int finer = coarsest(lod_max_error * (1.0f + lod_hysteresis));
+	if (coarser > current)
+		current = coarser;
+	else if (finer < current)
+		current = finer;
+	level = current;
+	return current ? mesh->lods[current - 1] : mesh;
+}
+
+#define RECORD_CHUNK 64 //packets per job
+
+void Renderer::renderRenderCalls(eRenderMode mode, std::vector<RenderCall>& rendercalls, Camera* camera)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+	recordRenderCalls(mode, rendercalls);
+	record_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+
+	//the light passes of MULTI only shade the pixels that the pre-pass left visible
+	depth_prepass_done = false;
+	num_prepass_triangles = 0;
+	if (mode == MULTI && use_depth_prepass)
+	{
+		renderDepthPrepass(rendercalls);
+		depth_prepass_done = true;
+	}
+
+	//the result of the last frame is ready by now, no wait
+	if (mode == MULTI)
+	{
+		if (!fragments_query)
+			glGenQueries(1, &fragments_query);
+		else if (fragments_query_prepass != -1)
+		{
+			GLuint samples = 0;
+			glGetQueryObjectuiv(fragments_query, GL_QUERY_RESULT, &samples);
+			num_fragments_shaded = samples;
+			fragments_shaded[fragments_query_prepass] = samples;
+		}
+		glBeginQuery(GL_SAMPLES_PASSED, fragments_query);
+		fragments_query_prepass = depth_prepass_done ? 1 : 0;
+	}
+
+	for (unsigned int i = 0; i < draw_packets.size(); ++i)
+		executePacket(mode, draw_packets[i], rendercalls);
+
+	if (mode == MULTI)
+		glEndQuery(GL_SAMPLES_PASSED);
+
+	gl_state.setDepthMask(true);
+	gl_state.setDepthFunc(GL_LESS);
+	depth_prepass_done = false;
+}
+
+void Renderer::recordRenderCalls(eRenderMode mode, std::vector<RenderCall>& rendercalls)
+{
+	//groups of calls drawn together, found before the jobs because they can cross the chunks
+	//(the list is sorted by material and mesh, so the copies are together).
+	//the shaders are resolved here too, a lookup can compile one and that needs the GL thread
+	draw_groups.resize(0);
+	bool skip_blend = mode == GBUFFERS || useTransparencyPass(mode);
+	GTR::Material* last_material = NULL;
+	Shader* last_shader = NULL;
+	int num_rendercalls = (int)rendercalls.size();
+	int i = 0;
+	while (i < num_rendercalls)
+	{
+		RenderCall& rc = rendercalls[i];
+		int j = i + 1;
+		if (use_instancing && (rc.material->alpha_mode != BLEND || mode == TRANSPARENCY))
+			while (j < num_rendercalls && rendercalls[j].mesh == rc.mesh && rendercalls[j].material == rc.material)
+				j++;
+		int count = j - i;
+
+		//the BLEND calls of these modes are drawn in the transparency pass
+		if (skip_blend && rc.material->alpha_mode == BLEND)
+		{
+			for (int k = i; k < j; ++k)
+				draw_groups.push_back({ k, 0, NULL });
+			i = j;
+			continue;
+		}
+
+		Shader* shader = count > 1 ? getShader(mode, rc.material, true) : NULL;
+		if (shader)
+		{
+			draw_groups.push_back({ i, count, shader });
+			num_instanced_draws++;
+			num_instanced_rcs += count;
+		}
+		else
+		{
+			if (rc.material != last_material)
+			{
+				last_material = rc.material;
+				last_shader = getShader(mode, rc.material);
+			}
+			for (int k = i; k < j; ++k)
+				draw_groups.push_back({ k, 0, last_shader });
+		}
+		i = j;
+	}
+
+	//created here, the jobs only read it
+	Texture::getWhiteTexture();
+
+	int num_packets = draw_groups.size();
+	int num_chunks = use_parallel_record ? (num_packets + RECORD_CHUNK - 1) / RECORD_CHUNK : 1;
+	draw_packets.resize(num_packets);
+	instance_models.resize(rendercalls.size());
+	if ((int)chunk_lights.size() < num_chunks)
+	{
+		chunk_lights.resize(num_chunks);
+		chunk_marks.resize(num_chunks);
+		chunk_ends.resize(num_chunks);
+	}
+	auto job = [&](int begin, int end, int chunk) {
+		chunk_lights[chunk].resize(0);
+		for (int p = begin; p < end; ++p)
+			recordPacket(mode, draw_packets[p], rendercalls, draw_groups[p], chunk_lights[chunk], chunk_marks[chunk]);
+		chunk_ends[chunk] = end;
+	};
+	if (num_chunks > 1)
+		JobPool::Get()->parallelFor(num_packets, num_chunks, job);
+	else if (num_packets)
+		job(0, num_packets, 0);
+
+	//merge the lights of the chunks and move the offsets of their packets
+	packet_lights.resize(0);
+	int packet = 0;
+	for (int k = 0; k < num_chunks && num_packets; ++k)
+	{
+		int base = packet_lights.size();
+		for (; packet < chunk_ends[k]; ++packet)
+			draw_packets[packet].first_light += base;
+		packet_lights.insert(packet_lights.end(), chunk_lights[k].begin(), chunk_lights[k].end());
+	}
+}
+
+void Renderer::recordPacket(eRenderMode mode, sDrawPacket& packet, std::vector<RenderCall>& rendercalls, const sDrawGroup& group, std::vector<uint32>& lights, std::vector<uint32>& marks)
 {
+	int object = group.object;
+	int num_instances = group.num_instances;
+	RenderCall& rc = rendercalls[object];
+	Mesh* mesh = rc.mesh;
+	GTR::Material* material = rc.material;
+	packet.shader = NULL;
+	packet.mesh = mesh;
+	packet.material = material;
+	packet.object = object;
+	packet.num_instances = num_instances;
+	packet.first_light = lights.size();
+	packet.num_lights = 0;
+
 	//in case there is nothing to do
-	if (!mesh || !mesh->getNumVertices() || !material )
+	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
-    assert(glGetError() == GL_NO_ERROR);
-
-	//flag para deffered en materiales con transparencias.
-	if (mode == GBUFFERS && material->alpha_mode == GTR::eAlphaMode::BLEND)
-		return; // luego cambiar con reticula..., usar disering??
-
-	//define locals to simplify coding
-	Shader* shader = NULL;
-	GTR::Scene* scene = GTR::Scene::instance;
-
-	//create and load texture 
-	Texture* texture = NULL;
-	Texture* em_texture = NULL;
-	Texture* mr_texture = NULL;
-	Texture* oc_texture = NULL;
-	Texture* n_texture = NULL;
-
-	texture = material->color_texture.texture;
-	em_texture = material->emissive_texture.texture;
-	mr_texture = material->metallic_roughness_texture.texture;
-	oc_texture = material->occlusion_texture.texture;
-	n_texture = material->normal_texture.texture;
-
-
-	if (texture == NULL)
-		texture = Texture::getWhiteTexture(); //a 1x1 white texture
-	if (em_texture == NULL)
-		em_texture = Texture::getWhiteTexture();
-	if (mr_texture == NULL)
-		mr_texture = Texture::getWhiteTexture();
-	if (oc_texture == NULL)
-		oc_texture = Texture::getWhiteTexture();
-	if (n_texture == NULL)
-		n_texture = Texture::getWhiteTexture();
-
-
-	//select if render both sides of the triangles
-	if(material->two_sided)
-		glDisable(GL_CULL_FACE); 
+
+	//shader of the mode, NULL for the BLEND calls that go to the transparency pass (no shader, nothing to render)
+	packet.shader = group.shader;
+	if (!packet.shader)
+		return;
+
+	//textures of the material, a 1x1 white texture when missing
+	packet.textures[0] = material->color_texture.texture;
+	packet.textures[1] = material->emissive_texture.texture;
+	packet.textures[2] = material->metallic_roughness_texture.texture;
+	packet.textures[3] = material->occlusion_texture.texture;
+	packet.textures[4] = material->normal_texture.texture;
+	for (int t = 0; t < 5; ++t)
+		if (packet.textures[t] == NULL)
+			packet.textures[t] = Texture::getWhiteTexture();
+
+	//select if render both sides of the triangles, and the blending
+	packet.cull_face = !material->two_sided;
+	packet.blend = material->alpha_mode == GTR::eAlphaMode::BLEND;
+
+	for (int k = 0; k < num_instances; ++k)
+		instance_models[object + k] = rendercalls[object + k].model;
+
+	if (mode == MULTI)
+	{
+		//one pass per light that reaches the object (any of the instances), the ones out of the block are skipped
+		object_lights.getLights(object, std::max(num_instances, 1), lights, marks);
+		int num_passes = packet.first_light;
+		for (int k = packet.first_light; k < (int)lights.size(); ++k)
+			if ((int)lights[k] < num_block_lights)
+				lights[num_passes++] = lights[k];
+		lights.resize(num_passes);
+
+		//without lights there is still one pass for the ambient and the emissive
+		if ((int)lights.size() == packet.first_light)
+			lights.push_back((uint32)-1);
+		packet.num_lights = lights.size() - packet.first_light;
+	}
+}
+
+//draws the mesh once or all the instances
+static inline void drawMesh(Mesh* mesh, const Matrix44* instance_models, int num_instances)
+{
+	if (num_instances)
+		mesh->renderInstanced(GL_TRIANGLES, instance_models, num_instances);
 	else
-		glEnable(GL_CULL_FACE);
-    assert(glGetError() == GL_NO_ERROR); 
+		mesh->render(GL_TRIANGLES);
+}
 
-	//select shader with respect to the mode 
-	if (mode == SHOW_TEXTURE)
-		shader = Shader::Get("texture");
+//renders a mesh given its transform and material
+void Renderer::executePacket(eRenderMode mode, const sDrawPacket& packet, std::vector<RenderCall>& rendercalls)
+{
+	Shader* shader = packet.shader;
+	if (!shader)
+		return;
+	assert(glGetError() == GL_NO_ERROR);
 
-	else if (mode == SINGLE)
-		shader = Shader::Get("light_singlepass");
+	//without cache every call is sent
+	if (!use_state_cache)
+		gl_state.invalidate();
 
-	else if (mode ==  MULTI)
-		shader = Shader::Get("light");
+	gl_state.setCullFace(packet.cull_face);
+	gl_state.useShader(shader);
 
-	else if (mode == SHOW_NORMAL) {
-		shader = Shader::Get("sh2debug");
-		shader->enable();
+	if (mode == SHOW_NORMAL)
 		shader->setUniform("u_texture_type", 0);
-	}
-	else if (mode == SHOW_OC) {
-		shader = Shader::Get("sh2debug");
-		shader->enable();
+	else if (mode == SHOW_OC)
 		shader->setUniform("u_texture_type", 1);
-	}
-	else if (mode == SHOW_UVS) {
-		shader = Shader::Get("sh2debug");
-		shader->enable();
+	else if (mode == SHOW_UVS)
 		shader->setUniform("u_texture_type", 2);
+
+	//upload uniforms (camera and lights are in the per frame blocks)
+	if (!packet.num_instances)
+		shader->setUniform("u_model", rendercalls[packet.object].model);
+	bindMaterialBlock(packet.material);
+
+	//upload textures
+	gl_state.setTexture(shader, "u_color_texture", packet.textures[0], 0);
+	gl_state.setTexture(shader, "u_emissive_texture", packet.textures[1], 1);
+	gl_state.setTexture(shader, "u_metallic_roughness_texture", packet.textures[2], 2);
+	gl_state.setTexture(shader, "u_occlusion_texture", packet.textures[3], 3);
+	gl_state.setTexture(shader, "u_normal_texture", packet.textures[4], 4);
+
+	//the alpha threshold (u_alpha_cutoff) is in the material block
+
+	//paints the pixels if it is LESS OR EQUAL of Zdepth, or only the ones of the pre-pass (the transparent ones are not in it)
+	bool equal_depth = depth_prepass_done && !packet.blend;
+	gl_state.setDepthFunc(equal_depth ? GL_EQUAL : GL_LEQUAL);
+	gl_state.setDepthMask(!equal_depth);
+
+	//select the blending. Solo para las luces. The transparency pass keeps the one of addTransparencyPasses
+	if (mode == TRANSPARENCY)
+		gl_state.setTexture(shader, "u_depth_texture", transparency_depth, 10);
+	else if (packet.blend)
+	{
+		gl_state.setBlend(true);
+		gl_state.setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
-	
-	else if (mode == GBUFFERS) 
-		shader = Shader::Get("gbuffers");
-	
+	else
+		gl_state.setBlend(false);
 
-	if (!shader)//no shader? then nothing to render
+	const Matrix44* models = packet.num_instances ? &instance_models[packet.object] : NULL;
+	if (mode == GTR::eRenderMode::SINGLE || mode == GTR::eRenderMode::MULTI)
+	{
+		renderlights(mode, packet, models);
 		return;
+	}
+	//lit in one pass like SINGLE
+	if (mode == TRANSPARENCY)
+	{
+		renderlights(SINGLE, packet, models);
+		return;
+	}
 
-	shader->enable();
-
-	assert(glGetError() == GL_NO_ERROR);
+	drawMesh(packet.mesh, models, packet.num_instances);
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model );
-	//float t = getTime(); shader->setUniform("u_time", t);
-	shader->setUniform("u_emissive_factor", material->emissive_factor);
-	shader->setUniform("u_color", material->color);
+	//the shader and the blending are restored at the end of the pass (gl_state.endPass)
+}
 
-	//upload textures
-	if(texture)
-		shader->setTexture("u_color_texture", texture, 0);
-	if(em_texture)
-		shader->setTexture("u_emissive_texture", em_texture, 1);
-	if(mr_texture )
-		shader->setTexture("u_metallic_roughness_texture", mr_texture, 2);
-	if (oc_texture)
-		shader->setTexture("u_occlusion_texture", oc_texture, 3);
-	if (n_texture)
-		shader->setTexture("u_normal_texture", n_texture, 4);
 
+void Renderer::renderDepthPrepass(std::vector<RenderCall>& rendercalls)
+{
+	long triangles = Mesh::num_triangles_rendered;
+	glColorMask(false, false, false, false);
+	gl_state.setDepthMask(true);
+	gl_state.setDepthFunc(GL_LESS);
+	gl_state.setBlend(false);
 
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	for (unsigned int i = 0; i < draw_packets.size(); ++i)
+	{
+		const sDrawPacket& packet = draw_packets[i];
+		if (!packet.shader || packet.blend)
+			continue;
+		Shader* shader = Shader::Get(packet.num_instances ? "shadow_instanced" : "shadow");
+		if (!shader)
+			break;
+		if (!use_state_cache)
+			gl_state.invalidate();
+
+		gl_state.setCullFace(packet.cull_face);
+		gl_state.useShader(shader);
+		if (!packet.num_instances)
+			shader->setUniform("u_model", rendercalls[packet.object].model);
+		bindMaterialBlock(packet.material);
+		gl_state.setTexture(shader, "u_color_texture", packet.material->alpha_mode == MASK ? packet.textures[0] : Texture::getWhiteTexture(), 0);
+		drawMesh(packet.mesh, packet.num_instances ? &instance_models[packet.object] : NULL, packet.num_instances);
+	}
 
-	glDepthFunc(GL_LEQUAL); //paints the pixels if it is LESS OR EQUAL of Zdepth
-	shader->setUniform("u_ambient_light", scene->ambient_light);//? ...
+	glColorMask(true, true, true, true);
+	num_prepass_triangles = Mesh::num_triangles_rendered - triangles;
+}
 
-	//select the blending. Solo para las luces.
-	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
+Shader* Renderer::getShader(eRenderMode mode, GTR::Material* material, bool instanced)
+{
+	if (mode == TRANSPARENCY)
 	{
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		if (material->alpha_mode != BLEND)
+			return NULL;
+		return Shader::GetVariant(instanced ? "light_singlepass_instanced" : "light_singlepass", "#define OIT_ACCUMULATE");
 	}
-	else
-		glDisable(GL_BLEND);
-	
-	/*if (mode != GTR::eRenderMode::SINGLE || mode != GTR::eRenderMode::MULTI) {
-		mesh->render(GL_TRIANGLES);
-		std::cout << "Hello World!";
-		return; 
-	}*/
-	
-	if (mode == GTR::eRenderMode::SINGLE || mode == GTR::eRenderMode::MULTI) {
-		
-		renderlights(mode, shader, mesh, material);
-		
-		shader->disable();
-		glDisable(GL_BLEND);
-		
-		return;
+
+	if (instanced)
+	{
+		if (mode == SHOW_TEXTURE)
+			return Shader::Get("texture_instanced");
+		if (mode == SINGLE)
+			return Shader::Get("light_singlepass_instanced");
+		if (mode == MULTI)
+			return Shader::Get("light_instanced");
+		if (mode == GBUFFERS)
+			return getGBufferShader("gbuffers_instanced");
+		return NULL;
 	}
 
-	mesh->render(GL_TRIANGLES);
-	
-	shader->disable();
-	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
+	if (mode == SHOW_TEXTURE)
+		return Shader::Get("texture");
+	if (mode == SINGLE)
+		return Shader::Get("light_singlepass");
+	if (mode == MULTI)
+		return Shader::Get("light");
+	if (mode == SHOW_NORMAL || mode == SHOW_OC || mode == SHOW_UVS)
+		return Shader::Get("sh2debug");
+	if (mode == GBUFFERS)
+		return getGBufferShader("gbuffers");
+	return NULL;
+}
+
+void Renderer::setUpscaleFilter(Texture* texture, bool upscale)
+{
+	if (texture->width == width && texture->height == height)
+		return;
+	GLenum filter = upscale ? GL_LINEAR : GL_NEAREST;
+	glBindTexture(texture->texture_type, texture->texture_id);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MIN_FILTER, filter);
+	glBindTexture(texture->texture_type, 0);
+}
 
+bool Renderer::useTransparencyPass(eRenderMode mode)
+{
+	return use_oit && (mode == SINGLE || mode == MULTI || mode == GBUFFERS);
 }
 
+void Renderer::addTransparencyPasses(std::vector<RenderCall>& rendercalls, Camera* camera, int color, int depth)
+{
+	//color * alpha * weight and the revealage in the alpha, the sum of the weights in the other one (same size as the depth)
+	const FrameGraph::sTextureDesc& depth_desc = frame_graph.resources[depth].desc;
+	FrameGraph::sTextureDesc accum_desc = { depth_desc.width, depth_desc.height, GL_RGBA, GL_HALF_FLOAT, GL_RGBA16F };
+	FrameGraph::sTextureDesc weights_desc = { depth_desc.width, depth_desc.height, GL_RED, GL_HALF_FLOAT, GL_R16F };
+	int accum = frame_graph.createTexture("transparency", accum_desc);
+	int weights = frame_graph.createTexture("transparency weights", weights_desc);
+	std::vector<int> writes;
+	writes.push_back(accum);
+	writes.push_back(weights);
+
+	//compiled here, the recording jobs only find them
+	Shader::GetVariant("light_singlepass", "#define OIT_ACCUMULATE");
+	Shader::GetVariant("light_singlepass_instanced", "#define OIT_ACCUMULATE");
+
+	//the lambdas run after this function returns, the handles are copied
+	frame_graph.addPass("transparency", std::vector<int>(1, depth), writes, [this, &rendercalls, camera, depth]() {
+		//nothing added and everything revealed
+		glClearColor(0, 0, 0, 1);
+		glClear(GL_COLOR_BUFFER_BIT);
+		checkGLErrors();
+
+		//in any order: the color and the weights are added, the revealage multiplied by 1 - alpha
+		gl_state.invalidate();
+		gl_state.setDepthTest(false);
+		gl_state.setDepthMask(false);
+		glEnable(GL_BLEND);
+		glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+		transparency_depth = frame_graph.getTexture(depth);
+		renderRenderCalls(TRANSPARENCY, rendercalls, camera);
+		gl_state.endPass();
+		glEnable(GL_DEPTH_TEST);
+	});
+
+	std::vector<int> reads;
+	reads.push_back(color);
+	reads.push_back(accum);
+	reads.push_back(weights);
+	frame_graph.addPass("present", reads, std::vector<int>(), [this, color, accum, weights]() {
+		Texture* textures[3] = { frame_graph.getTexture(color), frame_graph.getTexture(accum), frame_graph.getTexture(weights) };
+		for (int i = 0; i < 3; ++i)
+			setUpscaleFilter(textures[i], true);
+		textures[0]->toViewport();
+
+		//average color of the transparent surfaces over the opaque image, as much as they cover
+		Shader* shader = Shader::Get("oit_composite");
+		shader->enable();
+		shader->setTexture("u_accum_texture", textures[1], 0);
+		shader->setTexture("u_weights_texture", textures[2], 1);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+		Mesh::getQuad()->render(GL_TRIANGLES);
+		glDisable(GL_BLEND);
+		shader->disable();
+
+		for (int i = 0; i < 3; ++i)
+			setUpscaleFilter(textures[i], false);
+	}, true);
+}
 
-void Renderer::renderlights(eRenderMode mode, Shader* shader, Mesh* mesh, GTR::Material* material) {
+void Renderer::renderlights(eRenderMode mode, const sDrawPacket& packet, const Matrix44* instance_models) {
 	
+	Shader* shader = packet.shader;
 	if (!shader)
 		return;
 	
 	if (mode == eRenderMode::MULTI) {
 
-		for (int i = 0; i < this->light_entities.size(); ++i) {
+		//the lights of the object were found when recording (at least one pass for the ambient and the emissive)
+		gl_state.setTexture(shader, "u_shadow_atlas", shadow_atlas.fbo.depth_texture, 8);
+		gl_state.setTexture(shader, "u_shadow_data", &shadow_atlas.data_tbo, 9);
 
-			LightEntity* light = this->light_entities[i];
+		for (int i = 0; i < packet.num_lights; ++i) {
 
 			// first pass we don't use blending
-			if (i == 0 && material->alpha_mode != BLEND)
+			if (i == 0 && !packet.blend)
 			{
-				glDisable(GL_BLEND);
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+				gl_state.setBlend(false);
+				gl_state.setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 			}
 			else {
-				glEnable(GL_BLEND);//enable blending and add the pixels to the previous ones
-				glDepthFunc(GL_LEQUAL);//paints the pixels if it is LESS OR EQUAL of Zdepth
-				glBlendFunc(GL_ONE, GL_ONE);
+				gl_state.setBlend(true);//enable blending and add the pixels to the previous ones
+				gl_state.setBlendFunc(GL_ONE, GL_ONE);
 
 			}
-			//pass the lights data to the shader
-			light->uploadToShader(shader);
-			mesh->render(GL_TRIANGLES);
-			
+			//the light data is already in the block, we only say which one
+			shader->setUniform("u_light_index", (int)packet_lights[packet.first_light + i]);
 			//only one pass ambient light and emissive light
-			shader->setUniform("u_ambient_light", Vector3(0, 0, 0));
-			shader->setUniform("u_emissive_factor", Vector3(0, 0, 0));
+			shader->setUniform("u_first_pass", i == 0);
+			drawMesh(packet.mesh, instance_models, packet.num_instances);
 
 		} // loop of multipass
 
-		glDisable(GL_BLEND);
-		glDepthFunc(GL_LESS);
+		gl_state.setBlend(false);
 		
 		return; //we put return, to go out when it finish!
 	} // flag of multipass
 	
 	if (mode == eRenderMode::SINGLE) {
-		std::vector <LightEntity*> lights = this->light_entities;
-		const int num_lights = 8;
-
-		int light_type[num_lights];
-		Vector3 light_color[num_lights];
-		Vector3 light_position[num_lights];
-		Vector3 light_direction[num_lights];
-		float light_intensity[num_lights];
-		float light_maxdist[num_lights];
-		Vector3 light_target[num_lights];
-		float light_spot_exp[num_lights];
-		float light_spot_cutoff[num_lights];
-		Vector3 light_fronts[num_lights];
-
-		//fill the elements of the lists
-		for (int i = 0; i < lights.size(); i++)
-		{
-			if (i > num_lights - 1 )
-				break; //finish when the have used all posibles lights of the list
-			// This is because we could have more lights [lights.size] than the ones that we want to render. Then to avoid IndexError.
+		//every instance reads its list of lights (see get_lightslist_uniforms)
+		gl_state.setTexture(shader, "u_light_data", &object_lights.lights_tbo, 5);
+		gl_state.setTexture(shader, "u_object_lights", &object_lights.ranges_tbo, 6);
+		gl_state.setTexture(shader, "u_light_list", &object_lights.indices_tbo, 7);
+		shader->setUniform("u_object_index", packet.object);
+		gl_state.setTexture(shader, "u_shadow_atlas", shadow_atlas.fbo.depth_texture, 8);
+		gl_state.setTexture(shader, "u_shadow_data", &shadow_atlas.data_tbo, 9);
+		drawMesh(packet.mesh, instance_models, packet.num_instances);
 
-			light_type[i] = lights[i]->light_type;
-			light_color[i] = lights[i]->color;
-			light_position[i] = lights[i]->model.getTranslation();
 
-			light_direction[i] =  lights[i]->model.rotateVector(Vector3(0, 0, -1));
-
-			light_intensity[i] = lights[i]->intensity;
-			light_maxdist[i] = lights[i]->max_dist;
-
-			light_fronts[i] = lights[i]->target;
-			light_spot_exp[i] = lights[i]->spot_exp;
-			light_spot_cutoff[i] = cosf(lights[i]->spot_cutoff * DEG2RAD);
+		return;
+	}
 
-		}
-				
-		shader->setUniform1("u_num_lights", num_lights);
-		shader->setUniform1Array("u_light_types", (int*)&light_type, num_lights);
-		shader->setUniform3Array("u_light_colors", (float*)&light_color, num_lights);
-		shader->setUniform3Array("u_light_positions", (float*)&light_position, num_lights);
-		shader->setUniform3Array("u_light_vectors", (float*)&light_direction, num_lights);
-		shader->setUniform1Array("u_light_intensitis", (float*)&light_intensity, num_lights);
-		shader->setUniform1Array("u_light_maxdists", (float*)&light_maxdist, num_lights);
-
-		shader->setUniform3Array("u_light_fronts", (float*)&light_fronts, num_lights);
-		shader->setUniform1Array("u_light_spot_exps", (float*)&light_spot_exp, num_lights);
-		shader->setUniform1Array("u_light_spot_cutoffs", (float*)&light_spot_cutoff, num_lights);
-		
-		mesh->render(GL_TRIANGLES);
+}
 
 
+void Renderer::updateShadows(GTR::Scene* scene, Camera* camera)
+{
+	static const std::vector<LightEntity*> no_lights;
+
+	//the casters are found with the tree, also when it is not used for the camera
+	if (!use_bvh)
+		bvh.update(scene);
+	shadow_atlas.update(camera, use_shadows ? light_entities : no_lights, &bvh);
+	shadow_atlas.upload();
+	if (shadow_atlas.render_tiles.empty())
 		return;
-	}
 
+	//only depth, every tile in its square of the atlas
+	gl_state.invalidate();
+	shadow_atlas.fbo.bind();
+	glColorMask(false, false, false, false);
+	glEnable(GL_SCISSOR_TEST);
+	glEnable(GL_POLYGON_OFFSET_FILL); //slope bias, the bias of the light is not enough on surfaces almost parallel to the light
+	glPolygonOffset(2.0f, 2.0f);
+	gl_state.setDepthTest(true);
+	gl_state.setDepthMask(true);
+	gl_state.setDepthFunc(GL_LESS);
+	gl_state.setBlend(false);
+
+	for (unsigned int i = 0; i < shadow_atlas.render_tiles.size(); ++i)
+		render2depthbuffer(*shadow_atlas.render_tiles[i]);
+
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glDisable(GL_SCISSOR_TEST);
+	glColorMask(true, true, true, true);
+	shadow_atlas.fbo.unbind();
+	gl_state.endPass();
 }
 
+void Renderer::render2depthbuffer(ShadowAtlas::sTile& tile)
+{
+	glViewport(tile.x, tile.y, tile.size, tile.size);
+	glScissor(tile.x, tile.y, tile.size, tile.size);
+	glClear(GL_DEPTH_BUFFER_BIT);
 
-void Renderer::render2depthbuffer(GTR::Material* material, Camera* camera) {
+	//the shaders read the viewprojection from the camera block
+	uploadCameraBlock(GTR::Scene::instance, &tile.camera);
 
-	/*LightEntity* light;
-	for (int i = 0; i < this->light_entities.size(); ++i)
+	Shader* shader = Shader::Get("shadow");
+	if (!shader)
+		return;
+	gl_state.useShader(shader);
+	for (unsigned int i = 0; i < tile.casters.size(); ++i)
 	{
-		if (this->light_entities[i]->light_type == SPOT) {
-			light = this->light_entities[i];
-		}
+		SceneBVH::sLeaf& leaf = bvh.leaves[tile.casters[i]];
+		GTR::Material* material = leaf.node->material;
+		Texture* texture = material->color_texture.texture;
+		if (!texture || material->alpha_mode != MASK)
+			texture = Texture::getWhiteTexture();
+
+		gl_state.setCullFace(!material->two_sided);
+		bindMaterialBlock(material);
+		gl_state.setTexture(shader, "u_color_texture", texture, 0);
+		shader->setUniform("u_model", leaf.model);
+		leaf.node->mesh->render(GL_TRIANGLES);
 	}
+}
 
-	//first time we create the FBO
-	if (!light->shadow_fbo)
+void Renderer::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Show GBuffers", &show_gbuffers);
+	static const char* layout_names[NUM_GBUFFER_LAYOUTS] = { "basic", "octahedral", "octahedral 10 bits" };
+	char layout_labels[NUM_GBUFFER_LAYOUTS][64];
+	const char* layout_items[NUM_GBUFFER_LAYOUTS];
+	for (int i = 0; i < NUM_GBUFFER_LAYOUTS; ++i)
 	{
-		
-		FBO* fbo = new FBO();
-		light->shadow_fbo = fbo;
-		light->shadow_fbo->setDepthOnly(1024, 1024);
+		sprintf(layout_labels[i], "%s (%d bytes/pixel)", layout_names[i], getGBufferBytesPerPixel((eGBufferLayout)i));
+		layout_items[i] = layout_labels[i];
 	}
-
-	//enable it to render inside the texture
-	light->shadow_fbo->bind();
-
-	//you can disable writing to the color buffer to speed up the rendering as we do not need it
-	glColorMask(false, false, false, false);
-
-	//clear the depth buffer only (don't care of color)
-	glClear(GL_DEPTH_BUFFER_BIT);
-
-	//whatever we render here will be stored inside a texture, we don't need to do anything fanzy
-	
-	renderPriority(this->rc_data_list, camera);
-
-
-	if (material->alpha_mode == BLEND)
+	ImGui::Combo("GBuffer layout", (int*)&gbuffer_layout, layout_items, NUM_GBUFFER_LAYOUTS);
+	ImGui::Checkbox("HDR illumination (R11G11B10F)", &use_hdr_illumination);
+	ImGui::Checkbox("Dynamic resolution", &dynamic_resolution.enabled);
+	if (dynamic_resolution.enabled)
 	{
-		glDisable(GL_BLEND);
+		ImGui::SliderFloat("Frame budget (ms)", &dynamic_resolution.budget, 4.0f, 50.0f);
+		ImGui::SliderFloat("Min scale", &dynamic_resolution.min_scale, DYNRES_STEP, 1.0f);
 	}
-
-	//disable it to render back to the screen
-	light->shadow_fbo->unbind();
-
-	//allow to render back to the color buffer
-	glColorMask(true, true, true, true);
-	
-	*/
+	ImGui::Text("Render size: %dx%d (scale %.3f), GPU %.2f ms, %d changes", render_width, render_height, dynamic_resolution.enabled ? dynamic_resolution.scale : 1.0f, dynamic_resolution.gpu_time, dynamic_resolution.num_changes);
+	ImGui::Checkbox("Stencil light volumes", &use_stencil_volumes);
+	ImGui::Checkbox("Light pixel stats", &light_pixel_stats);
+	if (light_pixel_stats)
+	{
+		int total = 0, max_pixels = 0, num_drawn = 0;
+		for (int i = 0; i < light_pixels.size(); ++i)
+			if (light_pixels[i] >= 0)
+			{
+				total += light_pixels[i];
+				max_pixels = std::max(max_pixels, light_pixels[i]);
+				num_drawn++;
+			}
+		ImGui::Text("Shaded pixels: %d in %d lights, %d max", total, num_drawn, max_pixels);
+		if (ImGui::TreeNode("Pixels per light"))
+		{
+			for (int i = 0; i < light_pixels.size(); ++i)
+				if (light_pixels[i] >= 0)
+					ImGui::Text("%d %s: %d", i, light_entities[i]->name.c_str(), light_pixels[i]);
+			ImGui::TreePop();
+		}
+	}
+	ImGui::Text("Frame graph: %d passes (%d culled), %d of %d textures, %.1f MB (%.1f MB without aliasing)", (int)frame_graph.order.size(), frame_graph.num_culled, frame_graph.num_textures, frame_graph.pool_size, frame_graph.memory / (1024.0f * 1024.0f), frame_graph.memory_no_aliasing / (1024.0f * 1024.0f));
+	ImGui::Checkbox("Parallel collect", &use_parallel_collect);
+	ImGui::Checkbox("Compare with serial", &compare_collect);
+	if (compare_collect)
+		ImGui::Text(collect_match ? "Collect: match" : "Collect: MISMATCH");
+	ImGui::Text("Collect: %.3f ms (%d threads)", collect_time, JobPool::Get()->num_threads);
+	ImGui::Checkbox("BVH culling", &use_bvh);
+	if (use_bvh)
+		ImGui::Text("BVH: %d visited, %d drawn of %d nodes (%d rebuilds, %d refits)", bvh.num_visited, bvh.num_drawn, (int)bvh.leaves.size(), bvh.num_rebuilds, bvh.num_refits);
+	ImGui::Checkbox("Levels of detail", &use_lods);
+	if (use_lods)
+	{
+		ImGui::SliderFloat("LOD max error", &lod_max_error, 0.1f, 10.0f);
+		ImGui::SliderFloat("LOD hysteresis", &lod_hysteresis, 0.0f, 0.5f);
+		int lod_calls[MESH_MAX_LODS + 1] = { 0 };
+		long lod_triangles = 0;
+		for (int i = 0; i < rc_data_list.size(); ++i)
+		{
+			lod_calls[rc_data_list[i].mesh->lod_level]++;
+			lod_triangles += rc_data_list[i].mesh->getNumIndices() / 3;
+		}
+		std::string text = "Calls per level:";
+		for (int i = 0; i <= MESH_MAX_LODS; ++i)
+			text += " " + std::to_string(lod_calls[i]);
+		ImGui::Text("%s (%.1fK tris)", text.c_str(), lod_triangles * 0.001f);
+	}
+	ImGui::Checkbox("Occlusion culling", &use_occlusion);
+	if (use_occlusion)
+	{
+		ImGui::SliderFloat("Occluder min size", &occluder_min_area, 0.0f, 1.0f);
+		ImGui::SliderInt("Max occluders", &max_occluders, 0, 64);
+		ImGui::Checkbox("SIMD raster", &occlusion.use_simd);
+		ImGui::Text("Occlusion: %d occluders (%d tris), %d of %d culled, %.3f ms", occlusion.num_occluders, occlusion.num_triangles, num_occlusion_culled, occlusion.num_tested, occlusion_time);
+	}
+	if (ImGui::Checkbox("Cache render list", &use_render_cache) && !use_render_cache)
+		render_list_valid = false;
+	if (use_render_cache)
+	{
+		ImGui::SliderInt("Max patched entities", &max_patched_entities, 0, 64);
+		const char* states[] = { "collected", "patched", "reused" };
+		ImGui::Text("Render list: %s (%d entities moved)", states[render_list_state], num_patched_entities);
+	}
+	ImGui::Checkbox("Sort keys (radix)", &use_sort_keys);
+	ImGui::Checkbox("Sort stats", &sort_stats);
+	ImGui::Text("Switches: %d shaders, %d materials", shader_switches, material_switches);
+	if (sort_stats)
+		ImGui::Text("Distance sort: %d shaders, %d materials (saved %d)", dist_shader_switches, dist_material_switches, (dist_shader_switches - shader_switches) + (dist_material_switches - material_switches));
+	ImGui::Checkbox("GL state cache", &use_state_cache);
+	ImGui::Text("GL calls: %d issued, %d elided", (int)gl_state.num_issued, (int)gl_state.num_elided);
+	ImGui::Checkbox("Instancing", &use_instancing);
+	ImGui::Checkbox("Parallel recording", &use_parallel_record);
+	ImGui::Text("Recording: %d packets, %.3f ms", (int)draw_packets.size(), record_time);
+	ImGui::Checkbox("Depth pre-pass (multi)", &use_depth_prepass);
+	float fragments_saved = fragments_shaded[0] ? 100.0f * (1.0f - fragments_shaded[1] / (float)fragments_shaded[0]) : 0.0f;
+	ImGui::Text("Shaded fragments: %.1fK (%.1fK with pre-pass, %.1fK without, %.1f%% saved), pre-pass %.1fK tris", num_fragments_shaded * 0.001f, fragments_shaded[1] * 0.001f, fragments_shaded[0] * 0.001f, fragments_saved, num_prepass_triangles * 0.001f);
+	RingBuffer* ring = RingBuffer::Get();
+	ImGui::Text("Streaming: %.1f KB in %d uploads, %d fence waits (%.3f ms)%s", ring->bytes_streamed / 1024.0f, ring->num_uploads, ring->num_waits, ring->wait_time, ring->persistent ? ", persistent" : "");
+	ImGui::Text("Instanced: %d draws for %d calls", num_instanced_draws, num_instanced_rcs);
+	ImGui::Checkbox("Order independent transparency", &use_oit);
+	ImGui::Text("Transparent calls: %d", num_transparent_rcs);
+	ImGui::Checkbox("Shadows", &use_shadows);
+	ImGui::Checkbox("Cache shadows", &shadow_atlas.use_cache);
+	ImGui::Text("Shadow atlas: %d lights, %d tiles, %d rendered, %d without space, %.3f ms", shadow_atlas.num_shadows, shadow_atlas.num_tiles, shadow_atlas.num_rendered, shadow_atlas.num_failed, shadow_atlas.update_time);
+	ImGui::Checkbox("Clustered lights", &use_light_clusters);
+	ImGui::Checkbox("SIMD culling", &light_clusters.use_simd);
+	ImGui::Text("Clusters: %d lights, %d pairs, max %d, %.3f ms", light_clusters.num_lights, light_clusters.num_pairs, light_clusters.max_per_cluster, light_clusters.build_time);
+	ImGui::Checkbox("Per object lights", &object_lights.cull_lights);
+	ImGui::Text("Object lights: %d pairs for %d objects, max %d, %.3f ms", object_lights.num_pairs, object_lights.num_objects, object_lights.max_per_object, object_lights.build_time);
+	if (ImGui::Button("Light benchmark"))
+		run_light_benchmark = true;
+#endif
 }
 
-
 Texture* GTR::CubemapFromHDRE(const char* filename)
 {
 	HDRE* hdre = new HDRE();
@@ -1,6 +1,15 @@
 #pragma once
 #include "prefab.h"
 #include "fbo.h"
+#include "glstate.h"
+#include "ubo.h"
+#include "lightclusters.h"
+#include "scenebvh.h"
+#include "occlusion.h"
+#include "objectlights.h"
+#include "shadowatlas.h"
+#include "framegraph.h"
+#include "dynamicresolution.h"
 #include "application.h"
 
 //forward declarations
@@ -15,7 +24,8 @@ namespace GTR {
 		SHOW_UVS,
 		SINGLE,
 		MULTI,
-		GBUFFERS
+		GBUFFERS,
+		TRANSPARENCY //only the BLEND calls, into the targets of the weighted blended transparency
 	
 	};
 
@@ -24,6 +34,14 @@ namespace GTR {
 		DEFERRED
 	};
 
+	//targets of the gbuffers, the shaders of the deferred are compiled with the macros of the layout (see get_gbuffer_functions)
+	enum eGBufferLayout {
+		GBUFFER_BASIC, //color, normal (xyz in 0..1) and metallic-roughness in three RGBA8 targets
+		GBUFFER_OCTAHEDRAL, //normal in two channels, the occlusion, roughness and metallic in the free ones, no extra target
+		GBUFFER_OCTAHEDRAL_10, //the same with the normal target in RGB10A2 (only 2 bits for the metallic)
+		NUM_GBUFFER_LAYOUTS
+	};
+
 	class Prefab;
 	class Material;
 	
@@ -34,16 +52,106 @@ namespace GTR {
 		Mesh* mesh;
 		Material* material;
 		float dist2camera;
+		uint64 sort_key;
+		bool occluder; //the node is flagged as occluder
 
 		RenderCall() {
 			mesh = NULL;
 			material = NULL;
 			dist2camera = NULL;
+			sort_key = 0;
+			occluder = false;
 			model.setIdentity();
 		}
 	};
 
 
+	//a draw recorded from the render calls, everything is resolved so the GL thread only has to execute it
+	struct sDrawPacket
+	{
+		Shader* shader; //NULL when there is nothing to draw
+		Mesh* mesh;
+		Material* material;
+		Texture* textures[5]; //color, emissive, metallic-roughness, occlusion and normal (white when missing)
+		int object; //render call of the mesh (or the first instance), for the model and the lights of the object
+		int num_instances; //0 for a single mesh
+		int first_light; //passes of the multipass in packet_lights
+		int num_lights;
+		bool cull_face;
+		bool blend;
+	};
+
+	//calls of a packet, found on the GL thread before recording
+	struct sDrawGroup
+	{
+		int object; //first render call
+		int num_instances; //0 without instancing
+		Shader* shader; //resolved here because a lookup can compile it, NULL when there is nothing to draw
+	};
+
+	//packed sort key of a render call (most significant bits first), the ids are ranks among the ones in the list:
+	// opaque/mask: [alpha class 2][shader 6][material 16][mesh 16][depth 24] -> grouped by state and mesh (instancing), front to back
+	// blend:       [alpha class 2][inverted depth 24][shader 6][material 16][free 16] -> back to front
+	//              with the transparency pass the order doesn't matter: no depth and the mesh in the free bits
+	enum eSortKeyClass {
+		KEY_OPAQUE = 0,
+		KEY_MASK = 1,
+		KEY_BLEND = 2
+	};
+
+	struct sSortItem {
+		uint64 key;
+		uint32 index;
+	};
+
+	//how the render list of the frame was obtained
+	enum eRenderListState {
+		LIST_COLLECTED, //from scratch
+		LIST_PATCHED, //only the entities that moved
+		LIST_REUSED //the one of the last frame
+	};
+
+	//what the render list depends on besides the entities, compared with memcmp
+	struct sRenderListKey {
+		Scene* scene;
+		int camera_version;
+		int node_edits;
+		int mode;
+		int use_occlusion;
+		float occluder_min_area;
+		int occluder_max_triangles;
+		int max_occluders;
+		int use_sort_keys;
+		int use_oit;
+		int use_lods;
+		float lod_max_error;
+		float lod_hysteresis;
+	};
+
+	#define UBO_MAX_LIGHTS 256 //same as MAX_LIGHTS in the shaders
+
+	//std140 blocks, see get_camera_block and get_lights_block in the shader atlas
+	struct sCameraBlock {
+		Matrix44 viewprojection;
+		Vector3 camera_position;
+		int num_lights;
+		Vector3 ambient_light;
+		float padding;
+	};
+
+	struct sLightData {
+		Vector3 position;
+		float max_dist;
+		Vector3 color;
+		float intensity;
+		Vector3 vector;
+		float type;
+		float spot_cosine_cutoff;
+		float spot_exponent;
+		float area_size;
+		float shadow; //first tile in the shadow atlas, -1 without shadow
+	};
+
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
 	class Renderer
@@ -61,18 +169,159 @@ namespace GTR {
 				
 
 		FBO fbo;
-		FBO gbuffers_fbo;
-		FBO illumination_fbo;
 
+		//passes of the deferred, the gbuffers and the illumination are transient targets of its pool
+		FrameGraph frame_graph;
+
+		//size of the window, taken every frame (it can be resized)
 		int width = Application::instance->window_width;
 		int height = Application::instance->window_height;
 
+		//the passes of the deferred before the present are rendered at a scale of the window to keep the GPU time
+		//of the frame inside a budget, then upscaled (the targets of every scale are in the pool of the frame graph)
+		DynamicResolution dynamic_resolution;
+		int render_width;
+		int render_height;
+
 		bool show_gbuffers;
+		eGBufferLayout gbuffer_layout;
+		bool use_hdr_illumination; //R11G11B10F for the illumination target instead of RGB8
+
+		//point and spot lights of the deferred without clusters only shade the pixels inside their volume (sphere or cone), marked in the stencil
+		bool use_stencil_volumes;
+
+		//pixels shaded by every light of the deferred without clusters, counted with queries read the next frame
+		bool light_pixel_stats;
+		std::vector<GLuint> light_queries;
+		std::vector<int> light_query_lights; //light of every query issued the last frame
+		int num_light_queries;
+		std::vector<int> light_pixels; //per light of light_entities, -1 when it was not drawn
 
 		eRenderMode render_mode;
 		ePipelineMode pipeline_mode;
 
 		bool rendering_shadowmap;
+
+		//parallel collection of the render calls
+		bool use_parallel_collect;
+		bool compare_collect; //runs both paths and checks that they give the same list
+		bool collect_match;
+		float collect_time; //ms
+		std::vector< std::vector<RenderCall> > rc_thread_lists; //one buffer per chunk of entities
+		std::vector< std::vector<LightEntity*> > light_thread_lists;
+
+		//culling of the prefab nodes with a tree kept between frames
+		bool use_bvh;
+		SceneBVH bvh;
+		std::vector<int> bvh_visible;
+
+		//levels of detail of the meshes (see Mesh::generateLODs): the coarsest one whose error projected on the screen is under
+		//lod_max_error, and it only changes when the error leaves a band around it, so it doesn't pop back and forth
+		bool use_lods;
+		float lod_max_error; //in the units of Camera::getProjectedScale
+		float lod_hysteresis; //width of the band, fraction of lod_max_error
+
+		//software occlusion culling: big (or flagged) opaque meshes are rasterized on the CPU
+		//and the render calls behind them are removed before sorting
+		bool use_occlusion;
+		OcclusionBuffer occlusion;
+		float occluder_min_area; //fraction of the screen covered by the box to be picked as occluder
+		int occluder_max_triangles;
+		int max_occluders;
+		float occlusion_time; //ms
+		int num_occlusion_culled;
+		std::vector<BoundingBox> rc_boxes;
+		std::vector< std::pair<float, int> > occluder_candidates;
+
+		//the culled and sorted list is kept between frames: reused while the camera, the entities and the settings don't change,
+		//and when only a few entities moved just their render calls are collected again (then occlusion and sorting as always)
+		bool use_render_cache;
+		int max_patched_entities; //more entities moved than these and the list is collected from scratch
+		eRenderListState render_list_state;
+		int num_patched_entities;
+		bool render_list_valid;
+		sRenderListKey render_list_key;
+		struct sCachedEntity {
+			BaseEntity* entity;
+			int version;
+			bool moved;
+		};
+		std::vector<sCachedEntity> cached_entities;
+		std::vector<int> entity_num_rcs; //render calls of every entity of the scene in the last collect
+		std::vector<RenderCall> rc_collected; //the list after the frustum culling, before the occlusion and the sorting
+		std::vector<RenderCall> rc_patched;
+
+		//sorting of the render calls
+		bool use_sort_keys; //packed keys + radix sort, otherwise std::sort by distance
+		bool sort_stats; //also computes the switches that the distance sort would have
+		int shader_switches;
+		int material_switches;
+		int dist_shader_switches;
+		int dist_material_switches;
+		std::vector<sSortItem> sort_items;
+		std::vector<sSortItem> sort_tmp;
+		std::vector<Shader*> sort_shaders; //of every render call, while the keys are computed
+		std::vector<int> shader_ranks; //position of every id among the ones in the list, -1 if it is not used
+		std::vector<int> material_ranks;
+		std::vector<int> mesh_ranks;
+		std::vector<RenderCall> rc_sorted;
+
+		//cache of the GL state to skip redundant calls
+		GLState gl_state;
+		bool use_state_cache;
+
+		//instancing of render calls with the same mesh and material
+		bool use_instancing;
+
+		//uniform blocks, streamed every frame through the ring buffer (see ringbuffer.h)
+		std::vector<sLightData> lights_data;
+		int num_block_lights; //lights in the block, the first ones of light_entities (lights_data has all of them)
+		std::vector<Matrix44> instance_models;
+		int num_instanced_draws;
+		int num_instanced_rcs;
+
+		//lights that reach every render call, for the single and multi pass modes
+		ObjectLights object_lights;
+
+		//the render calls are recorded as draw packets by the worker threads and replayed on the GL thread
+		bool use_parallel_record;
+		float record_time; //ms
+		std::vector<sDrawPacket> draw_packets;
+		std::vector<sDrawGroup> draw_groups; //of every packet
+		std::vector<uint32> packet_lights;
+		std::vector< std::vector<uint32> > chunk_lights; //lights of the packets of every chunk, merged after the jobs
+		std::vector< std::vector<uint32> > chunk_marks;
+		std::vector<int> chunk_ends;
+
+		//depth of the opaque calls before the light passes of MULTI, then every light only shades the visible pixels (GL_EQUAL)
+		bool use_depth_prepass;
+		bool depth_prepass_done; //the packets being executed test against the pre-pass
+		long num_prepass_triangles;
+
+		//fragments that pass the depth test in the light passes of MULTI (the shaded ones), counted with a query read the next frame
+		GLuint fragments_query;
+		int fragments_query_prepass; //if the pending query was with the pre-pass (-1 none)
+		long num_fragments_shaded;
+		long fragments_shaded[2]; //last count without and with the pre-pass, to compare
+
+		//BLEND calls of the lit modes and the deferred drawn in any order into an accumulation and a revealage target
+		//(weighted blended order independent transparency) and composited over the opaque image
+		bool use_oit;
+		int num_transparent_rcs;
+		Texture* transparency_depth; //depth of the opaque image, tested in the shader (the targets have no depth)
+
+		//shadows of the spot and point lights, cached in an atlas while nothing moves
+		bool use_shadows;
+		ShadowAtlas shadow_atlas;
+
+		//deferred lighting of all the lights in one pass, binned in clusters on the CPU
+		bool use_light_clusters;
+		LightClusters light_clusters;
+
+		//frame time against number of lights, extra random lights are added to the visible ones
+		bool run_light_benchmark;
+		std::vector<LightEntity*> bench_lights;
+		int bench_num_lights;
 		
 		//ctor
 		Renderer();
@@ -84,15 +333,88 @@ namespace GTR {
 		void renderScene(GTR::Scene* scene, Camera* camera);
 
 		void collectRenderCalls(GTR::Scene* scene, Camera* camera);
+
+		//same as collectRenderCalls but splitting the entities across the worker threads
+		void collectRenderCallsParallel(GTR::Scene* scene, Camera* camera);
+
+		//same as collectRenderCalls but culling the nodes with the BVH
+		void collectRenderCallsBVH(GTR::Scene* scene, Camera* camera);
+
+		//visible lights, they are few and always collected again
+		void collectLights(GTR::Scene* scene, Camera* camera);
+
+		//checks the camera, the settings and the versions of the entities against the last list:
+		//-1 if it has to be collected again, otherwise the number of prefab entities that moved
+		int checkRenderList(GTR::Scene* scene, Camera* camera);
+
+		//keeps the collected list and what it depends on for the next frames
+		void storeRenderList(GTR::Scene* scene, Camera* camera);
+
+		//collects again the render calls of the entities that moved, the rest are copied from the last list
+		void patchRenderList(GTR::Scene* scene, Camera* camera);
+
+		void getRenderListKey(GTR::Scene* scene, Camera* camera, sRenderListKey& key);
+
+		//removes from rc_data_list the calls hidden behind the occluders
+		void occlusionCull(Camera* camera);
+
+		//thread safe version of getRCsfromNode, the global matrix of the parent is passed instead of stored in the node
+		void getRCsfromNodeTo(std::vector<RenderCall>& rcs, const Matrix44& prefab_model, const Matrix44& parent_global, GTR::Node* node, Camera* camera, std::vector<unsigned char>& lod_levels, int& lod_index);
 	
-		//to get a whole prefab (with all its nodes)
-		void getRCsfromPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
+		//to get a whole prefab (with all its nodes), lod_levels are the ones of the entity
+		void getRCsfromPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<unsigned char>& lod_levels);
+
+		//to get node from the prefab and its children, lod_index is the next node with mesh
+		void getRCsfromNode(const Matrix44& model, GTR::Node* node, Camera* camera, std::vector<unsigned char>& lod_levels, int& lod_index);
+
+		//level of detail of a mesh with this world box, level is the one of the last frame and gets the new one
+		Mesh* selectLOD(Mesh* mesh, const BoundingBox& world_bounding, Camera* camera, unsigned char& level);
+
+		//the BLEND calls of this mode go to the transparency pass instead of being sorted back to front
+		bool useTransparencyPass(eRenderMode mode);
+
+		//bilinear filter while a texture of the pool is drawn at the size of the window, nearest again after it
+		void setUpscaleFilter(Texture* texture, bool upscale);
+
+		//adds the pass that accumulates the BLEND calls (tested against depth) and the one that shows color with them on top
+		void addTransparencyPasses(std::vector<RenderCall>& rendercalls, Camera* camera, int color, int depth);
 
-		//to get node from the prefab and its children
-		void getRCsfromNode(const Matrix44& model, GTR::Node* node, Camera* camera);
+		//shader used to render a material in this mode (the instanced version reads the model from a vertex attribute)
+		Shader* getShader(eRenderMode mode, GTR::Material* material, bool instanced = false);
 
-		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterial(eRenderMode mode, const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		//fills the sort_key of every render call for this mode
+		void computeSortKeys(eRenderMode mode, Camera* camera);
+
+		//sorts rc_data_list using the keys (radix sort) or the old distance comparator
+		void sortRenderCalls(eRenderMode mode, Camera* camera);
+
+		//counts how many times the shader and the material change along the list
+		void countStateSwitches(std::vector<RenderCall>& rcs, int& shaders, int& materials);
+
+		//fill the per frame uniform blocks and bind them
+		void uploadCameraBlock(GTR::Scene* scene, Camera* camera);
+		void uploadLightsBlock();
+
+		//computes and uploads the lights of every render call of rc_data_list
+		void computeObjectLights();
+
+		//binds the block of the material, rebuilding it if the material changed
+		void bindMaterialBlock(GTR::Material* material);
+
+		//renders the list, consecutive opaque calls with the same mesh and material are drawn instanced
+		void renderRenderCalls(eRenderMode mode, std::vector<RenderCall>& rendercalls, Camera* camera);
+
+		//fills draw_packets from the list, one packet per mesh or group of instances, split in chunks across the threads
+		void recordRenderCalls(eRenderMode mode, std::vector<RenderCall>& rendercalls);
+
+		//resolves the textures and the lights of a draw (thread safe, lights and marks are the buffers of the chunk)
+		void recordPacket(eRenderMode mode, sDrawPacket& packet, std::vector<RenderCall>& rendercalls, const sDrawGroup& group, std::vector<uint32>& lights, std::vector<uint32>& marks);
+
+		//to render one packet given the list it was recorded from (GL thread)
+		void executePacket(eRenderMode mode, const sDrawPacket& packet, std::vector<RenderCall>& rendercalls);
+
+		//only the depth of the opaque packets (alpha masked ones discard like in the light passes)
+		void renderDepthPrepass(std::vector<RenderCall>& rendercalls);
 
 		
 
@@ -100,10 +422,41 @@ namespace GTR {
 
 		void renderDeferred(GTR::Scene* scene, std::vector <RenderCall>& rendercalls, Camera* camera);
 
+		//targets of a layout: color, normal, extra and depth (width 0 for the ones it doesn't use)
+		void getGBufferDescs(eGBufferLayout layout, FrameGraph::sTextureDesc* descs);
+		int getGBufferBytesPerPixel(eGBufferLayout layout);
+
+		//the shader of the atlas compiled for the current layout
+		Shader* getGBufferShader(const char* name);
+
+		//illumination pass of the deferred with a quad per directional light and a sphere per point light, a cone per spot (gbuffers: color, normal, extra, depth)
+		void renderDeferredLights(GTR::Scene* scene, Camera* camera, Texture** gbuffers);
+
+		//mesh and model of the volume of a point or spot light
+		Mesh* getLightVolume(LightEntity* light, Matrix44& model);
+
+		//the query of a light counts the pixels it shades (light_pixel_stats)
+		void beginLightQuery(int light);
+		void endLightQuery();
+		void readLightQueries();
+
+		//illumination pass of the deferred with the clusters, all the lights in one full-screen quad
+		void renderClusteredLights(GTR::Scene* scene, Camera* camera, Texture** gbuffers);
+
+		//renders some frames with more and more lights (with and without clusters) and prints the times
+		void benchmarkLights(GTR::Scene* scene, Camera* camera);
+
 		//to render lights in the scene 
-		void renderlights(eRenderMode mode, Shader* shader, Mesh* mesh, GTR::Material* material);
+		void renderlights(eRenderMode mode, const sDrawPacket& packet, const Matrix44* instance_models);
+
+		//updates the shadow atlas and renders the tiles that changed
+		void updateShadows(GTR::Scene* scene, Camera* camera);
+
+		//renders the casters of a tile of the shadow atlas (only depth)
+		void render2depthbuffer(ShadowAtlas::sTile& tile);
 
-		void render2depthbuffer(GTR::Material* material, Camera* camera);
+		//debug panel
+		void renderInMenu();
 	};
 
 	Texture* CubemapFromHDRE(const char* filename);
@@ -0,0 +1,207 @@
+#include "ringbuffer.h"
+#include <cassert>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+#define RING_DEFAULT_SIZE (1024 * 1024) //bytes of every part when created by Get
+
+RingBuffer* RingBuffer::instance = NULL;
+
+RingBuffer* RingBuffer::Get()
+{
+	if (!instance)
+	{
+		instance = new RingBuffer();
+		instance->create(RING_DEFAULT_SIZE);
+	}
+	return instance;
+}
+
+RingBuffer::RingBuffer()
+{
+	buffer_id = 0;
+	frame_size = 0;
+	persistent = false;
+	mapped = NULL;
+	part = 0;
+	offset = 0;
+	uniform_alignment = 256;
+	bytes_streamed = num_uploads = num_waits = num_grows = 0;
+	wait_time = 0;
+	frame_bytes = frame_uploads = frame_waits = 0;
+	frame_wait_time = 0;
+	for (int i = 0; i < RING_FRAMES; ++i)
+		fences[i] = 0;
+}
+
+RingBuffer::~RingBuffer()
+{
+	release();
+}
+
+//buffers mapped while the GPU uses them need GL 4.4 or the extension
+static bool hasBufferStorage()
+{
+#ifdef GL_MAP_PERSISTENT_BIT
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major > 4 || (major == 4 && minor >= 4))
+		return true;
+	GLint num_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for (int i = 0; i < num_extensions; ++i)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_buffer_storage") == 0)
+			return true;
+#endif
+	return false;
+}
+
+void RingBuffer::create(int frame_size)
+{
+	assert(frame_size > 0);
+	release();
+	this->frame_size = frame_size;
+	part = 0;
+	offset = 0;
+
+	GLint alignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	if (alignment > 0)
+		uniform_alignment = alignment;
+
+	glGenBuffers(1, &buffer_id);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+	persistent = hasBufferStorage();
+#ifdef GL_MAP_PERSISTENT_BIT
+	if (persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_WRITE_BUFFER, frame_size * RING_FRAMES, NULL, flags);
+		mapped = (Uint8*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, frame_size * RING_FRAMES, flags);
+		persistent = mapped != NULL;
+	}
+#endif
+	if (!persistent)
+		glBufferData(GL_COPY_WRITE_BUFFER, frame_size * RING_FRAMES, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void RingBuffer::release()
+{
+	if (buffer_id)
+	{
+		if (mapped)
+		{
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+			glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		}
+		//the GL keeps it alive until the draws that use it are done
+		glDeleteBuffers(1, &buffer_id);
+	}
+	for (int i = 0; i < RING_FRAMES; ++i)
+		if (fences[i])
+		{
+			glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+	buffer_id = 0;
+	mapped = NULL;
+	frame_size = 0;
+}
+
+//a new buffer with bigger parts, the draws of this frame that already use the old one still read from it
+void RingBuffer::grow(int min_size)
+{
+	int size = std::max(frame_size * 2, RING_DEFAULT_SIZE);
+	while (size < min_size)
+		size *= 2;
+
+	//the old one is deleted after creating the new one, so they never get the same id (the bindings are cached by id)
+	GLuint old_buffer = buffer_id;
+	bool old_mapped = mapped != NULL;
+	buffer_id = 0;
+	mapped = NULL;
+	int current = part;
+	create(size);
+	part = current;
+	if (old_mapped)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, old_buffer);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &old_buffer);
+	num_grows++;
+}
+
+int RingBuffer::upload(const void* data, int size, int alignment, int reserve)
+{
+	if (!buffer_id)
+		create(RING_DEFAULT_SIZE);
+	int used = std::max(size, reserve);
+	int start = (offset + alignment - 1) / alignment * alignment;
+	if (start + used > frame_size)
+	{
+		grow(used);
+		start = 0;
+	}
+
+	int position = part * frame_size + start;
+	if (persistent && size)
+		memcpy(mapped + position, data, size);
+	else if (size)
+	{
+		//nobody reads this range (the fence said so), no need to wait for the GPU
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_id);
+		void* ptr = glMapBufferRange(GL_COPY_WRITE_BUFFER, position, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+		if (ptr)
+		{
+			memcpy(ptr, data, size);
+			glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+
+	offset = start + used;
+	frame_bytes += size;
+	frame_uploads++;
+	return position;
+}
+
+void RingBuffer::nextFrame()
+{
+	if (!buffer_id)
+		return;
+
+	//everything written in this part is used by the commands before the fence
+	if (fences[part])
+		glDeleteSync(fences[part]);
+	fences[part] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	part = (part + 1) % RING_FRAMES;
+	offset = 0;
+
+	bytes_streamed = frame_bytes;
+	num_uploads = frame_uploads;
+	num_waits = frame_waits;
+	wait_time = frame_wait_time;
+	frame_bytes = frame_uploads = frame_waits = 0;
+	frame_wait_time = 0;
+
+	//the part of RING_FRAMES frames ago, usually done
+	GLsync fence = fences[part];
+	if (!fence)
+		return;
+	if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+	{
+		auto t0 = std::chrono::high_resolution_clock::now();
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		frame_waits++;
+		frame_wait_time += std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+	}
+	glDeleteSync(fence);
+	fences[part] = 0;
+}
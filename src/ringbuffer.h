@@ -0,0 +1,58 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include "includes.h"
+
+#define RING_FRAMES 3 //frames that can be in flight, each one writes in its own part of the buffer
+
+//RingBuffer
+//streaming buffer for the data that is uploaded every frame (instance models, per pass constants, debug geometry).
+//It is split in one part per frame in flight and every upload takes the next bytes of the part of the current frame,
+//so the buffer is never reallocated (orphaned) while the GPU reads it. A fence at the end of the frame guards the part,
+//it is only written again once the GPU has finished with it. The buffer stays mapped when the driver has ARB_buffer_storage.
+
+class RingBuffer {
+public:
+	GLuint buffer_id;
+	int frame_size; //bytes of every part
+	bool persistent; //mapped all the time (ARB_buffer_storage), otherwise every upload maps its range unsynchronized
+	Uint8* mapped;
+	int part; //part of the current frame
+	int offset; //bytes used in the part
+	int uniform_alignment; //offsets of the uniform blocks must be a multiple of this
+
+	//stats of the last frame
+	int bytes_streamed;
+	int num_uploads;
+	int num_waits; //the GPU was still reading the part
+	float wait_time; //ms
+	int num_grows; //total times the buffer was too small
+
+	RingBuffer();
+	~RingBuffer();
+
+	void create(int frame_size);
+	void release();
+
+	//copies the data in the current part and returns its offset in the buffer (aligned)
+	//reserve keeps more bytes than the ones written, for blocks whose arrays are not full
+	int upload(const void* data, int size, int alignment = 16, int reserve = 0);
+
+	//closes the frame with a fence and waits until the next part is free, call once per frame
+	void nextFrame();
+
+	//shared by the renderer and the meshes
+	static RingBuffer* Get();
+
+private:
+	static RingBuffer* instance;
+	GLsync fences[RING_FRAMES];
+	int frame_bytes; //stats of the frame being recorded
+	int frame_uploads;
+	int frame_waits;
+	float frame_wait_time;
+
+	void grow(int min_size);
+};
+
+#endif
@@ -57,6 +57,19 @@ bool GTR::Scene::load(const char* filename)
 	main_camera.center = readJSONVector3(json, "camera_target", main_camera.center);
 	main_camera.fov = readJSONNumber(json, "camera_fov", main_camera.fov);
 
+	//camera path of the benchmark
+	camera_path.clear();
+	cJSON* path_json = cJSON_GetObjectItemCaseSensitive(json, "camera_path");
+	cJSON* key_json;
+	cJSON_ArrayForEach(key_json, path_json)
+	{
+		Camera key;
+		key.eye = readJSONVector3(key_json, "position", main_camera.eye);
+		key.center = readJSONVector3(key_json, "target", main_camera.center);
+		key.fov = readJSONNumber(key_json, "fov", main_camera.fov);
+		camera_path.push_back(key);
+	}
+
 	//entities
 	cJSON* entities_json = cJSON_GetObjectItemCaseSensitive(json, "entities");
 	cJSON* entity_json;
@@ -133,6 +146,16 @@ GTR::BaseEntity* GTR::Scene::createEntity(std::string type)
 	return NULL;
 }
 
+bool GTR::BaseEntity::checkChanges()
+{
+	if (visible == last_visible && memcmp(model.m, last_model.m, sizeof(model.m)) == 0)
+		return false;
+	last_model = model;
+	last_visible = visible;
+	version++;
+	return true;
+}
+
 void GTR::BaseEntity::renderInMenu()
 {
 #ifndef SKIP_IMGUI
@@ -195,6 +218,8 @@ GTR::LightEntity::LightEntity() {
 	this->cone_angle = 0;
 	this->area_size = 0;
 	this->spot_exp = 0;
+	this->cast_shadows = false;
+	this->shadow_bias = 0.001;
 
 	this->light_camera.lookAt(this->model.getTranslation(), this->model * Vector3(0, 0, 1), this->model.rotateVector(Vector3(0, 1, 0)));
 
@@ -273,6 +298,10 @@ void GTR::LightEntity::configure(cJSON* json)
 		float cone_exp = cJSON_GetObjectItem(json, "cone_exp")->valuedouble;
 		this->spot_exp = cone_exp;
 	}
+	if (cJSON_GetObjectItem(json, "cast_shadows"))
+		this->cast_shadows = cJSON_IsTrue(cJSON_GetObjectItem(json, "cast_shadows"));
+	if (cJSON_GetObjectItem(json, "shadow_bias"))
+		this->shadow_bias = cJSON_GetObjectItem(json, "shadow_bias")->valuedouble;
 
 
 
@@ -305,6 +334,11 @@ void GTR::LightEntity::renderInMenu()
 			ImGui::SliderFloat("Spot cutoff", &spot_cutoff, 0, 90);
 
 		}
+
+		if (this->light_type != DIRECTIONAL) {
+			ImGui::Checkbox("Cast shadows", &cast_shadows);
+			ImGui::SliderFloat("Shadow bias", &shadow_bias, 0, 0.01);
+		}
 		
 	#endif
 }
\ No newline at end of file
@@ -38,9 +38,15 @@ namespace GTR {
 		eEntityType entity_type;
 		Matrix44 model;
 		bool visible;
-		BaseEntity() { entity_type = NONE; visible = true; }
+		int version; //changes every time the model or the visibility change (see checkChanges)
+		Matrix44 last_model; //the ones of the last check
+		bool last_visible;
+		BaseEntity() { entity_type = NONE; visible = true; version = 0; last_visible = true; }
 		virtual ~BaseEntity() {}
 
+		//compares the model and the visibility with the last check, true (and a new version) if they changed
+		bool checkChanges();
+
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json) {
 		};
@@ -52,6 +58,7 @@ namespace GTR {
 	public:
 		std::string filename;
 		Prefab* prefab;
+		std::vector<unsigned char> lod_levels; //level of detail of every node with mesh, in the order of the traversal (see Renderer::selectLOD)
 		
 		PrefabEntity();
 
@@ -83,7 +90,8 @@ namespace GTR {
 		Camera light_camera;
 
 		//FBO* shadow_fbo;
-		bool cast_shadows;
+		bool cast_shadows; //spot and point lights, in the shadow atlas of the renderer
+		float shadow_bias;
 
 		LightEntity();
 
@@ -106,6 +114,7 @@ namespace GTR {
 		Vector3 background_color;
 		Vector3 ambient_light;
 		Camera main_camera;
+		std::vector<Camera> camera_path; //keys of the camera flown by the benchmark (eye, center and fov)
 
 		Scene();
 
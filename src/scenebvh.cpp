@@ -0,0 +1,328 @@
+#include "scenebvh.h"
+#include "scene.h"
+#include "prefab.h"
+#include "camera.h"
+#include "mesh.h"
+#include <algorithm>
+
+using namespace GTR;
+
+//half of the surface of the box, the cost used to build the tree
+static inline float boxArea(const Vector3& min, const Vector3& max)
+{
+	Vector3 d = max - min;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+SceneBVH::SceneBVH()
+{
+	root = -1;
+	num_visited = num_drawn = 0;
+	num_rebuilds = num_refits = 0;
+	node_edits = -1;
+	build_cost = cost = 0;
+}
+
+void SceneBVH::clear()
+{
+	leaves.resize(0);
+	nodes.resize(0);
+	free_nodes.resize(0);
+	entities.resize(0);
+	root = -1;
+	cost = build_cost = 0;
+}
+
+bool SceneBVH::needsRebuild(GTR::Scene* scene)
+{
+	if (node_edits != Node::s_edits || entities.size() != scene->entities.size())
+		return true;
+
+	for (unsigned int i = 0; i < entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		sEntityInfo& info = entities[i];
+		void* prefab = ent->entity_type == PREFAB ? ((PrefabEntity*)ent)->prefab : NULL;
+		if (info.entity != ent || info.prefab != prefab || info.visible != ent->visible)
+			return true;
+	}
+
+	//the refits made the tree much worse than a new one
+	return cost > build_cost * 2.0f;
+}
+
+void SceneBVH::update(GTR::Scene* scene)
+{
+	if (needsRebuild(scene))
+	{
+		rebuild(scene);
+		return;
+	}
+
+	//refit the entities that moved
+	for (unsigned int i = 0; i < entities.size(); ++i)
+	{
+		sEntityInfo& info = entities[i];
+		if (!info.num_leaves || memcmp(info.model.m, info.entity->model.m, sizeof(info.model.m)) == 0)
+			continue;
+		info.model = info.entity->model;
+		int leaf = info.first_leaf;
+		computeLeaves(i, Matrix44(), &((PrefabEntity*)info.entity)->prefab->root, leaf);
+		for (int j = info.first_leaf; j < info.first_leaf + info.num_leaves; ++j)
+			refit(leaves[j].tree_node);
+		num_refits++;
+	}
+}
+
+void SceneBVH::rebuild(GTR::Scene* scene)
+{
+	clear();
+	node_edits = Node::s_edits;
+	num_rebuilds++;
+
+	entities.resize(scene->entities.size());
+	for (unsigned int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		sEntityInfo& info = entities[i];
+		info.entity = ent;
+		info.prefab = NULL;
+		info.model = ent->model;
+		info.visible = ent->visible;
+		info.first_leaf = leaves.size();
+		if (ent->entity_type == PREFAB)
+		{
+			PrefabEntity* pent = (PrefabEntity*)ent;
+			info.prefab = pent->prefab;
+			if (ent->visible && pent->prefab)
+				addLeaves(ent, Matrix44(), &pent->prefab->root);
+		}
+		info.num_leaves = leaves.size() - info.first_leaf;
+		for (int j = info.first_leaf; j < (int)leaves.size(); ++j)
+			leaves[j].index = j - info.first_leaf;
+	}
+
+	for (unsigned int i = 0; i < leaves.size(); ++i)
+		insertLeaf(i);
+	build_cost = cost;
+}
+
+//same operations as Renderer::getRCsfromNodeTo so the matrices and boxes are bit exact
+void SceneBVH::addLeaves(BaseEntity* entity, const Matrix44& parent_global, Node* node)
+{
+	if (!node->visible)
+		return;
+
+	Matrix44 global = node->parent ? node->model * parent_global : node->model;
+	if (node->mesh && node->material)
+	{
+		sLeaf leaf;
+		leaf.entity = entity;
+		leaf.node = node;
+		leaf.model = global * entity->model;
+		leaf.box = transformBoundingBox(leaf.model, node->mesh->box);
+		leaf.tree_node = -1;
+		leaves.push_back(leaf);
+	}
+
+	for (unsigned int i = 0; i < node->children.size(); ++i)
+		addLeaves(entity, global, node->children[i]);
+}
+
+//recomputes the leaves of an entity, the nodes are visited in the same order than addLeaves
+void SceneBVH::computeLeaves(int entity_index, const Matrix44& parent_global, Node* node, int& leaf)
+{
+	if (!node->visible)
+		return;
+
+	Matrix44 global = node->parent ? node->model * parent_global : node->model;
+	if (node->mesh && node->material)
+	{
+		sLeaf& l = leaves[leaf++];
+		l.model = global * entities[entity_index].model;
+		l.box = transformBoundingBox(l.model, node->mesh->box);
+	}
+
+	for (unsigned int i = 0; i < node->children.size(); ++i)
+		computeLeaves(entity_index, global, node->children[i], leaf);
+}
+
+int SceneBVH::allocNode()
+{
+	if (free_nodes.size())
+	{
+		int index = free_nodes.back();
+		free_nodes.pop_back();
+		return index;
+	}
+	nodes.push_back(sTreeNode());
+	return nodes.size() - 1;
+}
+
+//inserts next to the sibling that makes the tree grow less (surface area heuristic)
+void SceneBVH::insertLeaf(int leaf)
+{
+	sLeaf& l = leaves[leaf];
+	int index = allocNode();
+	sTreeNode& tn = nodes[index];
+	tn.min = l.box.center - l.box.halfsize;
+	tn.max = l.box.center + l.box.halfsize;
+	tn.parent = tn.left = tn.right = -1;
+	tn.leaf = leaf;
+	l.tree_node = index;
+
+	if (root == -1)
+	{
+		root = index;
+		return;
+	}
+
+	Vector3 leaf_min = tn.min;
+	Vector3 leaf_max = tn.max;
+
+	//go down choosing the cheapest child
+	int sibling = root;
+	while (nodes[sibling].leaf == -1)
+	{
+		sTreeNode& n = nodes[sibling];
+		Vector3 umin = n.min, umax = n.max;
+		umin.setMin(leaf_min);
+		umax.setMax(leaf_max);
+		float area = boxArea(n.min, n.max);
+		float combined = boxArea(umin, umax);
+
+		//cost of making a new parent here, and what every level below pays for growing this one
+		float here = 2.0f * combined;
+		float inheritance = 2.0f * (combined - area);
+
+		float child_cost[2];
+		int children[2] = { n.left, n.right };
+		for (int c = 0; c < 2; ++c)
+		{
+			sTreeNode& child = nodes[children[c]];
+			Vector3 cmin = child.min, cmax = child.max;
+			cmin.setMin(leaf_min);
+			cmax.setMax(leaf_max);
+			child_cost[c] = boxArea(cmin, cmax) + inheritance;
+			if (child.leaf == -1)
+				child_cost[c] -= boxArea(child.min, child.max);
+		}
+
+		if (here < child_cost[0] && here < child_cost[1])
+			break;
+		sibling = child_cost[0] < child_cost[1] ? children[0] : children[1];
+	}
+
+	//new parent for the sibling and the leaf
+	int old_parent = nodes[sibling].parent;
+	int parent = allocNode();
+	sTreeNode& p = nodes[parent];
+	p.parent = old_parent;
+	p.left = sibling;
+	p.right = index;
+	p.leaf = -1;
+	p.min = nodes[sibling].min;
+	p.max = nodes[sibling].max;
+	p.min.setMin(leaf_min);
+	p.max.setMax(leaf_max);
+	cost += boxArea(p.min, p.max);
+
+	if (old_parent == -1)
+		root = parent;
+	else if (nodes[old_parent].left == sibling)
+		nodes[old_parent].left = parent;
+	else
+		nodes[old_parent].right = parent;
+	nodes[sibling].parent = parent;
+	nodes[index].parent = parent;
+
+	refit(nodes[parent].parent);
+}
+
+//recomputes the box of a node (the leaf box for leaves) and of all its parents
+void SceneBVH::refit(int tree_node)
+{
+	while (tree_node != -1)
+	{
+		sTreeNode& n = nodes[tree_node];
+		if (n.leaf != -1)
+		{
+			BoundingBox& box = leaves[n.leaf].box;
+			n.min = box.center - box.halfsize;
+			n.max = box.center + box.halfsize;
+		}
+		else
+		{
+			float old_area = boxArea(n.min, n.max);
+			n.min = nodes[n.left].min;
+			n.max = nodes[n.left].max;
+			n.min.setMin(nodes[n.right].min);
+			n.max.setMax(nodes[n.right].max);
+			cost += boxArea(n.min, n.max) - old_area;
+		}
+		tree_node = n.parent;
+	}
+}
+
+void SceneBVH::addSubtree(int tree_node, std::vector<int>& result)
+{
+	num_visited++;
+	sTreeNode& n = nodes[tree_node];
+	if (n.leaf != -1)
+	{
+		result.push_back(n.leaf);
+		return;
+	}
+	addSubtree(n.left, result);
+	addSubtree(n.right, result);
+}
+
+void SceneBVH::cull(Camera* camera, std::vector<int>& result)
+{
+	result.resize(0);
+	num_visited = 0;
+	if (root == -1)
+	{
+		num_drawn = 0;
+		return;
+	}
+
+	stack.resize(0);
+	stack.push_back(root);
+	while (stack.size())
+	{
+		int index = stack.back();
+		stack.pop_back();
+		sTreeNode& n = nodes[index];
+
+		if (n.leaf != -1)
+		{
+			//same test as the render calls without tree
+			num_visited++;
+			BoundingBox& box = leaves[n.leaf].box;
+			if (camera->testBoxInFrustum(box.center, box.halfsize))
+				result.push_back(n.leaf);
+			continue;
+		}
+
+		num_visited++;
+		//a bit bigger so the rounding never rejects a child that would pass its own test
+		Vector3 center = (n.min + n.max) * 0.5f;
+		Vector3 halfsize = (n.max - center) * 1.0001f;
+		char clip = camera->testBoxInFrustum(center, halfsize);
+		if (clip == CLIP_OUTSIDE)
+			continue;
+		if (clip == CLIP_INSIDE)
+		{
+			num_visited--; //counted again by addSubtree
+			addSubtree(index, result);
+			continue;
+		}
+		stack.push_back(n.right);
+		stack.push_back(n.left);
+	}
+
+	//leaves are numbered in scene order
+	std::sort(result.begin(), result.end());
+	num_drawn = result.size();
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include "framework.h"
+#include <vector>
+
+//forward declarations
+class Camera;
+
+namespace GTR {
+
+	class Scene;
+	class BaseEntity;
+	class Node;
+
+	// Dynamic AABB tree with the world bounds of every node (with mesh) of the prefabs of the scene.
+	// It is kept between frames: moving an entity only refits the boxes of its leaves and their parents,
+	// it is only rebuilt when entities are added, removed, hidden or their prefab is edited.
+	// The culling goes down the tree, so a subtree outside the frustum is rejected with one test
+	// and a subtree fully inside is accepted without testing its children.
+	class SceneBVH
+	{
+	public:
+		//one per node with mesh and material of every visible prefab entity, in the order of the scene
+		struct sLeaf {
+			BaseEntity* entity;
+			Node* node;
+			Matrix44 model; //world matrix of the node
+			BoundingBox box; //world box of the mesh
+			int tree_node;
+			int index; //of the leaf in its entity, the same as the nodes visited by the renderer (PrefabEntity::lod_levels)
+		};
+
+		struct sTreeNode {
+			Vector3 min;
+			Vector3 max;
+			int parent;
+			int left;
+			int right;
+			int leaf; //-1 for inner nodes
+		};
+
+		std::vector<sLeaf> leaves;
+		std::vector<sTreeNode> nodes;
+		int root;
+
+		//stats
+		int num_visited; //tree nodes touched by the last cull
+		int num_drawn; //leaves that passed
+		int num_rebuilds;
+		int num_refits;
+
+		SceneBVH();
+
+		//checks what changed in the scene since the last call: refits moved entities or rebuilds everything
+		void update(GTR::Scene* scene);
+
+		//indices of the leaves inside the frustum, sorted so the order is the same as walking the scene
+		void cull(Camera* camera, std::vector<int>& result);
+
+		void clear();
+
+	private:
+		//what the tree knows about every entity, to detect changes
+		struct sEntityInfo {
+			BaseEntity* entity;
+			void* prefab;
+			Matrix44 model;
+			bool visible;
+			int first_leaf;
+			int num_leaves;
+		};
+		std::vector<sEntityInfo> entities;
+		int node_edits; //Node::s_edits when it was built
+		float build_cost; //sum of the areas of the inner nodes after the build
+		float cost; //the same, updated with the refits
+		std::vector<int> free_nodes;
+		std::vector<int> stack;
+
+		bool needsRebuild(GTR::Scene* scene);
+		void rebuild(GTR::Scene* scene);
+		void addLeaves(BaseEntity* entity, const Matrix44& parent_global, Node* node);
+		void computeLeaves(int entity_index, const Matrix44& parent_global, Node* node, int& leaf);
+		int allocNode();
+		void insertLeaf(int leaf);
+		void refit(int tree_node);
+		void addSubtree(int tree_node, std::vector<int>& result);
+	};
+
+};
@@ -11,6 +11,7 @@
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
+std::map<std::string, int> Shader::s_uniform_blocks;
 
 
 //typedef unsigned int GLhandle;
@@ -56,12 +57,14 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std:: map < std::string , Shader* > Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+int Shader::s_num_shaders = 0;
 
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
 	vs = fs = 0;
+	id = s_num_shaders++;
 	compiled = false;
 	from_atlas = false;
 }
@@ -133,6 +136,77 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 	return sh;
 }
 
+//the macros go after the #version line, it must be the first one
+static std::string insertMacros(const std::string& code, const std::string& macros)
+{
+	size_t pos = code.find("#version");
+	if (pos == std::string::npos)
+		return macros + "\n" + code;
+	pos = code.find('\n', pos);
+	if (pos == std::string::npos)
+		return code + "\n" + macros + "\n";
+	return code.substr(0, pos + 1) + macros + "\n" + code.substr(pos + 1);
+}
+
+Shader* Shader::GetVariant(const char* name, const char* macros)
+{
+	if (!macros || !macros[0])
+		return Get(name);
+
+	std::string variant_name = std::string(name) + "#" + macros;
+	std::map<std::string, Shader*>::iterator it = s_Shaders.find(variant_name);
+	if (it != s_Shaders.end())
+		return it->second;
+
+	Shader* base = Get(name);
+	if (!base || !base->from_atlas)
+		return NULL;
+
+	Shader* sh = new Shader();
+	sh->vs_filename = base->vs_filename;
+	sh->ps_filename = base->ps_filename;
+	sh->macros = macros;
+	sh->from_atlas = true;
+	if (!sh->compileVariant())
+	{
+		std::cout << " * Compilation error in shader variant: " << name << std::endl;
+		delete sh;
+		return NULL;
+	}
+	s_Shaders[variant_name] = sh;
+	return sh;
+}
+
+bool Shader::compileVariant()
+{
+	std::string vs_code = s_shaders_atlas[vs_filename];
+	std::string fs_code = s_shaders_atlas[ps_filename];
+	if (!vs_code.size() || !fs_code.size())
+		return false;
+	return compileFromMemory(insertMacros(vs_code, macros), insertMacros(fs_code, macros));
+}
+
+void Shader::registerUniformBlock(const char* name, int binding)
+{
+	s_uniform_blocks[name] = binding;
+
+	//shaders already compiled
+	for (std::map<std::string, Shader*>::iterator it = s_Shaders.begin(); it != s_Shaders.end(); it++)
+		if (it->second->compiled)
+			it->second->bindUniformBlocks();
+}
+
+void Shader::bindUniformBlocks()
+{
+	for (std::map<std::string, int>::iterator it = s_uniform_blocks.begin(); it != s_uniform_blocks.end(); it++)
+	{
+		GLuint index = glGetUniformBlockIndex(program, it->first.c_str());
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, it->second);
+	}
+	assert(glGetError() == GL_NO_ERROR);
+}
+
 void Shader::ReloadAll()
 {
 	for( std::map<std::string,Shader*>::iterator it = s_Shaders.begin(); it!=s_Shaders.end();it++)
@@ -267,6 +341,11 @@ bool Shader::LoadAtlas(const char* filename)
 		std::cout << " + Shader from atlas: " << name << std::endl;
 	}
 
+	//the variants (GetVariant) with the new code
+	for (std::map<std::string, Shader*>::iterator it = s_Shaders.begin(); it != s_Shaders.end(); it++)
+		if (it->second->from_atlas && it->second->macros.size() && !it->second->compileVariant())
+			std::cout << " * Compilation error in shader variant: " << it->first << std::endl;
+
 	return true;
 }
 
@@ -339,6 +418,7 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 #endif
 
 	compiled = true;
+	bindUniformBlocks();
 
 	return true;
 }
@@ -28,6 +28,8 @@ class Shader
 
 public:
 	static Shader* current;
+	static int s_num_shaders;
+	int id; //unique small number, used in the sort keys of the renderer
 
 	Shader();
 	virtual ~Shader();
@@ -112,6 +114,8 @@ public:
 	void setMacros(const char * macros);
 
 	static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
+	//a shader of the atlas compiled with some #defines after the #version (cached by name and macros, rebuilt with the atlas)
+	static Shader* GetVariant(const char* name, const char* macros);
 	static void ReloadAll();
 	static std::map<std::string,Shader*> s_Shaders;
 
@@ -123,6 +127,11 @@ public:
 
 	static Shader* getDefaultShader(std::string name);
 
+	//uniform blocks: every shader declaring a block with this name reads it from that binding point
+	static std::map<std::string, int> s_uniform_blocks;
+	static void registerUniformBlock(const char* name, int binding);
+	void bindUniformBlocks();
+
 protected:
 
 	std::string info_log;
@@ -131,6 +140,8 @@ protected:
 	std::string macros;
 	bool from_atlas;
 
+	bool compileVariant();
+
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
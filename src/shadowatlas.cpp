@@ -0,0 +1,317 @@
+#include "shadowatlas.h"
+#include "scene.h"
+#include "scenebvh.h"
+#include "prefab.h"
+#include "mesh.h"
+#include "material.h"
+#include <chrono>
+#include <algorithm>
+
+using namespace GTR;
+
+ShadowAtlas::ShadowAtlas(int size)
+{
+	this->size = size;
+	max_tile = size / 4;
+	min_tile = size >> (SHADOW_ATLAS_LEVELS - 1);
+	use_cache = true;
+	frame = 0;
+	num_shadows = num_tiles = num_rendered = num_failed = 0;
+	update_time = 0;
+	free_tiles[0].push_back(std::make_pair(0, 0));
+}
+
+float ShadowAtlas::screenCoverage(Camera* camera, const Vector3& position, float radius)
+{
+	if (camera->type != Camera::PERSPECTIVE)
+		return 1.0f;
+	float dist = (position - camera->eye).length();
+	if (dist <= radius)
+		return 1.0f;
+	//projected radius against half the height of the screen
+	float coverage = radius / (dist * tan(camera->fov * 0.5f * DEG2RAD));
+	return std::min(coverage, 1.0f);
+}
+
+//takes a free square of the level or splits a bigger one
+bool ShadowAtlas::allocTile(int level, int& x, int& y)
+{
+	if (level < 0)
+		return false;
+	std::vector< std::pair<int, int> >& free_list = free_tiles[level];
+	if (free_list.size())
+	{
+		x = free_list.back().first;
+		y = free_list.back().second;
+		free_list.pop_back();
+		return true;
+	}
+	if (!allocTile(level - 1, x, y))
+		return false;
+	int half = size >> level;
+	free_list.push_back(std::make_pair(x + half, y + half));
+	free_list.push_back(std::make_pair(x, y + half));
+	free_list.push_back(std::make_pair(x + half, y));
+	return true;
+}
+
+//gives back the square, merging it with its three buddies when all of them are free
+void ShadowAtlas::freeTile(int level, int x, int y)
+{
+	std::vector< std::pair<int, int> >& free_list = free_tiles[level];
+	if (level > 0)
+	{
+		int parent_size = size >> (level - 1);
+		int px = x - x % parent_size;
+		int py = y - y % parent_size;
+		int half = size >> level;
+		int found[3];
+		int num_found = 0;
+		for (int i = 0; i < (int)free_list.size(); ++i)
+		{
+			std::pair<int, int>& t = free_list[i];
+			if ((t.first == px || t.first == px + half) && (t.second == py || t.second == py + half) && !(t.first == x && t.second == y))
+				found[num_found++] = i;
+			if (num_found == 3)
+				break;
+		}
+		if (num_found == 3)
+		{
+			//remove from the end so the indices are still valid
+			for (int i = 2; i >= 0; --i)
+			{
+				free_list[found[i]] = free_list.back();
+				free_list.pop_back();
+			}
+			freeTile(level - 1, px, py);
+			return;
+		}
+	}
+	free_list.push_back(std::make_pair(x, y));
+}
+
+bool ShadowAtlas::allocShadow(sShadow& shadow, int level)
+{
+	shadow.level = level;
+	for (int i = 0; i < shadow.num_tiles; ++i)
+	{
+		if (allocTile(level, shadow.tiles[i].x, shadow.tiles[i].y))
+		{
+			shadow.tiles[i].size = size >> level;
+			shadow.tiles[i].dirty = true;
+			continue;
+		}
+		for (int j = 0; j < i; ++j)
+			freeTile(level, shadow.tiles[j].x, shadow.tiles[j].y);
+		shadow.level = -1;
+		return false;
+	}
+	return true;
+}
+
+void ShadowAtlas::freeShadow(sShadow& shadow)
+{
+	if (shadow.level == -1)
+		return;
+	for (int i = 0; i < shadow.num_tiles; ++i)
+		freeTile(shadow.level, shadow.tiles[i].x, shadow.tiles[i].y);
+	shadow.level = -1;
+}
+
+//the cameras of a spot (its cone) or a point light (the faces of a cube, same order as get_shadow)
+void ShadowAtlas::setupCameras(sShadow& shadow)
+{
+	LightEntity* light = shadow.light;
+	Vector3 pos = light->model.getTranslation();
+	float near_plane = light->max_dist * 0.01f;
+
+	if (light->light_type == SPOT)
+	{
+		Camera& camera = shadow.tiles[0].camera;
+		Vector3 front = light->model.frontVector();
+		Vector3 up = light->model.topVector();
+		camera.lookAt(pos, pos + front, up);
+		camera.setPerspective(std::min(light->cone_angle * 2.0f, 150.0f), 1.0f, near_plane, light->max_dist);
+		return;
+	}
+
+	static const Vector3 dirs[6] = { Vector3(1, 0, 0), Vector3(-1, 0, 0), Vector3(0, 1, 0), Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1) };
+	static const Vector3 ups[6] = { Vector3(0, 1, 0), Vector3(0, 1, 0), Vector3(0, 0, -1), Vector3(0, 0, 1), Vector3(0, 1, 0), Vector3(0, 1, 0) };
+	for (int i = 0; i < 6; ++i)
+	{
+		Camera& camera = shadow.tiles[i].camera;
+		camera.lookAt(pos, pos + dirs[i], ups[i]);
+		camera.setPerspective(90.0f, 1.0f, near_plane, light->max_dist);
+	}
+}
+
+//what is inside the frustum, and where it is
+uint64 ShadowAtlas::hashCasters(SceneBVH* bvh, std::vector<int>& casters)
+{
+	//FNV-1a
+	uint64 hash = 14695981039346656037ULL;
+	int num_casters = 0;
+	for (unsigned int i = 0; i < casters.size(); ++i)
+	{
+		SceneBVH::sLeaf& leaf = bvh->leaves[casters[i]];
+		if (leaf.node->material->alpha_mode == BLEND)
+			continue;
+		casters[num_casters++] = casters[i];
+		const void* parts[3] = { leaf.node, leaf.node->mesh, leaf.node->material };
+		const uint8* bytes[2] = { (const uint8*)parts, (const uint8*)leaf.model.m };
+		int sizes[2] = { sizeof(parts), sizeof(leaf.model.m) };
+		for (int b = 0; b < 2; ++b)
+			for (int k = 0; k < sizes[b]; ++k)
+				hash = (hash ^ bytes[b][k]) * 1099511628211ULL;
+	}
+	casters.resize(num_casters);
+	return hash ^ num_casters;
+}
+
+void ShadowAtlas::update(Camera* camera, const std::vector<LightEntity*>& lights, SceneBVH* bvh)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+	frame++;
+
+	if (!fbo.fbo_id)
+	{
+		fbo.setDepthOnly(size, size);
+		data_tbo.create(GL_RGBA32F);
+	}
+
+	light_tiles.assign(lights.size(), -1);
+	render_tiles.resize(0);
+	data.resize(0);
+	num_shadows = num_tiles = num_rendered = num_failed = 0;
+
+	//the lights that can cast shadows and their entry in shadows (created the first time)
+	std::vector<int> order;
+	for (unsigned int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		if (!light->cast_shadows || light->light_type == DIRECTIONAL)
+			continue;
+		order.push_back(i);
+	}
+
+	std::vector<int> light_shadow(lights.size(), -1);
+	for (unsigned int n = 0; n < order.size(); ++n)
+	{
+		int i = order[n];
+		LightEntity* light = lights[i];
+		int index = -1;
+		for (int s = 0; s < (int)shadows.size(); ++s)
+			if (shadows[s].light == light)
+				index = s;
+		if (index == -1)
+		{
+			shadows.push_back(sShadow());
+			index = shadows.size() - 1;
+			sShadow& shadow = shadows.back();
+			shadow.light = light;
+			shadow.level = shadow.wanted_level = -1;
+			shadow.num_tiles = 0;
+			shadow.last_frame = 0;
+			shadow.max_dist = shadow.cone_angle = -1;
+		}
+		light_shadow[i] = index;
+		shadows[index].last_frame = frame;
+	}
+
+	//tile size from the coverage of the light, a point light splits it in six faces
+	for (unsigned int n = 0; n < order.size(); ++n)
+	{
+		int i = order[n];
+		LightEntity* light = lights[i];
+		sShadow& shadow = shadows[light_shadow[i]];
+		int num = light->light_type == POINT ? 6 : 1;
+		float coverage = screenCoverage(camera, light->model.getTranslation(), light->max_dist);
+		int tile_size = std::max((int)(max_tile * coverage) / (num == 6 ? 2 : 1), min_tile);
+		int level = 0;
+		while ((size >> (level + 1)) >= tile_size && level < SHADOW_ATLAS_LEVELS - 1)
+			level++;
+
+		bool changed = memcmp(shadow.light_model.m, light->model.m, sizeof(shadow.light_model.m)) != 0 || shadow.max_dist != light->max_dist || shadow.cone_angle != light->cone_angle || shadow.num_tiles != num;
+		if (shadow.wanted_level == level && shadow.level != -1 && !changed)
+			continue;
+
+		if (shadow.wanted_level != level || shadow.level == -1 || shadow.num_tiles != num)
+		{
+			freeShadow(shadow);
+			shadow.num_tiles = num;
+			shadow.wanted_level = level;
+			//no space: remove the shadows of lights not visible this frame, then try smaller tiles
+			while (!allocShadow(shadow, level))
+			{
+				int oldest = -1;
+				for (int s = 0; s < (int)shadows.size(); ++s)
+					if (shadows[s].level != -1 && shadows[s].last_frame != frame && (oldest == -1 || shadows[s].last_frame < shadows[oldest].last_frame))
+						oldest = s;
+				if (oldest != -1)
+					freeShadow(shadows[oldest]);
+				else if (level < SHADOW_ATLAS_LEVELS - 1)
+					level++;
+				else
+					break;
+			}
+		}
+		shadow.light_model = light->model;
+		shadow.max_dist = light->max_dist;
+		shadow.cone_angle = light->cone_angle;
+		setupCameras(shadow);
+		for (int t = 0; t < shadow.num_tiles; ++t)
+			shadow.tiles[t].dirty = true;
+	}
+
+	//casters of every tile, the culling for the shadows doesn't count in the stats of the tree
+	int num_visited = bvh->num_visited;
+	int num_drawn = bvh->num_drawn;
+	for (unsigned int i = 0; i < lights.size(); ++i)
+	{
+		if (light_shadow[i] == -1)
+			continue;
+		sShadow& shadow = shadows[light_shadow[i]];
+		if (shadow.level == -1)
+		{
+			num_failed++;
+			continue;
+		}
+
+		light_tiles[i] = data.size() / 20;
+		for (int t = 0; t < shadow.num_tiles; ++t)
+		{
+			sTile& tile = shadow.tiles[t];
+			bvh->cull(&tile.camera, tile.casters);
+			uint64 hash = hashCasters(bvh, tile.casters);
+			if (tile.dirty || hash != tile.casters_hash || !use_cache)
+			{
+				tile.casters_hash = hash;
+				tile.dirty = false;
+				render_tiles.push_back(&tile);
+			}
+
+			data.insert(data.end(), tile.camera.viewprojection_matrix.m, tile.camera.viewprojection_matrix.m + 16);
+			data.push_back((float)tile.x);
+			data.push_back((float)tile.y);
+			data.push_back((float)tile.size);
+			data.push_back(shadow.light->shadow_bias);
+		}
+		num_shadows++;
+		num_tiles += shadow.num_tiles;
+	}
+	bvh->num_visited = num_visited;
+	bvh->num_drawn = num_drawn;
+	num_rendered = render_tiles.size();
+
+	update_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+}
+
+void ShadowAtlas::upload()
+{
+	//the shader can't fetch from empty buffers
+	static const float empty[20] = { 0 };
+	if (data.size())
+		data_tbo.update(&data[0], data.size() * sizeof(float));
+	else
+		data_tbo.update(empty, sizeof(empty));
+}
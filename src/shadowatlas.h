@@ -0,0 +1,89 @@
+#pragma once
+#include "framework.h"
+#include "camera.h"
+#include "fbo.h"
+#include "ubo.h"
+#include <vector>
+
+namespace GTR {
+
+	class LightEntity;
+	class SceneBVH;
+
+	#define SHADOW_ATLAS_LEVELS 8 //tile sizes: atlas size >> level
+
+	// All the shadow maps of the spot and point lights (one tile per spot, six per point light) packed in one depth texture.
+	// The size of the tiles depends on how much of the screen the light can cover, they are allocated as squares
+	// of power of two sizes (buddy allocator), so they keep their place while the light doesn't change.
+	// A tile is only rendered again when its light changes or something inside its frustum moves,
+	// the casters are found with the scene BVH and compared with the ones of the last render.
+	class ShadowAtlas
+	{
+	public:
+		//one shadow map inside the atlas
+		struct sTile {
+			int x;
+			int y;
+			int size;
+			Camera camera;
+			uint64 casters_hash; //casters inside the frustum when it was rendered
+			bool dirty;
+			std::vector<int> casters; //leaves of the BVH inside the frustum (only valid the frame it is updated)
+		};
+
+		struct sShadow {
+			LightEntity* light;
+			int level; //size of the tiles (-1 without space)
+			int wanted_level; //size from the coverage, the tiles can be smaller when the atlas is full
+			int num_tiles; //1 spot, 6 point
+			sTile tiles[6];
+			//the light when the tiles were rendered
+			Matrix44 light_model;
+			float max_dist;
+			float cone_angle;
+			int last_frame; //last frame the light was visible
+		};
+
+		int size; //pixels of the side of the atlas
+		int max_tile; //biggest tile, for a light that covers the whole screen
+		int min_tile;
+		bool use_cache; //if false every tile is rendered every frame
+
+		FBO fbo;
+		TBO data_tbo; //5 texels per tile of this frame: viewprojection and (x, y, size, bias)
+		std::vector<float> data;
+		std::vector<int> light_tiles; //first tile in data of every light (-1 without shadow)
+		std::vector<sTile*> render_tiles; //tiles that must be rendered this frame
+		std::vector<sShadow> shadows;
+
+		//stats
+		int num_shadows; //lights with shadow this frame
+		int num_tiles;
+		int num_rendered;
+		int num_failed; //lights without space in the atlas
+		float update_time; //ms
+
+		ShadowAtlas(int size = 4096);
+
+		//allocates the tiles of the lights and finds the ones that must be rendered (render_tiles)
+		void update(Camera* camera, const std::vector<LightEntity*>& lights, SceneBVH* bvh);
+
+		//uploads the data of the tiles of this frame
+		void upload();
+
+		//how big the light is on the screen (0..1)
+		static float screenCoverage(Camera* camera, const Vector3& position, float radius);
+
+	private:
+		int frame;
+		std::vector< std::pair<int, int> > free_tiles[SHADOW_ATLAS_LEVELS];
+
+		bool allocTile(int level, int& x, int& y);
+		void freeTile(int level, int x, int y);
+		bool allocShadow(sShadow& shadow, int level);
+		void freeShadow(sShadow& shadow);
+		void setupCameras(sShadow& shadow);
+		uint64 hashCasters(SceneBVH* bvh, std::vector<int>& casters);
+	};
+
+};
@@ -0,0 +1,108 @@
+#include "ubo.h"
+#include <cassert>
+
+UBO::UBO()
+{
+	ubo_id = 0;
+	size = 0;
+}
+
+UBO::~UBO()
+{
+	release();
+}
+
+void UBO::release()
+{
+	if (ubo_id)
+		glDeleteBuffers(1, &ubo_id);
+	ubo_id = 0;
+	size = 0;
+}
+
+void UBO::create(int size, const void* data)
+{
+	assert(size > 0);
+	if (!ubo_id)
+		glGenBuffers(1, &ubo_id);
+	this->size = size;
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+	glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void UBO::update(const void* data, int size, int offset)
+{
+	assert(ubo_id && "create the UBO first");
+	if (size == -1)
+		size = this->size;
+	assert(offset + size <= this->size);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+	glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void UBO::bind(int binding)
+{
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo_id);
+}
+
+TBO::TBO()
+{
+	buffer_id = 0;
+	texture_id = 0;
+	internal_format = 0;
+	size = 0;
+}
+
+TBO::~TBO()
+{
+	release();
+}
+
+void TBO::release()
+{
+	if (texture_id)
+		glDeleteTextures(1, &texture_id);
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+	texture_id = buffer_id = 0;
+	size = 0;
+}
+
+void TBO::create(GLenum internal_format)
+{
+	this->internal_format = internal_format;
+	if (!buffer_id)
+		glGenBuffers(1, &buffer_id);
+	if (!texture_id)
+		glGenTextures(1, &texture_id);
+	size = 0;
+}
+
+void TBO::update(const void* data, int size)
+{
+	assert(buffer_id && "create the TBO first");
+	if (size <= 0)
+		return;
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer_id);
+	if (size > this->size)
+	{
+		//realloc and attach again to the texture
+		glBufferData(GL_TEXTURE_BUFFER, size, data, GL_DYNAMIC_DRAW);
+		this->size = size;
+		glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+		glTexBuffer(GL_TEXTURE_BUFFER, internal_format, buffer_id);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+	else
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void TBO::bind(int unit)
+{
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_BUFFER, texture_id);
+}
@@ -0,0 +1,52 @@
+#ifndef UBO_H
+#define UBO_H
+
+#include "includes.h"
+
+//binding points of the uniform blocks used by the renderer (the shaders get them when linked)
+enum eUBOBinding {
+	UBO_CAMERA = 0,
+	UBO_LIGHTS = 1,
+	UBO_MATERIAL = 2,
+	UBO_MAX_BINDINGS = 8
+};
+
+//UniformBufferObject
+//a block of uniforms stored in GPU memory, shared by all the shaders that declare it (std140 layout)
+
+class UBO {
+public:
+	GLuint ubo_id;
+	int size;
+
+	UBO();
+	~UBO();
+
+	void create(int size, const void* data = NULL);
+	void update(const void* data, int size = -1, int offset = 0);
+	void bind(int binding); //binds it to the binding point of the block
+
+	void release();
+};
+
+//TextureBufferObject
+//a buffer read from the shaders as a 1D texture with texelFetch (samplerBuffer), no size limit like the UBOs
+
+class TBO {
+public:
+	GLuint buffer_id;
+	GLuint texture_id;
+	GLenum internal_format; //GL_RGBA32F, GL_R32UI, ...
+	int size;
+
+	TBO();
+	~TBO();
+
+	void create(GLenum internal_format);
+	void update(const void* data, int size); //grows the buffer if needed
+	void bind(int unit);
+
+	void release();
+};
+
+#endif
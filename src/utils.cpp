@@ -4,6 +4,10 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
 #endif
 
 #include "includes.h"
@@ -12,6 +16,7 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
+#include "ringbuffer.h"
 
 #include "extra/stb_easy_font.h"
 
@@ -137,6 +142,72 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+#ifdef WIN32
+	//the view keeps the file mapped, the handles are not needed after it
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	if (data)
+		size = (size_t)file_size.QuadPart;
+#else
+	//the mapping stays valid after closing the descriptor
+	int fd = ::open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+	{
+		void* address = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address != MAP_FAILED)
+		{
+			data = (const char*)address;
+			size = (size_t)info.st_size;
+		}
+	}
+	::close(fd);
+#endif
+	return data != NULL;
+}
+
+void MappedFile::close()
+{
+	if (data)
+	{
+#ifdef WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, size);
+#endif
+	}
+	data = NULL;
+	size = 0;
+}
+
 bool checkGLErrors()
 {
 	#ifndef _DEBUG
@@ -225,10 +296,14 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale )
 	glLoadMatrixf(projection_matrix.m);
 
 	glColor3f(c.x, c.y, c.z);
+	RingBuffer* ring = RingBuffer::Get();
+	int offset = ring->upload(buffer, num_quads * 4 * 16);
+	glBindBuffer(GL_ARRAY_BUFFER, ring->buffer_id);
 	glEnableClientState(GL_VERTEX_ARRAY);
-	glVertexPointer(2, GL_FLOAT, 16, buffer);
+	glVertexPointer(2, GL_FLOAT, 16, (void*)(size_t)offset);
 	glDrawArrays(GL_QUADS, 0, num_quads * 4);
 	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	glPopMatrix();
 	glMatrixMode(GL_MODELVIEW);
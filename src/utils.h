@@ -19,6 +19,19 @@ float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
 
+//file mapped in memory (read only), the system reads its pages when they are used and they are never copied
+class MappedFile {
+public:
+	const char* data;
+	size_t size;
+
+	MappedFile();
+	~MappedFile();
+
+	bool open(const char* filename);
+	void close();
+};
+
 //generic purposes fuctions
 void drawGrid();
 bool drawText(float x, float y, std::string text, Vector3 c, float scale = 1);